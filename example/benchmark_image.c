@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "glad/glad.h"
+
+#define LIGHTMAPPER_IMPLEMENTATION
+#include "../lightmapper.h"
+
+// usage: benchmark_image <min|max|add|scale|power|dilate|dilaten|smooth|denoise|downsample|ftoub|pipeline|all> [size] [iterations]
+// runs the lmImage* kernels on a synthetic size x size RGBA lightmap with unpopulated (zero) regions.
+
+static void fillLightmap(float *image, int w, int h)
+{
+	unsigned int seed = 1;
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			float *p = image + ((size_t)y * w + x) * 4;
+			lm_bool populated = ((x / 37) + (y / 23)) % 4 != 0;
+			for (int i = 0; i < 4; i++)
+			{
+				seed = seed * 1664525u + 1013904223u;
+				p[i] = populated ? (float)(seed >> 8) / 16777216.0f : 0.0f;
+			}
+		}
+	}
+}
+
+static void runKernel(const char *kernel, const float *image, float *outImage, unsigned char *outImageUB, int w, int h)
+{
+	if      (!strcmp(kernel, "min"       )) { volatile float v = lmImageMin(image, w, h, 4, LM_ALL_CHANNELS); (void)v; }
+	else if (!strcmp(kernel, "max"       )) { volatile float v = lmImageMax(image, w, h, 4, LM_ALL_CHANNELS); (void)v; }
+	else if (!strcmp(kernel, "add"       )) lmImageAdd(outImage, w, h, 4, 0.0f, LM_ALL_CHANNELS);
+	else if (!strcmp(kernel, "scale"     )) lmImageScale(outImage, w, h, 4, 1.0f, LM_ALL_CHANNELS);
+	else if (!strcmp(kernel, "power"     )) lmImagePower(outImage, w, h, 4, 1.0f, LM_ALL_CHANNELS);
+	else if (!strcmp(kernel, "dilate"    )) lmImageDilate(image, outImage, w, h, 4);
+	else if (!strcmp(kernel, "dilaten"   )) lmImageDilateN(image, outImage, w, h, 4, 16);
+	else if (!strcmp(kernel, "smooth"    )) lmImageSmooth(image, outImage, w, h, 4);
+	else if (!strcmp(kernel, "denoise"   )) lmImageDenoise(image, outImage, w, h, 4, NULL, NULL, 3, 0.03f, 0.0f, 0.0f);
+	else if (!strcmp(kernel, "downsample")) lmImageDownsample(image, outImage, w, h, 4);
+	else if (!strcmp(kernel, "ftoub"     )) lmImageFtoUB(image, outImageUB, w, h, 4, 0.0f);
+	else if (!strcmp(kernel, "pipeline"  ))
+	{
+		// same operations as the example postprocessing
+		const lm_image_op ops[] = {
+			{ LM_IMAGE_OP_DILATE_N, 16.0f },
+			{ LM_IMAGE_OP_SMOOTH },
+			{ LM_IMAGE_OP_POWER, 1.0f / 2.2f, 0x7 },
+			{ LM_IMAGE_OP_FTOUB, 1.0f }
+		};
+		lmImageProcess(image, NULL, outImageUB, w, h, 4, ops, sizeof(ops) / sizeof(ops[0]));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *kernels[] = { "min", "max", "add", "scale", "power", "dilate", "dilaten", "smooth", "denoise", "downsample", "ftoub", "pipeline" };
+	const char *kernel = argc > 1 ? argv[1] : "all";
+	int size = argc > 2 ? atoi(argv[2]) : 4096;
+	int iterations = argc > 3 ? atoi(argv[3]) : 10;
+	if (size <= 0 || iterations <= 0)
+	{
+		fprintf(stderr, "invalid size or iteration count\n");
+		return 1;
+	}
+
+	size_t count = (size_t)size * size * 4;
+	float *image = (float*)calloc(count, sizeof(float));
+	float *outImage = (float*)calloc(count, sizeof(float));
+	unsigned char *outImageUB = (unsigned char*)calloc(count, sizeof(unsigned char));
+	if (!image || !outImage || !outImageUB)
+	{
+		fprintf(stderr, "could not allocate a %dx%d lightmap\n", size, size);
+		return 1;
+	}
+	fillLightmap(image, size, size);
+	memcpy(outImage, image, count * sizeof(float)); // the in-place kernels work on outImage
+
+	lm_bool found = LM_FALSE;
+	for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++)
+	{
+		if (strcmp(kernel, "all") && strcmp(kernel, kernels[k]))
+			continue;
+		runKernel(kernels[k], image, outImage, outImageUB, size, size); // warm up
+		double start = lm_time();
+		for (int i = 0; i < iterations; i++)
+			runKernel(kernels[k], image, outImage, outImageUB, size, size);
+		double ms = (lm_time() - start) * 1000.0 / iterations;
+		printf("%-10s %dx%d RGBA: %8.2f ms (%7.1f Mpixels/s)\n", kernels[k], size, size, ms, (double)size * size / (ms * 1000.0));
+		found = LM_TRUE;
+	}
+	if (!found)
+		fprintf(stderr, "unknown kernel: %s\n", kernel);
+
+	free(image);
+	free(outImage);
+	free(outImageUB);
+	return found ? 0 : 1;
+}
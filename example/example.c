@@ -1,6 +1,7 @@
 #define _USE_MATH_DEFINES
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include "glad/glad.h"
@@ -57,8 +58,8 @@ static int bake(scene_t *scene)
 	}
 
 	int w = scene->w, h = scene->h;
-	float *data = calloc(w * h * 4, sizeof(float));
-	lmSetTargetLightmap(ctx, data, w, h, 4);
+	unsigned short *data = calloc(w * h * 4, sizeof(unsigned short)); // half floats are precise enough and halve the memory
+	lmSetTargetLightmapEx(ctx, data, LM_HALF_FLOAT, w, h, 4);
 
 	lmSetGeometry(ctx, NULL,                                                                 // no transformation in this example
 		LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
@@ -90,30 +91,117 @@ static int bake(scene_t *scene)
 
 	lmDestroy(ctx);
 
-	// postprocess texture
-	float *temp = calloc(w * h * 4, sizeof(float));
-	for (int i = 0; i < 16; i++)
-	{
-		lmImageDilate(data, temp, w, h, 4);
-		lmImageDilate(temp, data, w, h, 4);
-	}
-	lmImageSmooth(data, temp, w, h, 4);
-	lmImageDilate(temp, data, w, h, 4);
-	lmImagePower(data, w, h, 4, 1.0f / 2.2f, 0x7); // gamma correct color channels
-	free(temp);
+	// postprocess texture (tile by tile, straight to 8bit/channel)
+	const lm_image_op ops[] = {
+		{ LM_IMAGE_OP_DILATE_N, 33.0f },
+		{ LM_IMAGE_OP_SMOOTH },
+		{ LM_IMAGE_OP_POWER, 1.0f / 2.2f, 0x7 }, // gamma correct color channels
+		{ LM_IMAGE_OP_FTOUB, 1.0f }
+	};
+	unsigned char *result = calloc(w * h * 4, sizeof(unsigned char));
+	lmImageProcessEx(data, LM_HALF_FLOAT, result, LM_UNSIGNED_BYTE, w, h, 4, ops, sizeof(ops) / sizeof(ops[0]));
+	free(data);
 
 	// save result to a file
-	if (lmImageSaveTGAf("result.tga", data, w, h, 4, 1.0f))
+	if (lmImageSaveTGAub("result.tga", result, w, h, 4))
 		printf("Saved result.tga\n");
 
 	// upload result
 	glBindTexture(GL_TEXTURE_2D, scene->lightmap);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_FLOAT, data);
-	free(data);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, result);
+	free(result);
 
 	return 1;
 }
 
+static void benchmark(scene_t *scene)
+{
+	// compare the hemisphere throughput of different hemisphere batch sizes
+	const int batchSizes[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 }, { 8, 8 }, { 16, 16 }, { 0, 0 } }; // { 0, 0 } => derived from GL limits
+	int w = scene->w, h = scene->h;
+	float *data = calloc(w * h * 4, sizeof(float));
+	for (int i = 0; i < (int)(sizeof(batchSizes) / sizeof(batchSizes[0])); i++)
+	{
+		lm_create_params params = {0};
+		params.batchHemisphereCountX = batchSizes[i][0];
+		params.batchHemisphereCountY = batchSizes[i][1];
+		lm_context *ctx = lmCreateEx(64, 0.001f, 100.0f, 1.0f, 1.0f, 1.0f, 2, 0.01f, 0.0f, &params);
+		if (!ctx)
+		{
+			fprintf(stderr, "Error: Could not initialize lightmapper.\n");
+			break;
+		}
+
+		memset(data, 0, w * h * 4 * sizeof(float));
+		lmSetTargetLightmap(ctx, data, w, h, 4);
+		lmSetGeometry(ctx, NULL,
+			LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
+			LM_NONE , NULL                                                   , 0               ,
+			LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, t), sizeof(vertex_t),
+			scene->indexCount, LM_UNSIGNED_SHORT, scene->indices);
+
+		double startTime = glfwGetTime();
+		int vp[4];
+		float view[16], projection[16];
+		while (lmBegin(ctx, vp, view, projection))
+		{
+			glViewport(vp[0], vp[1], vp[2], vp[3]);
+			drawScene(scene, view, projection);
+			lmEnd(ctx);
+		}
+		glFinish();
+		double duration = glfwGetTime() - startTime;
+
+		lm_statistics statistics;
+		lmGetStatistics(ctx, &statistics);
+		lmDestroy(ctx);
+
+		char name[16];
+		if (batchSizes[i][0])
+			sprintf(name, "%dx%d", batchSizes[i][0], batchSizes[i][1]);
+		else
+			sprintf(name, "auto");
+		printf("batch %-5s: %7u hemispheres in %6.2fs = %8.1f hemispheres/s (%u batches, %.3fs readback stalls, %u failed readbacks)\n",
+			name, statistics.hemispheres, duration, statistics.hemispheres / duration,
+			statistics.batches, statistics.readbackStallSeconds, statistics.readbackFailures);
+	}
+	free(data);
+}
+
+static void benchmarkPreparation(scene_t *scene)
+{
+	// time the rasterization of the geometry into texel samples at several lightmap sizes.
+	// build with -DLM_NO_SIMD to compare against clipping every texel exactly.
+	const int sizes[] = { 654, 1024, 2048 };
+	lm_create_params params = {0};
+	params.threadCount = 1;
+	lm_context *ctx = lmCreateEx(64, 0.001f, 100.0f, 1.0f, 1.0f, 1.0f, 2, 0.01f, 0.0f, &params);
+	if (!ctx)
+	{
+		fprintf(stderr, "Error: Could not initialize lightmapper.\n");
+		return;
+	}
+
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+	{
+		lmSetTargetLightmap(ctx, NULL, sizes[i], sizes[i], 4); // preparing the geometry doesn't touch the lightmap
+		const int iterations = 5;
+		double startTime = glfwGetTime();
+		for (int j = 0; j < iterations; j++)
+		{
+			lm_prepared_geometry *geometry = lmPrepareGeometry(ctx, NULL,
+				LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, p), sizeof(vertex_t),
+				LM_NONE , NULL                                                   , 0               ,
+				LM_FLOAT, (unsigned char*)scene->vertices + offsetof(vertex_t, t), sizeof(vertex_t),
+				scene->indexCount, LM_UNSIGNED_SHORT, scene->indices);
+			lmDestroyPreparedGeometry(geometry);
+		}
+		double duration = (glfwGetTime() - startTime) / iterations;
+		printf("prepare %4dx%-4d: %8.2fms (1 thread)\n", sizes[i], sizes[i], duration * 1000.0);
+	}
+	lmDestroy(ctx);
+}
+
 static void error_callback(int error, const char *description)
 {
 	fprintf(stderr, "Error: %s\n", description);
@@ -189,6 +277,16 @@ int main(int argc, char* argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (argc > 1 && strcmp(argv[1], "-benchmark") == 0)
+	{
+		benchmarkPreparation(&scene);
+		benchmark(&scene);
+		destroyScene(&scene);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return EXIT_SUCCESS;
+	}
+
 	printf("Ambient Occlusion Baking Example.\n");
 	printf("Use your mouse and the W, A, S, D, E, Q keys to navigate.\n");
 	printf("Press SPACE to start baking one light bounce!\n");
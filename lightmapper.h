@@ -20,6 +20,8 @@
 #define LM_DEFAULT_VALUE(value)
 #endif
 
+#include <stddef.h> // size_t
+
 #ifndef LM_CALLOC
 #define LM_CALLOC(count, size) calloc(count, size)
 #endif
@@ -28,6 +30,14 @@
 #define LM_FREE(ptr) free(ptr)
 #endif
 
+#ifndef LM_MAX_THREADS
+#define LM_MAX_THREADS 64 // maximum number of threads used for the geometry preparation and the image post processing. define LM_NO_THREADS to do everything on the calling thread
+#endif
+
+#ifndef LM_READBACK_BUFFERS
+#define LM_READBACK_BUFFERS 16 // maximum number of hemisphere batches that can be in flight between the GPU and the CPU
+#endif
+
 typedef int lm_bool;
 #define LM_FALSE 0
 #define LM_TRUE  1
@@ -37,7 +47,13 @@ typedef int lm_type;
 #define LM_UNSIGNED_BYTE  GL_UNSIGNED_BYTE
 #define LM_UNSIGNED_SHORT GL_UNSIGNED_SHORT
 #define LM_UNSIGNED_INT   GL_UNSIGNED_INT
+#define LM_BYTE           GL_BYTE
+#define LM_SHORT          GL_SHORT
+#define LM_INT            GL_INT
+#define LM_HALF_FLOAT     GL_HALF_FLOAT
 #define LM_FLOAT          GL_FLOAT
+#define LM_RGB9_E5        GL_UNSIGNED_INT_5_9_9_9_REV     // packed RGB with a shared exponent (only target lightmaps and images, c = 3)
+#define LM_R11F_G11F_B10F GL_UNSIGNED_INT_10F_11F_11F_REV // packed unsigned RGB floats (only target lightmaps and images, c = 3)
 
 typedef struct lm_context lm_context;
 
@@ -56,21 +72,123 @@ lm_context *lmCreate(
 	                                                                                                   // > 0.0f => improves gradients on surfaces with interpolated normals due to the flat surface horizon,
 	                                                                                                   // but may introduce other artifacts.
 
+// optional: extended creation parameters. zero-initialize the struct and only set the fields you need.
+typedef struct lm_create_params
+{
+	int batchHemisphereCountX, batchHemisphereCountY;                                                  // number of hemispheres rendered and integrated together per batch.
+	                                                                                                   // 0 => as many as fit into the batch memory budget and the GL texture/renderbuffer/viewport limits.
+	int batchMemoryBudget;                                                                             // GPU memory for the hemisphere batch framebuffers in MB (0 => 32 MB).
+	lm_bool disableComputeIntegration;                                                                 // always integrate hemispheres with the fragment shader downsampling chain,
+	                                                                                                   // even if compute shaders (GL 4.3) are available.
+	int threadCount;                                                                                   // number of threads that rasterize the geometry into texel samples (0 => number of CPU cores).
+	lm_bool spatialSampleOrder;                                                                        // render the hemispheres of each pass along a 3D morton curve through their positions instead of in triangle order.
+	                                                                                                   // nearby hemispheres end up in the same batch, which improves GPU cache use and per-batch culling (see lmGetBatchBounds).
+	lm_bool normalSampleOrder;                                                                         // with spatialSampleOrder: group the hemispheres by the octant of their normal first.
+	lm_bool adaptiveSampling;                                                                          // instead of the fixed interpolation passes, render the texels with the highest estimated interpolation error first
+	                                                                                                   // (in rounds, since the estimates depend on the rendered results) and interpolate all others.
+	                                                                                                   // the interpolation passes only define the coarse grid that is always rendered and the interpolation neighbors.
+	unsigned int sampleBudget;                                                                         // with adaptiveSampling or irradianceCaching: maximum number of hemispheres per mesh (0 => no limit).
+	                                                                                                   // texels that can't be interpolated at all stay empty once the budget is used up (see lmImageDilate).
+	float errorTarget;                                                                                 // with adaptiveSampling: stop when no texel has a higher estimated interpolation error (0 => interpolationThreshold).
+	float interpolationMaxNormalAngle;                                                                 // geometry-aware interpolation: only interpolate if the normals of the texel and its interpolation neighbors
+	                                                                                                   // differ by at most this angle in degrees (0 => disabled). catches creases. typical: 30.
+	float interpolationMaxPositionError;                                                               // only interpolate if the average position of the interpolation neighbors is closer to the texel position
+	                                                                                                   // than this fraction of their distance to it (0 => disabled). catches folds and depth discontinuities. typical: 0.1.
+	float interpolationMaxHitDistanceFraction;                                                         // only interpolate if the texel is closer to its interpolation neighbors than this fraction of their mean hit distance
+	                                                                                                   // (harmonic mean of the depths seen by their hemispheres, 0 => disabled). catches contact shadows. typical: 0.1.
+	                                                                                                   // needs an additional integration of the hemisphere depth buffers.
+	                                                                                                   // with the geometry-aware interpolation, higher interpolation thresholds and more passes are usually safe.
+	lm_bool chartInterpolation;                                                                        // interpolate from neighbors anywhere in the same UV chart (triangles connected by shared lightmap coords)
+	                                                                                                   // instead of only within the rasterizer bounds of the texel's own triangle.
+	                                                                                                   // the pass grid is aligned to the lightmap instead of the triangles. saves many hemispheres on finely tessellated meshes.
+	lm_bool irradianceCaching;                                                                         // instead of interpolating between grid neighbors, extrapolate all texels from nearby rendered hemispheres (irradiance cache records
+	                                                                                                   // with a validity radius from their mean hit distance and translational gradients from the surrounding records).
+	                                                                                                   // the interpolation passes define the coarsest record spacing (2^passes texels). finer passes only render the texels
+	                                                                                                   // that no record is valid for. interpolationThreshold is unused. needs an additional integration of the hemisphere depth buffers.
+	                                                                                                   // saves most on large smooth surfaces, where a single record covers many coarse grid steps.
+	float irradianceCacheAccuracy;                                                                     // with irradianceCaching: records are valid up to this error estimate (distance / validity radius + normal deviation, 0 => 0.3).
+	                                                                                                   // lower values render more hemispheres.
+	void *(*allocate)(size_t size, void *userdata);                                                    // optional memory allocation functions for the lightmapper instance and its prepared geometries (NULL => LM_CALLOC/LM_FREE).
+	void (*deallocate)(void *memory, void *userdata);                                                  // allocate has to return memory aligned like malloc, but doesn't have to zero it. both are never called concurrently,
+	void *allocatorUserdata;                                                                           // but also from the geometry preparation threads.
+	                                                                                                   // allocate may return NULL: lmCreateEx and lmPrepareGeometry then fail and return NULL, all other functions expect it to succeed.
+	int poolMemoryLimit;                                                                               // freed memory is kept in size classes and reused for the next allocations, so that baking many similar meshes
+	                                                                                                   // doesn't allocate anymore after the first ones. maximum of unused memory kept in MB (0 => 64 MB, < 0 => no pooling).
+} lm_create_params;
+lm_context *lmCreateEx(
+	int hemisphereSize, float zNear, float zFar,                                                       // same as lmCreate.
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold,
+	float cameraToSurfaceDistanceModifier,
+	const lm_create_params *params);                                                                   // extended parameters or NULL (defaults).
+
 // optional: set material characteristics by specifying cos(theta)-dependent weights for incoming light.
 typedef float (*lm_weight_func)(float cos_theta, void *userdata);
 void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata);                        // precalculates weights for incoming light depending on its angle. (default: all weights are 1.0f)
 
 // specify an output lightmap image buffer with w * h * c * sizeof(float) bytes of memory.
 void lmSetTargetLightmap(lm_context *ctx, float *outLightmap, int w, int h, int c);                    // output HDR lightmap (linear 32bit float channels; c: 1->Greyscale, 2->Greyscale+Alpha, 3->RGB, 4->RGBA).
+void lmSetTargetLightmapEx(lm_context *ctx, void *outLightmap, lm_type type, int w, int h, int c);     // same with LM_FLOAT, LM_HALF_FLOAT (w * h * c * 2 bytes) or LM_RGB9_E5, LM_R11F_G11F_B10F (w * h * 4 bytes, c = 3)
+                                                                                                       // channels. the type is also the one for uploading the buffer with glTexImage2D.
+
+// optional: out-of-core target lightmaps for atlases that don't fit into memory. the lightmap is kept in a memory mapped file
+// in tiles of LM_TILE_SIZE x LM_TILE_SIZE texels, so that the texels of a triangle (or an image tile) only touch a few pages.
+#define LM_TILE_SIZE 64 // texels per side of the tiles of mapped and sparse images (and of the sparse per texel data of the lightmapper)
+typedef struct lm_mapped_image lm_mapped_image;
+lm_mapped_image *lmMapImage(const char *filename, int w, int h, int c);                                // opens a file that was mapped with the same size before (keeps its content)
+                                                                                                       // or creates a new zero initialized one. returns NULL on failure.
+void lmUnmapImage(lm_mapped_image *image);                                                             // the image stays in the file.
+void lmMappedImageRead(const lm_mapped_image *image, int x, int y, int w, int h, float *out);          // copy a w x h rectangle at x, y from/to a linear w * h * c float image.
+void lmMappedImageWrite(lm_mapped_image *image, int x, int y, int w, int h, const float *in);
+void lmSetTargetLightmapMapped(lm_context *ctx, lm_mapped_image *lightmap);                            // same as lmSetTargetLightmap. the image has to stay mapped while it is the target.
+
+// optional: sparse target lightmaps for atlases that are mostly empty. only the tiles (LM_TILE_SIZE x LM_TILE_SIZE texels) that contain
+// texels of the geometry are allocated, so the memory and the postprocessing (see lmImageProcessSparse) scale with the covered area.
+typedef struct lm_sparse_image lm_sparse_image;
+lm_sparse_image *lmCreateSparseImage(int w, int h, int c);                                             // all texels are zero and no tiles are allocated.
+void lmDestroySparseImage(lm_sparse_image *image);
+const float *lmSparseImageTile(const lm_sparse_image *image, int tx, int ty);                          // tile tx, ty (LM_TILE_SIZE^2 * c floats in rows) or NULL if all its texels are zero.
+int lmSparseImageTileCount(const lm_sparse_image *image);                                              // allocated tiles.
+void lmSparseImageRead(const lm_sparse_image *image, int x, int y, int w, int h, float *out);          // copy a w x h rectangle at x, y from/to a linear w * h * c float image.
+void lmSparseImageWrite(lm_sparse_image *image, int x, int y, int w, int h, const float *in);           // only allocates tiles for non-zero texels.
+void lmSetTargetLightmapSparse(lm_context *ctx, lm_sparse_image *lightmap);                            // same as lmSetTargetLightmap.
 
 // set the geometry to map to the currently set target lightmap (set the target lightmap before calling this!).
 void lmSetGeometry(lm_context *ctx,
 	const float *transformationMatrix,                                                                 // 4x4 object-to-world transform for the geometry or NULL (no transformation).
-	lm_type positionsType, const void *positionsXYZ, int positionsStride,                              // triangle mesh in object space.
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,                              // triangle mesh in object space (integer types are not normalized).
 	lm_type normalsType, const void *normalsXYZ, int normalsStride,                                    // optional normals for the mesh in object space (Use LM_NONE type in case you only need flat surfaces).
-	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,                // lightmap atlas texture coordinates for the mesh [0..1]x[0..1] (integer types are normalized to 0..1 range).
+	                                                                                                   // LM_FLOAT, LM_HALF_FLOAT or signed normalized LM_BYTE/LM_SHORT/LM_INT.
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,                // lightmap atlas texture coordinates for the mesh [0..1]x[0..1] (integer types are normalized to 0..1 or -1..1 range).
 	int count, lm_type indicesType LM_DEFAULT_VALUE(LM_NONE), const void *indices LM_DEFAULT_VALUE(0));// if mesh indices are used, count = number of indices else count = number of vertices.
 
+// optional: rasterize the geometry into its list of lightmap texel samples once and reuse it for multiple bakes (e.g. bounces).
+// lmSetGeometry does the same internally, but throws the samples away with the next lmSetGeometry call.
+typedef struct lm_prepared_geometry lm_prepared_geometry;
+lm_prepared_geometry *lmPrepareGeometry(lm_context *ctx,                                                // the texel samples are prepared for the size of the currently set target lightmap.
+	const float *transformationMatrix,                                                                 // same parameters as lmSetGeometry.
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type normalsType, const void *normalsXYZ, int normalsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType LM_DEFAULT_VALUE(LM_NONE), const void *indices LM_DEFAULT_VALUE(0));
+void lmSetPreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry);                      // use instead of lmSetGeometry. the geometry must stay alive until the lightmap is finished.
+void lmDestroyPreparedGeometry(lm_prepared_geometry *geometry);
+void lmGetPreparedGeometryGuides(const lm_prepared_geometry *geometry,                                 // optional: world space guides for lmImageDenoise. only the texels covered by the mesh are written,
+	float *outPositions, float *outNormals);                                                           // so the guides of all meshes of an atlas can be gathered into the same zero-initialized w * h * 3 float images (or NULL).
+
+// optional: bake many meshes (e.g. thousands of small props) with a single lmBegin/lmEnd (or lmBeginBatch/lmEndBatch) loop.
+// the passes of the queued meshes are done side by side, so the hemispheres of different meshes share the batches and the results
+// are only waited for once per pass instead of once per pass of every mesh. each mesh is baked into the target lightmap
+// that was set when it was queued (they can also share one). meshes that cover the same lightmap texels shouldn't be queued together.
+void lmQueueGeometry(lm_context *ctx,                                                                  // same parameters as lmSetGeometry. the first queued mesh replaces the geometry set with lmSetGeometry.
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type normalsType, const void *normalsXYZ, int normalsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType LM_DEFAULT_VALUE(LM_NONE), const void *indices LM_DEFAULT_VALUE(0));
+void lmQueuePreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry);                   // same for prepared geometry. the geometry and the target lightmap must stay alive until lmBegin returns false.
+	                                                                                                   // the next lmBegin loop bakes all queued meshes and empties the queue. lmProgress covers the whole queue.
+
 
 // as long as lmBegin returns true, the scene has to be rendered with the
 // returned camera and view parameters to the currently bound framebuffer.
@@ -80,11 +198,62 @@ lm_bool lmBegin(lm_context *ctx,
 	float* outView4x4,                                                                                 // output of the current camera view matrix.
 	float* outProjection4x4);                                                                          // output of the current camera projection matrix.
 
+// optional: instead of lmBegin, render all five sides of a hemisphere with a single draw call.
+// the sides have to be rendered with the returned viewport array (GL 4.1 or GL_ARB_viewport_array),
+// e.g. by selecting gl_ViewportIndex and the side's matrices per primitive in a geometry shader with 5 invocations
+// or per instance in the vertex shader (GL_ARB_shader_viewport_layer_array) with glDrawElementsInstanced(..., 5).
+// if lmBeginHemisphere returns true, it must be followed by lmEnd after rendering!
+// lmBegin and lmBeginHemisphere should not be mixed within the same bake.
+lm_bool lmBeginHemisphere(lm_context *ctx,
+	float* outViewports5x4,                                                                            // output of the viewports of the five sides: { x, y, w, h } each. use these to call glViewportArrayv(0, 5, ...)!
+	float* outViews5x4x4,                                                                              // output of the camera view matrices of the five sides.
+	float* outProjections5x4x4);                                                                       // output of the camera projection matrices of the five sides.
+
 float lmProgress(lm_context *ctx);                                                                     // should only be called between lmBegin/lmEnd!
                                                                                                        // provides the light mapping progress as a value increasing from 0.0 to 1.0.
 
 void lmEnd(lm_context *ctx);
 
+// optional: instead of lmBegin, render a whole batch of hemispheres with one instanced draw call per scene object.
+// lmBeginBatch gathers the next hemispheres of the current pass (up to the batch size, also from the next queued meshes) and stores the cameras
+// of all their sides (instance = hemisphere * 5 + side) in a GL buffer object as an array of
+//     struct { mat4 view; mat4 projection; vec4 clipRect; } // 36 floats, same layout in std140 and std430
+// which can be bound as shader storage buffer, RGBA32F texture buffer (9 texels per side) or instanced vertex attributes.
+// the projections already map each side into the whole batch framebuffer, so the sides have to be clipped
+// to their rectangles (in normalized device coordinates: { minX, minY, maxX, maxY }) with GL_CLIP_DISTANCE0-3:
+//     vec4 p = projection * (view * position);
+//     gl_ClipDistance[0] = p.x - clipRect.x * p.w; gl_ClipDistance[1] = clipRect.z * p.w - p.x;
+//     gl_ClipDistance[2] = p.y - clipRect.y * p.w; gl_ClipDistance[3] = clipRect.w * p.w - p.y;
+// and every scene object has to be rendered with 5 * (returned hemisphere count) instances.
+// returns the number of hemispheres in the batch (0 => done). if it returns > 0, it must be followed by lmEndBatch after rendering!
+int lmBeginBatch(lm_context *ctx,
+	int* outViewport4,                                                                                 // output of the batch framebuffer viewport: { 0, 0, w, h }. use these to call glViewport()!
+	unsigned int* outCamerasBuffer);                                                                   // output of the GL buffer object with the cameras of all hemisphere sides in the batch.
+void lmEndBatch(lm_context *ctx);
+
+// optional: bounds of the hemispheres in the current batch (only valid between lmBeginBatch and lmEndBatch) to cull the scene once per batch.
+// scene objects can only be visible if they intersect the sphere grown by zFar and if some of their points p satisfy
+// dot(normalize(p - hemisphere position), axis) >= cos(acos(cosHalfAngle) + 90 degrees), e.g. with a normal cone/bounding sphere test.
+void lmGetBatchBounds(lm_context *ctx,
+	float* outSphere4,                                                                                 // output of the bounding sphere of the hemisphere camera positions: { x, y, z, radius }.
+	float* outNormalCone4);                                                                            // output of the cone around the hemisphere directions: { axis x, y, z, cosHalfAngle } (cosHalfAngle = -1 => no bound).
+
+// optional: statistics about the work done by the lightmapper instance since its creation.
+typedef struct lm_statistics
+{
+	unsigned int hemispheres;                                                                          // number of rendered hemispheres.
+	unsigned int batches;                                                                              // number of integrated hemisphere batches.
+	unsigned int readbackStalls;                                                                       // number of times the CPU had to wait for a batch readback.
+	double readbackStallSeconds;                                                                       // total time the CPU spent waiting for batch readbacks.
+	unsigned int readbackFailures;                                                                     // number of batch readbacks that couldn't be mapped. their results are lost (asserts in debug builds).
+	unsigned int geometryRejections;                                                                   // number of texels that were rendered because of the geometry-aware interpolation.
+	unsigned int heapAllocations;                                                                      // number of memory blocks allocated with the allocation functions (see lm_create_params) for the instance and its prepared geometries.
+	unsigned int pooledAllocations;                                                                    // number of allocations that reused a freed block instead. only these grow once a bake is in a steady state.
+	size_t pooledBytes;                                                                                // unused memory currently kept for reuse.
+	unsigned int glAllocations;                                                                        // number of GL buffer and texture storage allocations.
+} lm_statistics;
+void lmGetStatistics(lm_context *ctx, lm_statistics *outStatistics);
+
 // destroys the lightmapper instance. should be called to free resources.
 void lmDestroy(lm_context *ctx);
 
@@ -97,13 +266,53 @@ void lmImageAdd(float *image, int w, int h, int c, float value, int m LM_DEFAULT
 void lmImageScale(float *image, int w, int h, int c, float factor, int m LM_DEFAULT_VALUE(LM_ALL_CHANNELS));           // in-place scaling of the specified channels
 void lmImagePower(float *image, int w, int h, int c, float exponent, int m LM_DEFAULT_VALUE(LM_ALL_CHANNELS));         // in-place powf(v, exponent) of the specified channels (for gamma)
 void lmImageDilate(const float *image, float *outImage, int w, int h, int c);                                          // widen the populated non-zero areas by 1 pixel.
+void lmImageDilateN(const float *image, float *outImage, int w, int h, int c, int radius);                             // widen the populated non-zero areas by radius pixels (< 0 => until the image is full)
+                                                                                                                       // by copying the (euclidean) nearest populated pixel. costs the same for any radius.
 void lmImageSmooth(const float *image, float *outImage, int w, int h, int c);                                          // simple box filter on only the non-zero values.
+void lmImageDenoise(const float *image, float *outImage, int w, int h, int c,                                          // edge-avoiding a-trous wavelet filter (5x5 B3 spline, step size doubled per iteration) on only the non-zero values.
+	const float *positions LM_DEFAULT_VALUE(0), const float *normals LM_DEFAULT_VALUE(0),                             // optional w * h * 3 float guides (see lmGetPreparedGeometryGuides) or NULL.
+	int iterations LM_DEFAULT_VALUE(3),                                                                                // number of filter iterations (filter radius = 2 * (2^iterations - 1) pixels).
+	float colorSigma LM_DEFAULT_VALUE(0.03f),                                                                          // relative color difference |a - b| / rms(|a|, |b|) that is still smoothed (0 => no color edges).
+	                                                                                                                   // shrinks with each iteration. higher values remove more noise but also blur shadow edges.
+	float positionSigma LM_DEFAULT_VALUE(0.0f),                                                                        // world space distance of a neighbor from the pixel's tangent plane (or position without normals) (0 => no position edges).
+	float normalSigma LM_DEFAULT_VALUE(0.3f));                                                                         // normal difference |a - b| that is still smoothed (0 => no normal edges).
 void lmImageDownsample(const float *image, float *outImage, int w, int h, int c);                                      // downsamples [0..w]x[0..h] to [0..w/2]x[0..h/2] by avereging only the non-zero values
 void lmImageFtoUB(const float *image, unsigned char *outImage, int w, int h, int c, float max LM_DEFAULT_VALUE(0.0f)); // casts a floating point image to an 8bit/channel image
 
-// TGA file output helpers
+// optional: run a sequence of the above operations tile by tile (with borders that cover the reach of all operations), so that every tile stays
+// in the cache through all of them and no full size intermediate images are needed. same results as calling the functions one after another.
+#define LM_IMAGE_OP_ADD      1
+#define LM_IMAGE_OP_SCALE    2
+#define LM_IMAGE_OP_POWER    3
+#define LM_IMAGE_OP_DILATE   4
+#define LM_IMAGE_OP_DILATE_N 5
+#define LM_IMAGE_OP_SMOOTH   6
+#define LM_IMAGE_OP_FTOUB    7
+typedef struct lm_image_op
+{
+	int type;                                                                                          // LM_IMAGE_OP_*
+	float value;                                                                                       // ADD: value, SCALE: factor, POWER: exponent, DILATE_N: radius (>= 0),
+	                                                                                                   // FTOUB: max (> 0, only as the last operation. writes to outImageUB instead of outImage).
+	int m;                                                                                             // channel mask for ADD, SCALE and POWER (0 => LM_ALL_CHANNELS).
+} lm_image_op;
+void lmImageProcess(const float *image, float *outImage, unsigned char *outImageUB, int w, int h, int c, // outImage must not overlap image.
+	const lm_image_op *ops, int opCount);
+void lmImageProcessEx(const void *image, lm_type type, void *outImage, lm_type outType, int w, int h, int c, // same for images with LM_FLOAT, LM_HALF_FLOAT, LM_RGB9_E5 or LM_R11F_G11F_B10F channels.
+	const lm_image_op *ops, int opCount);                                                              // outType LM_UNSIGNED_BYTE with a final LM_IMAGE_OP_FTOUB. no operations: converts the image.
+void lmImageProcessMapped(const lm_mapped_image *image, lm_mapped_image *outImage,                     // same for two different mapped images of the same size (without LM_IMAGE_OP_FTOUB).
+	const lm_image_op *ops, int opCount);
+void lmImageProcessSparse(const lm_sparse_image *image, lm_sparse_image *outImage,                     // same for two different sparse images of the same size (without LM_IMAGE_OP_FTOUB).
+	const lm_image_op *ops, int opCount);                                                              // tiles that stay zero are skipped (and not allocated in outImage).
+
+// image file output helpers. the images are converted and written in blocks of rows (on the image job threads) and are never modified.
+// row 0 is the bottom row (like in OpenGL textures).
 lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w, int h, int c);
 lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h, int c, float max LM_DEFAULT_VALUE(0.0f));
+lm_bool lmImageSaveTGAubRLE(const char *filename, const unsigned char *image, int w, int h, int c);                  // run length encoded TGA
+lm_bool lmImageSaveTGAfRLE(const char *filename, const float *image, int w, int h, int c, float max LM_DEFAULT_VALUE(0.0f));
+lm_bool lmImageSavePFM(const char *filename, const float *image, int w, int h, int c);                                // c = 1: greyscale, c >= 3: RGB (other channels are dropped)
+lm_bool lmImageSaveHDR(const char *filename, const float *image, int w, int h, int c);                                // Radiance RGBE (run length encoded). c = 1: greyscale, c >= 3: RGB
+lm_bool lmImageSaveHalf(const char *filename, const float *image, int w, int h, int c);                               // raw little endian half floats (no header)
 
 #endif
 ////////////////////// END OF HEADER //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -116,6 +325,35 @@ lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h,
 #include <float.h>
 #include <assert.h>
 #include <limits.h>
+#include <string.h>
+
+#if !defined(LM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define LM_SSE2
+#if defined(__F16C__) || defined(__AVX2__)
+#include <immintrin.h>
+#define LM_F16C
+#endif
+#elif !defined(LM_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define LM_NEON
+#endif
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef LM_NO_THREADS
+#include <pthread.h>
+#endif
+#endif
 
 #define LM_SWAP(type, a, b) { type tmp = (a); (a) = (b); (b) = tmp; }
 
@@ -137,6 +375,12 @@ static inline float    lm_maxf      (float   a, float   b) { return a > b ? a :
 static inline float    lm_absf      (float   a           ) { return a < 0.0f ? -a : a; }
 static inline float    lm_pmodf     (float   a, float   b) { return (a < 0.0f ? 1.0f : 0.0f) + (float)fmod(a, b); } // positive mod
 
+#if defined(_WIN32)
+static double lm_time(void) { LARGE_INTEGER f, t; QueryPerformanceFrequency(&f); QueryPerformanceCounter(&t); return (double)t.QuadPart / (double)f.QuadPart; }
+#else
+static double lm_time(void) { struct timeval t; gettimeofday(&t, NULL); return (double)t.tv_sec + (double)t.tv_usec * 1e-6; }
+#endif
+
 typedef struct lm_ivec2 { int x, y; } lm_ivec2;
 static inline lm_ivec2 lm_i2        (int     x, int     y) { lm_ivec2 v = { x, y }; return v; }
 
@@ -259,71 +503,719 @@ static int lm_convexClip(lm_vec2 *poly, int nPoly, const lm_vec2 *clip, int nCli
 	return nRes;
 }
 
-struct lm_context
+typedef struct lm_readback
+{
+	GLuint buffer;                // pixel pack buffer with the RGBA result of each hemisphere in a batch
+	GLsync fence;
+	unsigned int hemiCount;
+	lm_ivec2 *toLightmapLocation; // lightmap location of each hemisphere result
+	unsigned int *toMesh;         // queued mesh of each hemisphere result
+	GLuint distanceBuffer;        // pixel pack buffer with the weighted inverse depth sum and the weight sum of each hemisphere (only with hit distances)
+} lm_readback;
+
+typedef struct lm_mesh
+{
+	const float *modelMatrix;
+	float normalMatrix[9];
+
+	const unsigned char *positions;
+	lm_type positionsType;
+	int positionsStride;
+	const unsigned char *normals;
+	lm_type normalsType;
+	int normalsStride;
+	const unsigned char *uvs;
+	lm_type uvsType;
+	int uvsStride;
+	const unsigned char *indices;
+	lm_type indicesType;
+	unsigned int count;
+} lm_mesh;
+
+typedef struct lm_triangle
+{
+	lm_vec3 p[3];
+	lm_vec3 n[3];
+	lm_vec2 uv[3];
+	lm_ivec2 rasterMin, rasterMax; // conservative rasterizer bounds on the lightmap
+} lm_triangle;
+
+#ifndef LM_NO_THREADS
+#if defined(_WIN32)
+typedef CRITICAL_SECTION lm_mutex;
+static void lm_initMutex(lm_mutex *mutex) { InitializeCriticalSection(mutex); }
+static void lm_destroyMutex(lm_mutex *mutex) { DeleteCriticalSection(mutex); }
+static void lm_lock(lm_mutex *mutex) { EnterCriticalSection(mutex); }
+static void lm_unlock(lm_mutex *mutex) { LeaveCriticalSection(mutex); }
+#else
+typedef pthread_mutex_t lm_mutex;
+static void lm_initMutex(lm_mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void lm_destroyMutex(lm_mutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lm_lock(lm_mutex *mutex) { pthread_mutex_lock(mutex); }
+static void lm_unlock(lm_mutex *mutex) { pthread_mutex_unlock(mutex); }
+#endif
+#else
+typedef int lm_mutex;
+static void lm_initMutex(lm_mutex *mutex) { (void)mutex; }
+static void lm_destroyMutex(lm_mutex *mutex) { (void)mutex; }
+static void lm_lock(lm_mutex *mutex) { (void)mutex; }
+static void lm_unlock(lm_mutex *mutex) { (void)mutex; }
+#endif
+
+// memory of a lightmapper instance and its prepared geometries. freed blocks go to free lists of size classes
+// (4 per power of two) and are reused by the next allocations, so that the per mesh memory of a series of similar meshes
+// comes from the pool instead of the heap. it lives until the instance and all of its prepared geometries are destroyed.
+// blocks larger than the largest class (896 MB) are allocated and freed directly.
+#define LM_POOL_CLASSES 96
+
+typedef union lm_pool_block
 {
 	struct
 	{
-		const float *modelMatrix;
-		float normalMatrix[9];
-
-		const unsigned char *positions;
-		lm_type positionsType;
-		int positionsStride;
-		const unsigned char *normals;
-		lm_type normalsType;
-		int normalsStride;
-		const unsigned char *uvs;
-		lm_type uvsType;
-		int uvsStride;
-		const unsigned char *indices;
-		lm_type indicesType;
-		unsigned int count;
-	} mesh;
+		union lm_pool_block *next; // next unused block of the same class
+		unsigned int sizeClass;   // LM_POOL_CLASSES => allocated directly
+	} header;
+	double alignment[2];          // keeps the memory behind the header 16 byte aligned
+} lm_pool_block;
 
-	struct
+typedef struct lm_allocator
+{
+	void *(*allocate)(size_t size, void *userdata);
+	void (*deallocate)(void *memory, void *userdata);
+	void *userdata;
+	lm_mutex mutex;               // the geometry preparation threads allocate too
+	unsigned int references;      // the lightmapper instance and its prepared geometries
+	size_t poolLimit;             // maximum size of all unused blocks
+	size_t pooledBytes;
+	unsigned int heapAllocations, pooledAllocations;
+	lm_pool_block *pool[LM_POOL_CLASSES]; // unused blocks of each size class
+} lm_allocator;
+
+static void *lm_defaultAllocate(size_t size, void *userdata) { (void)userdata; return LM_CALLOC(size, 1); }
+static void lm_defaultDeallocate(void *memory, void *userdata) { (void)userdata; LM_FREE(memory); }
+
+// block size of a class including the header: 64, 80, 96, 112, 128, 160, ... (sizeClass < LM_POOL_CLASSES)
+static inline size_t lm_poolBlockSize(unsigned int sizeClass) { return (size_t)(4 + (sizeClass & 3)) << (sizeClass / 4 + 4); }
+
+static lm_allocator *lm_createAllocator(const lm_create_params *params)
+{
+	assert(!params || !params->allocate == !params->deallocate); // both or none
+	void *(*allocate)(size_t, void*) = params && params->allocate ? params->allocate : lm_defaultAllocate;
+	void *userdata = params ? params->allocatorUserdata : NULL;
+	lm_allocator *allocator = (lm_allocator*)allocate(sizeof(lm_allocator), userdata);
+	if (!allocator)
+		return NULL;
+	memset(allocator, 0, sizeof(lm_allocator));
+	allocator->allocate = allocate;
+	allocator->deallocate = params && params->deallocate ? params->deallocate : lm_defaultDeallocate;
+	allocator->userdata = userdata;
+	int limit = params && params->poolMemoryLimit ? lm_maxi(params->poolMemoryLimit, 0) : 64;
+	allocator->poolLimit = (size_t)limit << 20;
+	allocator->references = 1;
+	allocator->heapAllocations = 1;
+	lm_initMutex(&allocator->mutex);
+	return allocator;
+}
+
+static void lm_retainAllocator(lm_allocator *allocator)
+{
+	lm_lock(&allocator->mutex);
+	allocator->references++;
+	lm_unlock(&allocator->mutex);
+}
+
+static void lm_releaseAllocator(lm_allocator *allocator)
+{
+	lm_lock(&allocator->mutex);
+	unsigned int references = --allocator->references;
+	lm_unlock(&allocator->mutex);
+	if (references > 0)
+		return;
+
+	for (int i = 0; i < LM_POOL_CLASSES; i++)
 	{
-		int pass;
-		int passCount;
+		while (allocator->pool[i])
+		{
+			lm_pool_block *block = allocator->pool[i];
+			allocator->pool[i] = block->header.next;
+			allocator->deallocate(block, allocator->userdata);
+		}
+	}
+	lm_destroyMutex(&allocator->mutex);
+	allocator->deallocate(allocator, allocator->userdata);
+}
 
-		struct
+// zero initialized memory for count elements of the given size (NULL => too large or the allocate function failed)
+static void *lm_allocate(lm_allocator *allocator, size_t count, size_t size)
+{
+	if (size && count > ((size_t)-1 - sizeof(lm_pool_block)) / size)
+		return NULL;
+	size_t bytes = count * size;
+	unsigned int sizeClass = 0;
+	if (bytes + sizeof(lm_pool_block) > lm_poolBlockSize(LM_POOL_CLASSES - 1))
+		sizeClass = LM_POOL_CLASSES;
+	else
+		while (lm_poolBlockSize(sizeClass) < bytes + sizeof(lm_pool_block))
+			sizeClass++;
+
+	lm_lock(&allocator->mutex);
+	lm_pool_block *block = sizeClass < LM_POOL_CLASSES ? allocator->pool[sizeClass] : NULL;
+	if (block)
+	{
+		allocator->pool[sizeClass] = block->header.next;
+		allocator->pooledBytes -= lm_poolBlockSize(sizeClass);
+		allocator->pooledAllocations++;
+	}
+	else
+	{
+		size_t blockSize = sizeClass < LM_POOL_CLASSES ? lm_poolBlockSize(sizeClass) : bytes + sizeof(lm_pool_block);
+		block = (lm_pool_block*)allocator->allocate(blockSize, allocator->userdata);
+		if (!block)
 		{
-			unsigned int baseIndex;
-			lm_vec3 p[3];
-			lm_vec3 n[3];
-			lm_vec2 uv[3];
-		} triangle;
+			lm_unlock(&allocator->mutex);
+			return NULL;
+		}
+		allocator->heapAllocations++;
+	}
+	lm_unlock(&allocator->mutex);
 
-		struct
+	block->header.sizeClass = sizeClass;
+	memset(block + 1, 0, bytes);
+	return block + 1;
+}
+
+static void lm_deallocate(lm_allocator *allocator, void *memory)
+{
+	if (!memory)
+		return;
+	lm_pool_block *block = (lm_pool_block*)memory - 1;
+	lm_bool pooled = block->header.sizeClass < LM_POOL_CLASSES;
+	size_t size = pooled ? lm_poolBlockSize(block->header.sizeClass) : 0;
+
+	lm_lock(&allocator->mutex);
+	if (pooled && allocator->pooledBytes + size <= allocator->poolLimit)
+	{
+		block->header.next = allocator->pool[block->header.sizeClass];
+		allocator->pool[block->header.sizeClass] = block;
+		allocator->pooledBytes += size;
+	}
+	else
+	{
+		allocator->deallocate(block, allocator->userdata);
+	}
+	lm_unlock(&allocator->mutex);
+}
+
+// sparse per texel values: tiles of LM_TILE_SIZE x LM_TILE_SIZE texels that are allocated when one of their texels is set
+typedef union lm_texel_value
+{
+	unsigned int u;
+	float f;
+} lm_texel_value;
+
+typedef struct lm_texel_tiles
+{
+	int tilesX, tilesY;
+	lm_texel_value fill;          // value of the texels that were never set
+	lm_texel_value **tiles;       // NULL => not allocated
+	lm_allocator *allocator;
+} lm_texel_tiles;
+
+static lm_bool lm_initTexelTiles(lm_allocator *allocator, lm_texel_tiles *tiles, int w, int h, lm_texel_value fill)
+{
+	tiles->allocator = allocator;
+	tiles->tilesX = (w + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	tiles->tilesY = (h + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	tiles->fill = fill;
+	tiles->tiles = (lm_texel_value**)lm_allocate(allocator, (size_t)tiles->tilesX * tiles->tilesY, sizeof(lm_texel_value*));
+	return tiles->tiles != NULL;
+}
+
+static void lm_freeTexelTiles(lm_texel_tiles *tiles)
+{
+	if (tiles->tiles)
+	{
+		for (size_t i = 0; i < (size_t)tiles->tilesX * tiles->tilesY; i++)
+			lm_deallocate(tiles->allocator, tiles->tiles[i]);
+		lm_deallocate(tiles->allocator, tiles->tiles);
+	}
+	tiles->tiles = 0;
+}
+
+static inline lm_texel_value lm_getTexelValue(const lm_texel_tiles *tiles, int x, int y)
+{
+	const lm_texel_value *tile = tiles->tiles[(size_t)((unsigned int)y / LM_TILE_SIZE) * tiles->tilesX + (unsigned int)x / LM_TILE_SIZE];
+	return tile ? tile[((unsigned int)y % LM_TILE_SIZE) * LM_TILE_SIZE + (unsigned int)x % LM_TILE_SIZE] : tiles->fill;
+}
+
+static inline lm_bool lm_setTexelValue(lm_texel_tiles *tiles, int x, int y, lm_texel_value value)
+{
+	lm_texel_value **tile = tiles->tiles + (size_t)((unsigned int)y / LM_TILE_SIZE) * tiles->tilesX + (unsigned int)x / LM_TILE_SIZE;
+	if (!*tile)
+	{
+		*tile = (lm_texel_value*)lm_allocate(tiles->allocator, LM_TILE_SIZE * LM_TILE_SIZE, sizeof(lm_texel_value));
+		if (!*tile)
+			return LM_FALSE;
+		for (int i = 0; i < LM_TILE_SIZE * LM_TILE_SIZE; i++)
+			(*tile)[i] = tiles->fill;
+	}
+	(*tile)[((unsigned int)y % LM_TILE_SIZE) * LM_TILE_SIZE + (unsigned int)x % LM_TILE_SIZE] = value;
+	return LM_TRUE;
+}
+
+static inline lm_texel_value lm_texelU(unsigned int u) { lm_texel_value v; v.u = u; return v; }
+static inline lm_texel_value lm_texelF(float f) { lm_texel_value v; v.f = f; return v; }
+
+// all lightmap texels of a mesh that need a hemisphere (or an interpolated value).
+// every texel belongs to the first triangle that covers it.
+struct lm_prepared_geometry
+{
+	int width, height;            // lightmap size that the mesh was rasterized for
+	unsigned int count, capacity;
+	lm_ivec2 *texel;              // lightmap location
+	unsigned int *triangle;       // index of the owning triangle
+	lm_vec3 *position;            // world space surface position
+	lm_vec3 *normal;              // normalized world space (interpolated) normal
+	lm_vec3 *up;                  // hemisphere up vector perpendicular to the normal (before the per-sample rotation)
+
+	lm_texel_tiles sampleAt;      // prepared sample of each lightmap texel (LM_NO_SAMPLE => not covered by the mesh)
+
+	unsigned int triangleCount;
+	lm_ivec2 *rasterMin, *rasterMax; // conservative rasterizer bounds of each triangle (interpolation pass grid and neighbors)
+	unsigned int *chart;          // UV chart of each triangle (index of its first triangle)
+
+	lm_allocator *allocator;      // of the lightmapper instance that prepared it
+};
+#define LM_NO_SAMPLE 0xffffffffu
+
+// a rendered hemisphere in the irradiance cache
+typedef struct lm_cache_record
+{
+	lm_vec3 position, normal;
+	lm_vec3 tangent, bitangent;   // gradient directions
+	float radius;                 // validity radius: clamped harmonic mean hit distance
+	float value[4];               // lightmap pixel
+	float gradient[2][4];         // change of the value per distance along the tangent and bitangent
+} lm_cache_record;
+
+typedef struct lm_cache_entry
+{
+	unsigned int record;
+	unsigned int next;            // next entry in the same spatial hash bucket (LM_NO_SAMPLE => none)
+} lm_cache_entry;
+
+struct lm_mapped_image
+{
+	int w, h, c;
+	int tilesX, tilesY;
+	float *data;                  // tiles in rows. the texels of each tile are in rows too.
+	void *view;                   // whole file (header and data)
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file, mapping;
+#else
+	int file;
+#endif
+};
+
+static inline float *lm_mappedImagePixel(const lm_mapped_image *image, int x, int y)
+{
+	assert(x >= 0 && x < image->w && y >= 0 && y < image->h);
+	size_t tile = (size_t)(y / LM_TILE_SIZE) * image->tilesX + x / LM_TILE_SIZE;
+	size_t texel = (tile * LM_TILE_SIZE + y % LM_TILE_SIZE) * LM_TILE_SIZE + x % LM_TILE_SIZE;
+	return image->data + texel * image->c;
+}
+
+// copies a rectangle between the tiles and a linear image with stride floats per row
+static void lm_mappedImageCopy(const lm_mapped_image *image, int x, int y, int w, int h, float *linear, size_t stride, lm_bool toImage)
+{
+	int c = image->c;
+	for (int j = 0; j < h; j++)
+	{
+		for (int i = 0; i < w;)
 		{
-			int minx, miny;
-			int maxx, maxy;
-			int x, y;
-		} rasterizer;
+			int n = lm_mini(w - i, LM_TILE_SIZE - (x + i) % LM_TILE_SIZE); // rest of the tile row
+			float *p = lm_mappedImagePixel(image, x + i, y + j);
+			float *l = linear + j * stride + (size_t)i * c;
+			if (toImage)
+				memcpy(p, l, (size_t)n * c * sizeof(float));
+			else
+				memcpy(l, p, (size_t)n * c * sizeof(float));
+			i += n;
+		}
+	}
+}
 
-		struct
+struct lm_sparse_image
+{
+	int w, h, c;
+	int tilesX, tilesY;
+	float **tiles;                // NULL => all texels are zero
+};
+
+static float *lm_sparseImageTile(lm_sparse_image *image, int tx, int ty, lm_bool allocate)
+{
+	float **tile = image->tiles + (size_t)ty * image->tilesX + tx;
+	if (!*tile && allocate)
+		*tile = (float*)LM_CALLOC((size_t)LM_TILE_SIZE * LM_TILE_SIZE * image->c, sizeof(float));
+	return *tile;
+}
+
+static inline float *lm_sparseImagePixel(lm_sparse_image *image, int x, int y)
+{
+	assert(x >= 0 && x < image->w && y >= 0 && y < image->h);
+	float *tile = lm_sparseImageTile(image, x / LM_TILE_SIZE, y / LM_TILE_SIZE, LM_TRUE);
+	return tile + ((y % LM_TILE_SIZE) * LM_TILE_SIZE + x % LM_TILE_SIZE) * image->c;
+}
+
+// copies a rectangle between the tiles and a linear image with stride floats per row.
+// unallocated tiles read as zeros and are only allocated for non-zero texels.
+static void lm_sparseImageCopy(const lm_sparse_image *image, int x, int y, int w, int h, float *linear, size_t stride, lm_bool toImage)
+{
+	int c = image->c;
+	for (int j = 0; j < h; j++)
+	{
+		for (int i = 0; i < w;)
 		{
-			lm_vec3 position;
-			lm_vec3 direction;
-			lm_vec3 up;
-		} sample;
+			int n = lm_mini(w - i, LM_TILE_SIZE - (x + i) % LM_TILE_SIZE); // rest of the tile row
+			float *l = linear + j * stride + (size_t)i * c;
+			size_t floats = (size_t)n * c;
+			lm_bool allocate = LM_FALSE;
+			for (size_t k = 0; toImage && k < floats && !allocate; k++)
+				allocate = l[k] != 0.0f;
+			float *tile = lm_sparseImageTile((lm_sparse_image*)image, (x + i) / LM_TILE_SIZE, (y + j) / LM_TILE_SIZE, allocate);
+			float *p = tile ? tile + (((y + j) % LM_TILE_SIZE) * LM_TILE_SIZE + (x + i) % LM_TILE_SIZE) * c : NULL;
+			if (toImage && p)
+				memcpy(p, l, floats * sizeof(float));
+			else if (!toImage && p)
+				memcpy(l, p, floats * sizeof(float));
+			else if (!toImage)
+				memset(l, 0, floats * sizeof(float));
+			i += n;
+		}
+	}
+}
 
-		struct
+// whether none of the sparse image tiles that overlap the x0..x1, y0..y1 area are allocated
+static lm_bool lm_isEmptySparseArea(const lm_sparse_image *image, int x0, int y0, int x1, int y1)
+{
+	for (int ty = y0 / LM_TILE_SIZE; ty <= (y1 - 1) / LM_TILE_SIZE; ty++)
+		for (int tx = x0 / LM_TILE_SIZE; tx <= (x1 - 1) / LM_TILE_SIZE; tx++)
+			if (image->tiles[(size_t)ty * image->tilesX + tx])
+				return LM_FALSE;
+	return LM_TRUE;
+}
+
+// frees the sparse image tiles in the x0..x1, y0..y1 area (which has to start and end at tile borders or the image border)
+static void lm_clearSparseArea(lm_sparse_image *image, int x0, int y0, int x1, int y1)
+{
+	for (int ty = y0 / LM_TILE_SIZE; ty <= (y1 - 1) / LM_TILE_SIZE; ty++)
+	{
+		for (int tx = x0 / LM_TILE_SIZE; tx <= (x1 - 1) / LM_TILE_SIZE; tx++)
+		{
+			float **tile = image->tiles + (size_t)ty * image->tilesX + tx;
+			LM_FREE(*tile);
+			*tile = NULL;
+		}
+	}
+}
+
+// texel formats of target lightmaps and images (LM_FLOAT, LM_HALF_FLOAT, LM_RGB9_E5, LM_R11F_G11F_B10F)
+static float lm_halfToFloat(unsigned short h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	unsigned int bits;
+	if (exponent == 0x1f) // inf/nan
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent) // normalized
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	else if (mantissa) // denormalized: renormalize
+	{
+		exponent = 127 - 14;
+		while (!(mantissa & 0x400))
 		{
-			int side;
-		} hemisphere;
-	} meshPosition;
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	else // zero
+		bits = sign;
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+// unsigned floats with a 5 bit exponent and mantissaBits bits of mantissa (10: half floats without their sign, 6 and 5: packed floats).
+// the sign of f is ignored. rounds to nearest even, like the hardware conversions.
+static unsigned int lm_floatToSmallFloat(float f, int mantissaBits)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	unsigned int mantissa = bits & 0x7fffff, inf = 0x1fu << mantissaBits;
+	int exponent = (int)((bits >> 23) & 0xff);
+	if (exponent == 0xff) // inf, nan
+		return inf | (mantissa ? (1u << (mantissaBits - 1)) | (mantissa >> (23 - mantissaBits)) : 0);
+	exponent += 15 - 127;
+	if (exponent >= 31) // too large
+		return inf;
+	unsigned int shift = 23 - mantissaBits;
+	if (exponent <= 0) // denormal
+	{
+		if (exponent < -mantissaBits)
+			return 0;
+		mantissa |= 0x800000;
+		shift = 24 - mantissaBits - exponent;
+		exponent = 0;
+	}
+	unsigned int small = ((unsigned int)exponent << mantissaBits) | (mantissa >> shift);
+	unsigned int rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+	if (rest > halfway || (rest == halfway && (small & 1)))
+		small++; // may carry into the exponent, which is still correct
+	return small;
+}
+
+static float lm_smallFloatToFloat(unsigned int small, int mantissaBits)
+{
+	unsigned int exponent = small >> mantissaBits;
+	unsigned int mantissa = small & ((1u << mantissaBits) - 1);
+	unsigned int bits;
+	if (exponent == 0x1f) // inf/nan
+		bits = 0x7f800000 | (mantissa << (23 - mantissaBits));
+	else if (exponent) // normalized
+		bits = ((exponent + 127 - 15) << 23) | (mantissa << (23 - mantissaBits));
+	else // denormalized (exact)
+		return (float)mantissa / (float)(1u << (14 + mantissaBits));
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+static unsigned short lm_floatToHalf(float f)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return (unsigned short)(((bits >> 16) & 0x8000) | lm_floatToSmallFloat(f, 10));
+}
+
+// R: bits 0..10, G: bits 11..21, B: bits 22..31. negative values become 0.
+static unsigned int lm_floatToR11G11B10(const float *rgb)
+{
+	return lm_floatToSmallFloat(lm_maxf(rgb[0], 0.0f), 6) | (lm_floatToSmallFloat(lm_maxf(rgb[1], 0.0f), 6) << 11) | (lm_floatToSmallFloat(lm_maxf(rgb[2], 0.0f), 5) << 22);
+}
+
+static void lm_r11g11b10ToFloat(unsigned int packed, float *rgb)
+{
+	rgb[0] = lm_smallFloatToFloat(packed & 0x7ff, 6);
+	rgb[1] = lm_smallFloatToFloat((packed >> 11) & 0x7ff, 6);
+	rgb[2] = lm_smallFloatToFloat(packed >> 22, 5);
+}
+
+// 9 bit mantissas in bits 0..8, 9..17, 18..26 and their shared exponent in bits 27..31 (the conversion of EXT_texture_shared_exponent).
+static unsigned int lm_floatToRGB9E5(const float *rgb)
+{
+	float c[3], maxc = 0.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		c[i] = rgb[i] > 0.0f ? lm_minf(rgb[i], 65408.0f) : 0.0f; // also nan => 0
+		maxc = lm_maxf(maxc, c[i]);
+	}
+	unsigned int bits;
+	memcpy(&bits, &maxc, sizeof(bits));
+	int exponent = lm_maxi((int)(bits >> 23) - 127, -16) + 16; // floor(log2(maxc)) + 1 + bias
+	if ((unsigned int)(maxc * ldexpf(1.0f, 24 - exponent) + 0.5f) == 512)
+		exponent++;
+	float scale = ldexpf(1.0f, 24 - exponent);
+	unsigned int packed = (unsigned int)exponent << 27;
+	for (int i = 0; i < 3; i++)
+		packed |= (unsigned int)(c[i] * scale + 0.5f) << (9 * i);
+	return packed;
+}
+
+static void lm_rgb9e5ToFloat(unsigned int packed, float *rgb)
+{
+	float scale = ldexpf(1.0f, (int)(packed >> 27) - 24);
+	for (int i = 0; i < 3; i++)
+		rgb[i] = (float)((packed >> (9 * i)) & 0x1ff) * scale;
+}
+
+static void lm_assertTexelType(lm_type type, int c)
+{
+	(void)type; (void)c;
+	assert(type == LM_FLOAT || type == LM_HALF_FLOAT || ((type == LM_RGB9_E5 || type == LM_R11F_G11F_B10F) && c == 3));
+}
+
+// converts count texels with c channels, starting at texel first of image, to floats
+static void lm_loadTexels(const void *image, lm_type type, int c, size_t first, size_t count, float *out)
+{
+	size_t i = 0, n = count * c;
+	switch (type)
+	{
+	case LM_FLOAT:
+		memcpy(out, (const float*)image + first * c, n * sizeof(float));
+		break;
+	case LM_HALF_FLOAT:
+	{
+		const unsigned short *in = (const unsigned short*)image + first * c;
+#if defined(LM_F16C)
+		for (; i + 4 <= n; i += 4)
+			_mm_storeu_ps(out + i, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(in + i))));
+#endif
+		for (; i < n; i++)
+			out[i] = lm_halfToFloat(in[i]);
+		break;
+	}
+	case LM_RGB9_E5:
+		for (; i < count; i++)
+			lm_rgb9e5ToFloat(((const unsigned int*)image)[first + i], out + i * 3);
+		break;
+	case LM_R11F_G11F_B10F:
+		for (; i < count; i++)
+			lm_r11g11b10ToFloat(((const unsigned int*)image)[first + i], out + i * 3);
+		break;
+	default:
+		assert(LM_FALSE);
+		break;
+	}
+}
+
+// converts count texels with c channels from floats and stores them at texel first of image
+static void lm_storeTexels(const float *in, void *image, lm_type type, int c, size_t first, size_t count)
+{
+	size_t i = 0, n = count * c;
+	switch (type)
+	{
+	case LM_FLOAT:
+		memcpy((float*)image + first * c, in, n * sizeof(float));
+		break;
+	case LM_HALF_FLOAT:
+	{
+		unsigned short *out = (unsigned short*)image + first * c;
+#if defined(LM_F16C)
+		for (; i + 4 <= n; i += 4)
+			_mm_storel_epi64((__m128i*)(out + i), _mm_cvtps_ph(_mm_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+		for (; i < n; i++)
+			out[i] = lm_floatToHalf(in[i]);
+		break;
+	}
+	case LM_RGB9_E5:
+		for (; i < count; i++)
+			((unsigned int*)image)[first + i] = lm_floatToRGB9E5(in + i * 3);
+		break;
+	case LM_R11F_G11F_B10F:
+		for (; i < count; i++)
+			((unsigned int*)image)[first + i] = lm_floatToR11G11B10(in + i * 3);
+		break;
+	default:
+		assert(LM_FALSE);
+		break;
+	}
+}
+
+// per mesh state of the lightmapper instance. the bake queue keeps it for every queued mesh (see lm_queued_mesh).
+typedef struct lm_bake_mesh
+{
+	const lm_prepared_geometry *geometry;
+	lm_prepared_geometry *owned; // prepared by lmSetGeometry
+} lm_bake_mesh;
+
+typedef struct lm_mesh_position
+{
+	int pass;
+	int passCount;
+
+	unsigned int sampleIndex;     // next prepared sample to try in the current pass
+
+	struct
+	{
+		int x, y;
+		lm_vec3 position;
+		lm_vec3 direction;
+		lm_vec3 up;
+	} sample;
 
 	struct
 	{
-		int width;
-		int height;
-		int channels;
-		float *data;
+		int side;
+	} hemisphere;
+} lm_mesh_position;
+
+typedef struct lm_target_lightmap
+{
+	int width;
+	int height;
+	int channels;
+	void *data;
+	lm_type type;                 // of the data channels
+	lm_mapped_image *mapped;      // instead of data
+	lm_sparse_image *sparse;      // instead of data
 
 #ifdef LM_DEBUG_INTERPOLATION
-		unsigned char *debug;
+	lm_texel_tiles debug;         // LM_DEBUG_* flags of the texels (0 => wasted)
 #endif
-	} lightmap;
+} lm_target_lightmap;
+
+typedef struct lm_adaptive_sampling
+{
+	lm_bool enabled;
+	unsigned int budget;
+	float errorTarget;
+	unsigned int rendered;        // hemispheres of the current mesh
+	unsigned char *level;         // interpolation pass of each prepared sample
+	unsigned char *done;          // prepared samples that were rendered
+	float *priority;              // interpolation error of each prepared sample weighted by its pass area (0 => no candidate)
+	unsigned int *order;          // prepared samples sorted by their pass
+	unsigned int *selection;      // prepared samples to render in the current round
+	unsigned int selectionCount;
+	lm_texel_tiles error;         // estimated error of each lightmap texel (LM_ADAPTIVE_PENDING, LM_ADAPTIVE_BLOCKED => no value)
+} lm_adaptive_sampling;
+
+typedef struct lm_interpolation_guard
+{
+	lm_bool enabled;
+	float minNormalCos;           // -2 => normals aren't checked
+	float maxPositionError;       // FLT_MAX => positions aren't checked
+	float maxHitDistanceFraction; // 0 => hit distances aren't captured and checked
+	lm_texel_tiles hitDistance;   // mean hit distance of each lightmap texel (interpolated texels: minimum of their neighbors). only with hit distances (tiles != NULL).
+} lm_interpolation_guard;
+
+typedef struct lm_irradiance_cache
+{
+	lm_bool enabled;
+	float accuracy;               // maximum error estimate of a valid record
+	int pass;                     // next pass whose texels are checked against the cache
+	unsigned int nextSample;      // first sample of that pass in adaptive.order
+	float texelSize;              // mean world space distance between the texels of the current mesh
+	float cellSize;               // spatial hash grid cell size (largest record extent)
+	lm_cache_record *records;
+	unsigned int recordCount, recordCapacity;
+	unsigned int *buckets;        // first entry of each spatial hash bucket (LM_NO_SAMPLE => empty)
+	unsigned int bucketCount;     // power of two
+	lm_cache_entry *entries;      // records overlapping the grid cells of each bucket
+	unsigned int entryCount, entryCapacity;
+} lm_irradiance_cache;
+
+// a mesh of the bake queue. the context only holds the state of the mesh whose hemispheres are gathered
+// (or whose results arrive), the others wait here (see lm_selectQueuedMesh).
+typedef struct lm_queued_mesh
+{
+	lm_bake_mesh mesh;
+	lm_mesh_position meshPosition;
+	lm_target_lightmap lightmap;
+	lm_adaptive_sampling adaptive;
+	lm_interpolation_guard interpolationGuard;
+	lm_irradiance_cache irradianceCache;
+	float progress;               // lmProgress of the mesh when it was stored
+} lm_queued_mesh;
+
+struct lm_context
+{
+	lm_bake_mesh mesh;
+	lm_mesh_position meshPosition;
+	lm_target_lightmap lightmap;
 
 	struct
 	{
@@ -336,6 +1228,7 @@ struct lm_context
 		unsigned int fbHemiCountY;
 		unsigned int fbHemiIndex;
 		lm_ivec2 *fbHemiToLightmapLocation;
+		unsigned int *fbHemiToMesh;   // queued mesh of each hemisphere in the batch
 		GLuint fbTexture[2];
 		GLuint fb[2];
 		GLuint fbDepth;
@@ -346,6 +1239,7 @@ struct lm_context
 			GLuint hemispheresTextureID;
 			GLuint weightsTextureID;
 			GLuint weightsTexture;
+			lm_bool weightsTextureAllocated; // later weights only update its content
 		} firstPass;
 		struct
 		{
@@ -354,13 +1248,61 @@ struct lm_context
 		} downsamplePass;
 		struct
 		{
-			GLuint texture;
-			lm_ivec2 writePosition;
-			lm_ivec2 *toLightmapLocation;
-		} storage;
+			GLuint programID;             // weighted downsampling of the hemisphere depths for the mean hit distances
+			GLuint depthsTextureID;
+			GLuint weightsTextureID;
+			GLuint zNearFarID;
+		} distancePass;
+		struct
+		{
+			GLuint programID;
+			GLuint hemispheresTextureID;
+			GLuint weightsTextureID;
+			GLuint hemiCountXID;
+		} computePass;
+		struct
+		{
+			lm_readback *slots;           // ring of batches in flight. grows on demand up to LM_READBACK_BUFFERS entries.
+			unsigned int capacity;
+			unsigned int first, count;
+		} readback;
+		struct
+		{
+			GLuint camerasBuffer;         // cameras of all hemisphere sides in the batch for lmBeginBatch. created on first use.
+			float *cameras;
+			lm_vec3 *positions;           // position and direction of each hemisphere in the batch
+			lm_vec3 *directions;
+			float sphere[4];              // bounds of the current batch. see lmGetBatchBounds
+			float cone[4];
+		} batch;
 	} hemisphere;
 
+	lm_adaptive_sampling adaptive;
+	lm_interpolation_guard interpolationGuard;
+	lm_irradiance_cache irradianceCache;
+
+	struct
+	{
+		lm_queued_mesh *meshes;       // meshes of the next lmBegin loop (see lmQueueGeometry). finished meshes are removed after each pass.
+		unsigned int count, capacity;
+		unsigned int finished;
+		unsigned int current;         // mesh whose state is in the context while baking
+		lm_bool baking;
+		double progress;              // sum of the progress of the other meshes
+		lm_target_lightmap lightmap;  // target lightmap of the context. restored after baking
+#ifdef LM_DEBUG_INTERPOLATION
+		lm_target_lightmap *debugTargets; // target lightmaps of the queued meshes. their debug flags are shared and saved once the queue is done
+		unsigned int debugTargetCount, debugTargetCapacity;
+#endif
+	} queue;
+
 	float interpolationThreshold;
+	lm_bool chartInterpolation;
+	int threadCount;
+	int sampleOrder;
+
+	lm_allocator *allocator;
+	lm_statistics statistics;
 };
 
 // pass order of one 4x4 interpolation patch for two interpolation steps (and the next neighbors right of/below it)
@@ -396,37 +1338,87 @@ static unsigned int lm_passOffsetY(lm_context *ctx)
 	return passType != 0 ? halfStep : 0;
 }
 
-static lm_bool lm_hasConservativeTriangleRasterizerFinished(lm_context *ctx)
+static lm_bool lm_isInPassGrid(lm_context *ctx, unsigned int index)
 {
-	return ctx->meshPosition.rasterizer.y >= ctx->meshPosition.rasterizer.maxy;
+	// every texel belongs to exactly one pass. the grid is aligned to the rasterizer bounds of the owning triangle
+	// or, with chart interpolation and the irradiance cache, to the lightmap so that the grids of neighboring triangles match up.
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_ivec2 origin = ctx->chartInterpolation || ctx->irradianceCache.enabled ? lm_i2(0, 0) : geometry->rasterMin[geometry->triangle[index]];
+	int step = (int)lm_passStepSize(ctx);
+	int dx = geometry->texel[index].x - origin.x - (int)lm_passOffsetX(ctx);
+	int dy = geometry->texel[index].y - origin.y - (int)lm_passOffsetY(ctx);
+	return dx >= 0 && dy >= 0 && dx % step == 0 && dy % step == 0;
 }
 
-static void lm_moveToNextPotentialConservativeTriangleRasterizerPosition(lm_context *ctx)
+static const float lm_zeroPixel[4] = { 0 };
+
+static lm_bool lm_isZeroPixel(lm_context *ctx, const float *pixel)
+{
+	for (int j = 0; j < ctx->lightmap.channels; j++)
+		if (pixel[j] != 0.0f)
+			return LM_FALSE;
+	return LM_TRUE;
+}
+
+static void lm_getLightmapPixel(lm_context *ctx, int x, int y, float *out)
 {
-	unsigned int step = lm_passStepSize(ctx);
-	ctx->meshPosition.rasterizer.x += step;
-	while (ctx->meshPosition.rasterizer.x >= ctx->meshPosition.rasterizer.maxx)
+	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
+	int c = ctx->lightmap.channels;
+	const float *p;
+	if (ctx->lightmap.mapped)
+		p = lm_mappedImagePixel(ctx->lightmap.mapped, x, y);
+	else if (ctx->lightmap.sparse)
 	{
-		ctx->meshPosition.rasterizer.x = ctx->meshPosition.rasterizer.minx + lm_passOffsetX(ctx);
-		ctx->meshPosition.rasterizer.y += step;
-		if (lm_hasConservativeTriangleRasterizerFinished(ctx))
-			break;
+		p = lm_sparseImageTile(ctx->lightmap.sparse, x / LM_TILE_SIZE, y / LM_TILE_SIZE, LM_FALSE);
+		if (p)
+			p += ((y % LM_TILE_SIZE) * LM_TILE_SIZE + x % LM_TILE_SIZE) * c;
+		else
+			p = lm_zeroPixel;
+	}
+	else
+	{
+		lm_loadTexels(ctx->lightmap.data, ctx->lightmap.type, c, (size_t)y * ctx->lightmap.width + x, 1, out);
+		return;
 	}
+	memcpy(out, p, c * sizeof(float));
 }
 
-static float *lm_getLightmapPixel(lm_context *ctx, int x, int y)
+static void lm_setLightmapPixel(lm_context *ctx, int x, int y, const float *in)
 {
-	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
-	return ctx->lightmap.data + (y * ctx->lightmap.width + x) * ctx->lightmap.channels;
+	int c = ctx->lightmap.channels;
+	if (ctx->lightmap.mapped)
+		memcpy(lm_mappedImagePixel(ctx->lightmap.mapped, x, y), in, c * sizeof(float));
+	else if (ctx->lightmap.sparse)
+		memcpy(lm_sparseImagePixel(ctx->lightmap.sparse, x, y), in, c * sizeof(float));
+	else
+	{
+		assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
+		size_t texel = (size_t)y * ctx->lightmap.width + x;
+		lm_storeTexels(in, ctx->lightmap.data, ctx->lightmap.type, c, texel, 1);
+		if (ctx->lightmap.type == LM_FLOAT)
+			return;
+
+		// set texels must not turn into zero texels (which are the unset ones) in the smaller formats
+		float stored[4];
+		lm_loadTexels(ctx->lightmap.data, ctx->lightmap.type, c, texel, 1, stored);
+		if (!lm_isZeroPixel(ctx, stored) || lm_isZeroPixel(ctx, in))
+			return;
+		for (int j = 0; j < c; j++)
+			stored[j] = in[j] > 0.0f ? lm_maxf(in[j], 1.0f / (1 << 19)) : 0.0f; // smallest value of all formats, that isn't zero
+		lm_storeTexels(stored, ctx->lightmap.data, ctx->lightmap.type, c, texel, 1);
+	}
 }
 
-static void lm_setLightmapPixel(lm_context *ctx, int x, int y, float *in)
+#ifdef LM_DEBUG_INTERPOLATION
+#define LM_DEBUG_RENDERED     1 // red in the debug output
+#define LM_DEBUG_INTERPOLATED 2 // green in the debug output
+
+static void lm_setDebugFlag(lm_context *ctx, int x, int y, unsigned int flag)
 {
-	assert(x >= 0 && x < ctx->lightmap.width && y >= 0 && y < ctx->lightmap.height);
-	float *p = ctx->lightmap.data + (y * ctx->lightmap.width + x) * ctx->lightmap.channels;
-	for (int j = 0; j < ctx->lightmap.channels; j++)
-		*p++ = *in++;
+	lm_texel_tiles *debug = &ctx->lightmap.debug;
+	lm_setTexelValue(debug, x, y, lm_texelU(lm_getTexelValue(debug, x, y).u | flag));
 }
+#endif
 
 #define lm_baseAngle 0.1f
 static const float lm_baseAngles[3][3] = {
@@ -435,679 +1427,2377 @@ static const float lm_baseAngles[3][3] = {
 	{ lm_baseAngle + 2.0f / 3.0f, lm_baseAngle, lm_baseAngle + 1.0f / 3.0f }
 };
 
-static lm_bool lm_trySamplingConservativeTriangleRasterizerPosition(lm_context *ctx)
+static lm_bool lm_isInChart(const lm_prepared_geometry *geometry, int x, int y, unsigned int chart)
 {
-	if (lm_hasConservativeTriangleRasterizerFinished(ctx))
+	if (x < 0 || y < 0 || x >= geometry->width || y >= geometry->height)
 		return LM_FALSE;
+	unsigned int sample = lm_getTexelValue(&geometry->sampleAt, x, y).u;
+	return sample != LM_NO_SAMPLE && geometry->chart[geometry->triangle[sample]] == chart;
+}
 
-	// check if lightmap pixel was already set
-	float *pixelValue = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y);
-	for (int j = 0; j < ctx->lightmap.channels; j++)
-		if (pixelValue[j] != 0.0f)
+// interpolation neighbors of a prepared sample in the current pass (> 0).
+// returns false if some of them are outside of the rasterizer bounds of the owning triangle or,
+// with chart interpolation, if not all texels up to them are covered by the chart of the sample.
+static lm_bool lm_getInterpolationNeighbors(lm_context *ctx, unsigned int index, lm_ivec2 *neighbors, int *neighborCount)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	int x = geometry->texel[index].x;
+	int y = geometry->texel[index].y;
+	int d = (int)lm_passStepSize(ctx) / 2;
+	int dirs = ((ctx->meshPosition.pass - 1) % 3) + 1;
+	if (ctx->chartInterpolation)
+	{ // the straight path to the neighbors must not leave the chart (concave charts, other charts or meshes in between)
+		unsigned int chart = geometry->chart[geometry->triangle[index]];
+		for (int i = 1; i <= d; i++)
+		{
+			if ((dirs & 1) && (!lm_isInChart(geometry, x - i, y, chart) || !lm_isInChart(geometry, x + i, y, chart)))
+				return LM_FALSE;
+			if ((dirs & 2) && (!lm_isInChart(geometry, x, y - i, chart) || !lm_isInChart(geometry, x, y + i, chart)))
+				return LM_FALSE;
+		}
+	}
+	else
+	{
+		lm_ivec2 rasterMin = geometry->rasterMin[geometry->triangle[index]];
+		lm_ivec2 rasterMax = geometry->rasterMax[geometry->triangle[index]];
+		if ((dirs & 1) && (x - d < rasterMin.x || x + d > rasterMax.x))
 			return LM_FALSE;
+		if ((dirs & 2) && (y - d < rasterMin.y || y + d > rasterMax.y))
+			return LM_FALSE;
+	}
 
-	// try calculating centroid by clipping the pixel against the triangle
-	lm_vec2 pixel[16];
-	pixel[0] = lm_v2i(ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y);
-	pixel[1] = lm_v2i(ctx->meshPosition.rasterizer.x + 1, ctx->meshPosition.rasterizer.y);
-	pixel[2] = lm_v2i(ctx->meshPosition.rasterizer.x + 1, ctx->meshPosition.rasterizer.y + 1);
-	pixel[3] = lm_v2i(ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y + 1);
-
-	lm_vec2 res[16];
-	int nRes = lm_convexClip(pixel, 4, ctx->meshPosition.triangle.uv, 3, res);
-	if (nRes == 0)
-		return LM_FALSE; // nothing left
+	*neighborCount = 0;
+	if (dirs & 1) // x-neighbors with distance d
+	{
+		neighbors[(*neighborCount)++] = lm_i2(x - d, y);
+		neighbors[(*neighborCount)++] = lm_i2(x + d, y);
+	}
+	if (dirs & 2) // y-neighbors with distance d
+	{
+		neighbors[(*neighborCount)++] = lm_i2(x, y - d);
+		neighbors[(*neighborCount)++] = lm_i2(x, y + d);
+	}
+	return LM_TRUE;
+}
 
-	// calculate centroid position and area
-	lm_vec2 centroid = res[0];
-	float area = res[nRes - 1].x * res[0].y - res[nRes - 1].y * res[0].x;
-	for (int i = 1; i < nRes; i++)
+// geometry-aware interpolation guard: neighbors across creases, folds, depth discontinuities
+// or in front of nearby occluders may have similar colors by chance.
+static lm_bool lm_passesInterpolationGuard(lm_context *ctx, unsigned int index, const lm_ivec2 *neighbors, int neighborCount)
+{
+	if (!ctx->interpolationGuard.enabled)
+		return LM_TRUE;
+
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_vec3 position = geometry->position[index];
+	lm_vec3 normal = geometry->normal[index];
+	lm_vec3 avg = lm_v3(0.0f, 0.0f, 0.0f);
+	float distance = 0.0f;
+	for (int i = 0; i < neighborCount; i++)
 	{
-		centroid = lm_add2(centroid, res[i]);
-		area += res[i - 1].x * res[i].y - res[i - 1].y * res[i].x;
+		unsigned int neighbor = lm_getTexelValue(&geometry->sampleAt, neighbors[i].x, neighbors[i].y).u;
+		if (neighbor == LM_NO_SAMPLE)
+			return LM_FALSE; // set by another mesh. can't tell.
+		if (lm_dot3(normal, geometry->normal[neighbor]) < ctx->interpolationGuard.minNormalCos)
+			return LM_FALSE;
+		float neighborDistance = lm_length3(lm_sub3(geometry->position[neighbor], position));
+		if (ctx->interpolationGuard.maxHitDistanceFraction > 0.0f && ctx->interpolationGuard.hitDistance.tiles &&
+			neighborDistance > ctx->interpolationGuard.maxHitDistanceFraction * lm_getTexelValue(&ctx->interpolationGuard.hitDistance, neighbors[i].x, neighbors[i].y).f)
+			return LM_FALSE; // the incoming light changes quickly close to other geometry (irradiance caching validity)
+		avg = lm_add3(avg, geometry->position[neighbor]);
+		distance += neighborDistance;
 	}
-	centroid = lm_div2(centroid, (float)nRes);
-	area = lm_absf(area / 2.0f);
 
-	if (area <= 0.0f)
-		return LM_FALSE; // no area left
+	// the interpolation neighbors of a texel are symmetric around it, so their average
+	// is close to the texel position on surfaces that are (almost) flat between them.
+	float ni = 1.0f / neighborCount;
+	return lm_length3(lm_sub3(lm_scale3(avg, ni), position)) <= ctx->interpolationGuard.maxPositionError * distance * ni;
+}
 
-	// calculate barycentric coords
-	lm_vec2 uv = lm_toBarycentric(
-		ctx->meshPosition.triangle.uv[0],
-		ctx->meshPosition.triangle.uv[1],
-		ctx->meshPosition.triangle.uv[2],
-		centroid);
+static void lm_interpolateHitDistance(lm_context *ctx, int x, int y, const lm_ivec2 *neighbors, int neighborCount)
+{
+	if (!ctx->interpolationGuard.hitDistance.tiles)
+		return;
+	lm_texel_tiles *hitDistance = &ctx->interpolationGuard.hitDistance;
+	float minDistance = FLT_MAX;
+	for (int i = 0; i < neighborCount; i++)
+		minDistance = lm_minf(minDistance, lm_getTexelValue(hitDistance, neighbors[i].x, neighbors[i].y).f);
+	lm_setTexelValue(hitDistance, x, y, lm_texelF(minDistance));
+}
 
-	if (!lm_finite2(uv))
-		return LM_FALSE; // degenerate
+static void lm_setSampleCamera(lm_context *ctx, unsigned int index)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	int x = geometry->texel[index].x;
+	int y = geometry->texel[index].y;
+
+	// move the camera away from the surface along the normal
+	float cameraToSurfaceDistance = (1.0f + ctx->hemisphere.cameraToSurfaceDistanceModifier) * ctx->hemisphere.zNear * sqrtf(2.0f);
+	ctx->meshPosition.sample.x = x;
+	ctx->meshPosition.sample.y = y;
+	ctx->meshPosition.sample.direction = geometry->normal[index];
+	ctx->meshPosition.sample.position = lm_add3(geometry->position[index], lm_scale3(ctx->meshPosition.sample.direction, cameraToSurfaceDistance));
+
+#if 0
+	// triangle-consistent up vector
+	ctx->meshPosition.sample.up = geometry->up[index];
+#else
+	// "randomized" rotation with pattern
+	lm_vec3 up = geometry->up[index];
+	lm_vec3 side = lm_cross3(ctx->meshPosition.sample.direction, up);
+	int rx = x % 3;
+	int ry = y % 3;
+	static const float lm_pi = 3.14159265358979f;
+	float phi = 2.0f * lm_pi * lm_baseAngles[ry][rx] + 0.1f * ((float)rand() / (float)RAND_MAX);
+	ctx->meshPosition.sample.up = lm_normalize3(lm_add3(lm_scale3(side, cosf(phi)), lm_scale3(up, sinf(phi))));
+#endif
+}
+
+static lm_bool lm_trySamplingPreparedTexel(lm_context *ctx, unsigned int index)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	int x = geometry->texel[index].x;
+	int y = geometry->texel[index].y;
+
+	if (!lm_isInPassGrid(ctx, index))
+		return LM_FALSE; // texel is handled in another pass
+
+	// check if lightmap pixel was already set
+	float pixel[4];
+	lm_getLightmapPixel(ctx, x, y, pixel);
+	if (!lm_isZeroPixel(ctx, pixel))
+		return LM_FALSE;
 
 	// try to interpolate color from neighbors:
-	if (ctx->meshPosition.pass > 0)
-	{
-		float *neighbors[4];
-		int neighborCount = 0;
-		int neighborsExpected = 0;
-		int d = (int)lm_passStepSize(ctx) / 2;
-		int dirs = ((ctx->meshPosition.pass - 1) % 3) + 1;
-		if (dirs & 1) // check x-neighbors with distance d
-		{
-			neighborsExpected += 2;
-			if (ctx->meshPosition.rasterizer.x - d >= ctx->meshPosition.rasterizer.minx &&
-				ctx->meshPosition.rasterizer.x + d <= ctx->meshPosition.rasterizer.maxx)
+	lm_ivec2 neighborTexels[4];
+	int neighborCount;
+	if (ctx->meshPosition.pass > 0 && lm_getInterpolationNeighbors(ctx, index, neighborTexels, &neighborCount))
+	{ // all interpolation neighbors are available
+		float neighbors[4][4];
+		for (int i = 0; i < neighborCount; i++)
+			lm_getLightmapPixel(ctx, neighborTexels[i].x, neighborTexels[i].y, neighbors[i]);
+
+		// calculate average neighbor pixel value
+		float avg[4] = { 0 };
+		for (int i = 0; i < neighborCount; i++)
+			for (int j = 0; j < ctx->lightmap.channels; j++)
+				avg[j] += neighbors[i][j];
+		float ni = 1.0f / neighborCount;
+		for (int j = 0; j < ctx->lightmap.channels; j++)
+			avg[j] *= ni;
+
+		// check if error from average pixel to neighbors is above the interpolation threshold
+		lm_bool interpolate = LM_TRUE;
+		for (int i = 0; i < neighborCount; i++)
+		{
+			lm_bool zero = LM_TRUE;
+			for (int j = 0; j < ctx->lightmap.channels; j++)
 			{
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x - d, ctx->meshPosition.rasterizer.y);
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x + d, ctx->meshPosition.rasterizer.y);
+				if (neighbors[i][j] != 0.0f)
+					zero = LM_FALSE;
+				if (fabs(neighbors[i][j] - avg[j]) > ctx->interpolationThreshold)
+					interpolate = LM_FALSE;
 			}
+			if (zero)
+				interpolate = LM_FALSE;
+			if (!interpolate)
+				break;
 		}
-		if (dirs & 2) // check y-neighbors with distance d
+
+		if (interpolate && !lm_passesInterpolationGuard(ctx, index, neighborTexels, neighborCount))
 		{
-			neighborsExpected += 2;
-			if (ctx->meshPosition.rasterizer.y - d >= ctx->meshPosition.rasterizer.miny &&
-				ctx->meshPosition.rasterizer.y + d <= ctx->meshPosition.rasterizer.maxy)
-			{
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y - d);
-				neighbors[neighborCount++] = lm_getLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y + d);
-			}
+			interpolate = LM_FALSE;
+			ctx->statistics.geometryRejections++;
 		}
-		if (neighborCount == neighborsExpected) // are all interpolation neighbors available?
+
+		// set interpolated value and return if interpolation is acceptable
+		if (interpolate)
+		{
+			lm_setLightmapPixel(ctx, x, y, avg);
+			lm_interpolateHitDistance(ctx, x, y, neighborTexels, neighborCount);
+#ifdef LM_DEBUG_INTERPOLATION
+			// set interpolated pixel to green in debug output
+			lm_setDebugFlag(ctx, x, y, LM_DEBUG_INTERPOLATED);
+#endif
+			return LM_FALSE;
+		}
+	}
+
+	// could not interpolate. must render a hemisphere.
+	lm_setSampleCamera(ctx, index);
+	return LM_TRUE;
+}
+
+// adaptive sampling renders the prepared samples in rounds. after each round, all other samples are interpolated
+// from the same neighbors as in the pass grid and their interpolation error is estimated from the deviation of
+// the neighbors and the estimated errors of the neighbors themselves. the samples with the highest errors
+// (weighted by the area of their pass) are rendered in the next round until the error target or the budget is reached.
+#define LM_ADAPTIVE_PENDING -1.0f // not estimated yet in the current round
+#define LM_ADAPTIVE_BLOCKED -2.0f // no value until some of its interpolation neighbors are rendered
+
+static void lm_freeAdaptiveSampling(lm_context *ctx)
+{
+	lm_deallocate(ctx->allocator, ctx->adaptive.level);
+	lm_deallocate(ctx->allocator, ctx->adaptive.done);
+	lm_deallocate(ctx->allocator, ctx->adaptive.priority);
+	lm_deallocate(ctx->allocator, ctx->adaptive.order);
+	lm_deallocate(ctx->allocator, ctx->adaptive.selection);
+	lm_freeTexelTiles(&ctx->adaptive.error);
+	ctx->adaptive.level = 0;
+	ctx->adaptive.done = 0;
+	ctx->adaptive.priority = 0;
+	ctx->adaptive.order = 0;
+	ctx->adaptive.selection = 0;
+}
+
+static void lm_resetAdaptiveSampling(lm_context *ctx)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_freeAdaptiveSampling(ctx);
+	ctx->adaptive.rendered = 0;
+	ctx->adaptive.selectionCount = 0;
+	ctx->adaptive.level = (unsigned char*)lm_allocate(ctx->allocator, geometry->count, sizeof(unsigned char));
+	ctx->adaptive.done = (unsigned char*)lm_allocate(ctx->allocator, geometry->count, sizeof(unsigned char));
+	ctx->adaptive.priority = (float*)lm_allocate(ctx->allocator, geometry->count, sizeof(float));
+	ctx->adaptive.order = (unsigned int*)lm_allocate(ctx->allocator, geometry->count, sizeof(unsigned int));
+	ctx->adaptive.selection = (unsigned int*)lm_allocate(ctx->allocator, geometry->count, sizeof(unsigned int));
+	lm_initTexelTiles(ctx->allocator, &ctx->adaptive.error, ctx->lightmap.width, ctx->lightmap.height, lm_texelF(0.0f));
+
+	// find the pass of each sample and sort the samples by their pass (keeping their order within each pass)
+	unsigned int passStart[1 + 3 * 8 + 1] = { 0 };
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		lm_ivec2 texel = geometry->texel[i];
+		for (ctx->meshPosition.pass = 0; !lm_isInPassGrid(ctx, i); ctx->meshPosition.pass++)
+			assert(ctx->meshPosition.pass < ctx->meshPosition.passCount);
+		ctx->adaptive.level[i] = (unsigned char)ctx->meshPosition.pass;
+		passStart[ctx->meshPosition.pass + 1]++;
+
+		// texels that were already set (e.g. by another mesh) are kept like in the pass grid
+		float pixel[4];
+		lm_getLightmapPixel(ctx, texel.x, texel.y, pixel);
+		ctx->adaptive.done[i] = !lm_isZeroPixel(ctx, pixel);
+	}
+	ctx->meshPosition.pass = 0;
+	for (int pass = 0; pass < ctx->meshPosition.passCount; pass++)
+		passStart[pass + 1] += passStart[pass];
+	for (unsigned int i = 0; i < geometry->count; i++)
+		ctx->adaptive.order[passStart[ctx->adaptive.level[i]]++] = i;
+}
+
+// interpolates all samples that weren't rendered yet and estimates their errors.
+// returns the number of candidates above the error target, of which outForcedCount can't be interpolated at all.
+static unsigned int lm_estimateAdaptiveErrors(lm_context *ctx, unsigned int *outForcedCount)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_texel_tiles *error = &ctx->adaptive.error;
+	unsigned int candidates = 0, forced = 0;
+
+	// forget the previous estimates
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		if (ctx->adaptive.done[i])
+			continue;
+		lm_ivec2 texel = geometry->texel[i];
+		lm_setLightmapPixel(ctx, texel.x, texel.y, lm_zeroPixel);
+		lm_setTexelValue(error, texel.x, texel.y, lm_texelF(LM_ADAPTIVE_PENDING));
+	}
+
+	for (unsigned int k = 0; k < geometry->count; k++)
+	{
+		unsigned int i = ctx->adaptive.order[k];
+		ctx->adaptive.priority[i] = 0.0f;
+		if (ctx->adaptive.done[i])
+			continue;
+
+		lm_ivec2 texel = geometry->texel[i];
+		ctx->meshPosition.pass = ctx->adaptive.level[i];
+		float estimate = FLT_MAX; // can't be interpolated. has to be rendered.
+		lm_ivec2 neighborTexels[4];
+		int neighborCount;
+		if (ctx->meshPosition.pass > 0 && lm_getInterpolationNeighbors(ctx, i, neighborTexels, &neighborCount))
 		{
-			// calculate average neighbor pixel value
+			float neighbors[4][4];
+			float neighborErrors[4];
 			float avg[4] = { 0 };
-			for (int i = 0; i < neighborCount; i++)
+			int available = 0;
+			lm_bool blocked = LM_FALSE, missing = LM_FALSE;
+			for (int n = 0; n < neighborCount; n++)
+			{
+				lm_getLightmapPixel(ctx, neighborTexels[n].x, neighborTexels[n].y, neighbors[n]);
+				neighborErrors[n] = lm_getTexelValue(error, neighborTexels[n].x, neighborTexels[n].y).f;
+				lm_bool hasValue = neighborErrors[n] != LM_ADAPTIVE_PENDING && !lm_isZeroPixel(ctx, neighbors[n]);
+				if (neighborErrors[n] == LM_ADAPTIVE_BLOCKED)
+					blocked = LM_TRUE; // may still have an incomplete interpolation
+				else if (!hasValue)
+					missing = LM_TRUE; // not set at this point or invalid, same as in the pass grid
+				if (!hasValue)
+					continue;
 				for (int j = 0; j < ctx->lightmap.channels; j++)
-					avg[j] += neighbors[i][j];
-			float ni = 1.0f / neighborCount;
+					avg[j] += neighbors[n][j];
+				available++;
+			}
+			float ni = available ? 1.0f / available : 0.0f;
 			for (int j = 0; j < ctx->lightmap.channels; j++)
 				avg[j] *= ni;
 
-			// check if error from average pixel to neighbors is above the interpolation threshold
-			lm_bool interpolate = LM_TRUE;
-			for (int i = 0; i < neighborCount; i++)
+			if (!missing && !blocked && !lm_passesInterpolationGuard(ctx, i, neighborTexels, neighborCount))
 			{
-				lm_bool zero = LM_TRUE;
-				for (int j = 0; j < ctx->lightmap.channels; j++)
-				{
-					if (neighbors[i][j] != 0.0f)
-						zero = LM_FALSE;
-					if (fabs(neighbors[i][j] - avg[j]) > ctx->interpolationThreshold)
-						interpolate = LM_FALSE;
-				}
-				if (zero)
-					interpolate = LM_FALSE;
-				if (!interpolate)
-					break;
+				missing = LM_TRUE;
+				ctx->statistics.geometryRejections++;
 			}
 
-			// set interpolated value and return if interpolation is acceptable
-			if (interpolate)
+			if (!missing && !blocked)
 			{
-				lm_setLightmapPixel(ctx, ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y, avg);
-#ifdef LM_DEBUG_INTERPOLATION
-				// set interpolated pixel to green in debug output
-				ctx->lightmap.debug[(ctx->meshPosition.rasterizer.y * ctx->lightmap.width + ctx->meshPosition.rasterizer.x) * 3 + 1] = 255;
-#endif
-				return LM_FALSE;
+				float deviation = 0.0f, neighborError = 0.0f;
+				for (int n = 0; n < neighborCount; n++)
+				{
+					for (int j = 0; j < ctx->lightmap.channels; j++)
+						deviation = lm_maxf(deviation, lm_absf(neighbors[n][j] - avg[j]));
+					neighborError += neighborErrors[n];
+				}
+				estimate = deviation + neighborError * ni; // the neighbors may be interpolated themselves
+				lm_interpolateHitDistance(ctx, texel.x, texel.y, neighborTexels, neighborCount);
 			}
+			else if (!missing)
+				estimate = LM_ADAPTIVE_BLOCKED;
+
+			// incomplete interpolations are kept in case the budget runs out before the texel is rendered or interpolated
+			if (available)
+				lm_setLightmapPixel(ctx, texel.x, texel.y, avg);
+		}
+		lm_setTexelValue(error, texel.x, texel.y, lm_texelF(estimate == FLT_MAX ? LM_ADAPTIVE_BLOCKED : estimate));
+
+		if (estimate > ctx->adaptive.errorTarget)
+		{ // coarser passes interpolate larger areas and their results improve the estimates of the finer passes
+			float step = (float)lm_passStepSize(ctx);
+			ctx->adaptive.priority[i] = estimate == FLT_MAX ? FLT_MAX : estimate * step * step;
+			if (estimate == FLT_MAX)
+				forced++;
+			candidates++;
 		}
 	}
+	ctx->meshPosition.pass = 0;
 
-	// could not interpolate. must render a hemisphere.
-	// calculate 3D sample position and orientation
-	lm_vec3 p0 = ctx->meshPosition.triangle.p[0];
-	lm_vec3 p1 = ctx->meshPosition.triangle.p[1];
-	lm_vec3 p2 = ctx->meshPosition.triangle.p[2];
-	lm_vec3 v1 = lm_sub3(p1, p0);
-	lm_vec3 v2 = lm_sub3(p2, p0);
-	ctx->meshPosition.sample.position = lm_add3(p0, lm_add3(lm_scale3(v2, uv.x), lm_scale3(v1, uv.y)));
+	*outForcedCount = forced;
+	return candidates;
+}
 
-	lm_vec3 n0 = ctx->meshPosition.triangle.n[0];
-	lm_vec3 n1 = ctx->meshPosition.triangle.n[1];
-	lm_vec3 n2 = ctx->meshPosition.triangle.n[2];
-	lm_vec3 nv1 = lm_sub3(n1, n0);
-	lm_vec3 nv2 = lm_sub3(n2, n0);
-	ctx->meshPosition.sample.direction = lm_normalize3(lm_add3(n0, lm_add3(lm_scale3(nv2, uv.x), lm_scale3(nv1, uv.y))));
-	ctx->meshPosition.sample.direction = lm_normalize3(ctx->meshPosition.sample.direction);
-	float cameraToSurfaceDistance = (1.0f + ctx->hemisphere.cameraToSurfaceDistanceModifier) * ctx->hemisphere.zNear * sqrtf(2.0f);
-	ctx->meshPosition.sample.position = lm_add3(ctx->meshPosition.sample.position, lm_scale3(ctx->meshPosition.sample.direction, cameraToSurfaceDistance));
+static int lm_compareSampleIndices(const void *a, const void *b)
+{
+	unsigned int ia = *(const unsigned int*)a;
+	unsigned int ib = *(const unsigned int*)b;
+	return ia < ib ? -1 : ia > ib;
+}
 
-	if (!lm_finite3(ctx->meshPosition.sample.position) ||
-		!lm_finite3(ctx->meshPosition.sample.direction) ||
-		lm_length3sq(ctx->meshPosition.sample.direction) < 0.5f) // don't allow 0.0f. should always be ~1.0f
-		return LM_FALSE;
+// selects up to count candidates with the highest priorities (min-heap of the best candidates so far).
+static void lm_selectAdaptiveSamples(lm_context *ctx, unsigned int count)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	const float *priority = ctx->adaptive.priority;
+	unsigned int *heap = ctx->adaptive.selection;
+	unsigned int size = 0;
+	for (unsigned int k = 0; k < geometry->count && count > 0; k++)
+	{
+		unsigned int i = ctx->adaptive.order[k];
+		if (priority[i] <= 0.0f)
+			continue;
+
+		unsigned int node;
+		if (size < count)
+		{ // sift up
+			for (node = size++; node > 0 && priority[heap[(node - 1) / 2]] > priority[i]; node = (node - 1) / 2)
+				heap[node] = heap[(node - 1) / 2];
+		}
+		else if (priority[i] > priority[heap[0]])
+		{ // replace the lowest priority and sift down
+			for (node = 0; 2 * node + 1 < size;)
+			{
+				unsigned int child = 2 * node + 1;
+				if (child + 1 < size && priority[heap[child + 1]] < priority[heap[child]])
+					child++;
+				if (priority[heap[child]] >= priority[i])
+					break;
+				heap[node] = heap[child];
+				node = child;
+			}
+		}
+		else
+			continue;
+		heap[node] = i;
+	}
 
-	lm_vec3 up = lm_v3(0.0f, 1.0f, 0.0f);
-	if (lm_absf(lm_dot3(up, ctx->meshPosition.sample.direction)) > 0.8f)
-		up = lm_v3(0.0f, 0.0f, 1.0f);
+	// render them in the order of the prepared samples (see spatialSampleOrder)
+	qsort(heap, size, sizeof(unsigned int), lm_compareSampleIndices);
 
-#if 0
-	// triangle-consistent up vector
-	ctx->meshPosition.sample.up = lm_normalize3(lm_cross3(up, ctx->meshPosition.sample.direction));
-	return LM_TRUE;
-#else
-	// "randomized" rotation with pattern
-	lm_vec3 side = lm_normalize3(lm_cross3(up, ctx->meshPosition.sample.direction));
-	up = lm_normalize3(lm_cross3(side, ctx->meshPosition.sample.direction));
-	int rx = ctx->meshPosition.rasterizer.x % 3;
-	int ry = ctx->meshPosition.rasterizer.y % 3;
-	static const float lm_pi = 3.14159265358979f;
-	float phi = 2.0f * lm_pi * lm_baseAngles[ry][rx] + 0.1f * ((float)rand() / (float)RAND_MAX);
-	ctx->meshPosition.sample.up = lm_normalize3(lm_add3(lm_scale3(side, cosf(phi)), lm_scale3(up, sinf(phi))));
-	return LM_TRUE;
-#endif
+	for (unsigned int s = 0; s < size; s++)
+	{ // the rendered results replace the interpolated values
+		lm_ivec2 texel = geometry->texel[heap[s]];
+		lm_setLightmapPixel(ctx, texel.x, texel.y, lm_zeroPixel);
+		lm_setTexelValue(&ctx->adaptive.error, texel.x, texel.y, lm_texelF(0.0f));
+		ctx->adaptive.done[heap[s]] = 1;
+	}
+	ctx->adaptive.selectionCount = size;
+	ctx->adaptive.rendered += size;
 }
 
-// returns true if a sampling position was found and
-// false if we finished rasterizing the current triangle
-static lm_bool lm_findFirstConservativeTriangleRasterizerPosition(lm_context *ctx)
+// selects the samples of the next adaptive sampling round. returns false if there are none left.
+static lm_bool lm_scheduleAdaptiveRound(lm_context *ctx)
 {
-	while (!lm_trySamplingConservativeTriangleRasterizerPosition(ctx))
+	unsigned int forced;
+	unsigned int candidates = lm_estimateAdaptiveErrors(ctx, &forced);
+
+	// everything that can't be interpolated and the worse half of the other candidates.
+	// smaller rounds adapt better to the results, but wait for the GPU more often.
+	// with a budget, half of it is kept for texels that can only be judged once their neighbors are rendered.
+	// the batches are shared with the other queued meshes, so each of them only has to fill its part.
+	int batchSize = (int)(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY);
+	if (ctx->queue.baking)
+		batchSize /= (int)ctx->queue.count;
+	int others = (int)(candidates - forced) / 2;
+	if (ctx->adaptive.budget)
+		others = lm_mini(others, ((int)(ctx->adaptive.budget - ctx->adaptive.rendered) - (int)forced) / 2);
+	unsigned int count = forced + (unsigned int)lm_maxi(others, batchSize);
+	if (ctx->adaptive.budget)
+		count = (unsigned int)lm_mini((int)count, (int)(ctx->adaptive.budget - ctx->adaptive.rendered));
+	lm_selectAdaptiveSamples(ctx, count);
+
+#ifdef LM_DEBUG_INTERPOLATION
+	if (!ctx->adaptive.selectionCount)
 	{
-		lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
-		if (lm_hasConservativeTriangleRasterizerFinished(ctx))
-			return LM_FALSE;
+		// set interpolated pixels to green in debug output
+		const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+		for (unsigned int i = 0; i < geometry->count; i++)
+		{
+			lm_ivec2 texel = geometry->texel[i];
+			if (!ctx->adaptive.done[i] && lm_getTexelValue(&ctx->adaptive.error, texel.x, texel.y).f >= 0.0f)
+				lm_setDebugFlag(ctx, texel.x, texel.y, LM_DEBUG_INTERPOLATED);
+		}
 	}
-	return LM_TRUE;
+#endif
+
+	return ctx->adaptive.selectionCount > 0;
 }
 
-static lm_bool lm_findNextConservativeTriangleRasterizerPosition(lm_context *ctx)
+// irradiance caching: every rendered hemisphere becomes a record that is valid in a neighborhood
+// depending on the distance to the surrounding geometry (Ward et al. 1988). the records are found
+// through a spatial hash grid in which each record is inserted into all cells that it may be valid in.
+static void lm_freeIrradianceCache(lm_context *ctx)
 {
-	lm_moveToNextPotentialConservativeTriangleRasterizerPosition(ctx);
-	return lm_findFirstConservativeTriangleRasterizerPosition(ctx);
+	lm_deallocate(ctx->allocator, ctx->irradianceCache.records);
+	lm_deallocate(ctx->allocator, ctx->irradianceCache.buckets);
+	lm_deallocate(ctx->allocator, ctx->irradianceCache.entries);
+	ctx->irradianceCache.records = 0;
+	ctx->irradianceCache.buckets = 0;
+	ctx->irradianceCache.entries = 0;
+	ctx->irradianceCache.recordCount = ctx->irradianceCache.recordCapacity = 0;
+	ctx->irradianceCache.entryCount = ctx->irradianceCache.entryCapacity = 0;
 }
 
-static void lm_integrateHemisphereBatch(lm_context *ctx)
+// world space distance to the neighboring texels of a sample (0 => no neighbors in its chart)
+static float lm_getTexelSize(const lm_prepared_geometry *geometry, unsigned int index)
 {
-	if (!ctx->hemisphere.fbHemiIndex)
-		return; // nothing to do
-
-	glDisable(GL_DEPTH_TEST);
-	glBindVertexArray(ctx->hemisphere.vao);
-
-	int fbRead = 0;
-	int fbWrite = 1;
-
-	// weighted downsampling pass
-	int outHemiSize = ctx->hemisphere.size / 2;
-	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbWrite], 0);
-	glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * ctx->hemisphere.fbHemiCountY);
-	glUseProgram(ctx->hemisphere.firstPass.programID);
-	glUniform1i(ctx->hemisphere.firstPass.hemispheresTextureID, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
-	glUniform1i(ctx->hemisphere.firstPass.weightsTextureID, 1);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
-	glActiveTexture(GL_TEXTURE0);
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	//glBindTexture(GL_TEXTURE_2D, 0);
-
-#if 0
-	// debug output
-	int w = outHemiSize * ctx->hemisphere.fbHemiCountX, h = outHemiSize * ctx->hemisphere.fbHemiCountY;
-	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
-	float *image = new float[3 * w * h];
-	glReadPixels(0, 0, w, h, GL_RGB, GL_FLOAT, image);
-	lmImageSaveTGAf("firstpass.png", image, w, h, 3);
-	delete[] image;
-#endif
-
-	// downsampling passes
-	glUseProgram(ctx->hemisphere.downsamplePass.programID);
-	glUniform1i(ctx->hemisphere.downsamplePass.hemispheresTextureID, 0);
-	while (outHemiSize > 1)
+	static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	unsigned int chart = geometry->chart[geometry->triangle[index]];
+	float sum = 0.0f;
+	int count = 0;
+	for (int k = 0; k < 4; k++)
 	{
-		LM_SWAP(int, fbRead, fbWrite);
-		outHemiSize /= 2;
-		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
-		glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * ctx->hemisphere.fbHemiCountY);
-		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
-		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-		//glBindTexture(GL_TEXTURE_2D, 0);
+		int x = geometry->texel[index].x + offsets[k][0];
+		int y = geometry->texel[index].y + offsets[k][1];
+		if (!lm_isInChart(geometry, x, y, chart))
+			continue;
+		sum += lm_length3(lm_sub3(geometry->position[lm_getTexelValue(&geometry->sampleAt, x, y).u], geometry->position[index]));
+		count++;
 	}
+	return count ? sum / count : 0.0f;
+}
 
-	// copy results to storage texture
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.storage.texture);
-	glCopyTexSubImage2D(GL_TEXTURE_2D, 0,
-		ctx->hemisphere.storage.writePosition.x, ctx->hemisphere.storage.writePosition.y,
-		0, 0, ctx->hemisphere.fbHemiCountX, ctx->hemisphere.fbHemiCountY);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glBindVertexArray(0);
-	glEnable(GL_DEPTH_TEST);
+static void lm_resetIrradianceCache(lm_context *ctx)
+{
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_freeIrradianceCache(ctx);
+	ctx->irradianceCache.pass = 0;
+	ctx->irradianceCache.nextSample = 0;
 
-	// copy position mapping to storage
-	for (unsigned int y = 0; y < ctx->hemisphere.fbHemiCountY; y++)
+	double sum = 0.0;
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < geometry->count; i++)
 	{
-		int sy = ctx->hemisphere.storage.writePosition.y + y;
-		for (unsigned int x = 0; x < ctx->hemisphere.fbHemiCountX; x++)
-		{
-			int sx = ctx->hemisphere.storage.writePosition.x + x;
-			unsigned int hemiIndex = y * ctx->hemisphere.fbHemiCountX + x;
-			if (hemiIndex >= ctx->hemisphere.fbHemiIndex)
-				ctx->hemisphere.storage.toLightmapLocation[sy * ctx->lightmap.width + sx] = lm_i2(-1, -1);
-			else
-				ctx->hemisphere.storage.toLightmapLocation[sy * ctx->lightmap.width + sx] = ctx->hemisphere.fbHemiToLightmapLocation[hemiIndex];
-		}
+		float texelSize = lm_getTexelSize(geometry, i);
+		sum += texelSize;
+		count += texelSize > 0.0f;
 	}
+	ctx->irradianceCache.texelSize = count ? (float)(sum / count) : 1.0f;
+	float coarsestStep = (float)(1 << ((ctx->meshPosition.passCount - 1) / 3));
+	ctx->irradianceCache.cellSize = 2.0f * coarsestStep * ctx->irradianceCache.texelSize; // typical maximum record extent, see lm_addCacheRecord
+
+	ctx->irradianceCache.bucketCount = 1024;
+	while (ctx->irradianceCache.bucketCount < geometry->count / 16)
+		ctx->irradianceCache.bucketCount *= 2;
+	ctx->irradianceCache.buckets = (unsigned int*)lm_allocate(ctx->allocator, ctx->irradianceCache.bucketCount, sizeof(unsigned int));
+	memset(ctx->irradianceCache.buckets, 0xff, ctx->irradianceCache.bucketCount * sizeof(unsigned int));
+}
+
+static unsigned int lm_getCacheBucket(lm_context *ctx, int x, int y, int z)
+{
+	unsigned int hash = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ (unsigned int)z * 83492791u;
+	return hash & (ctx->irradianceCache.bucketCount - 1);
+}
+
+static unsigned int lm_getCacheBucketAt(lm_context *ctx, lm_vec3 p)
+{
+	float s = 1.0f / ctx->irradianceCache.cellSize;
+	return lm_getCacheBucket(ctx, (int)floorf(p.x * s), (int)floorf(p.y * s), (int)floorf(p.z * s));
+}
 
-	// advance storage texture write position
-	ctx->hemisphere.storage.writePosition.x += ctx->hemisphere.fbHemiCountX;
-	if (ctx->hemisphere.storage.writePosition.x + (int)ctx->hemisphere.fbHemiCountX > ctx->lightmap.width)
+// Ward's error estimate for using a record at a surface point (valid below the accuracy)
+static float lm_getCacheRecordError(const lm_cache_record *record, lm_vec3 position, lm_vec3 normal)
+{
+	lm_vec3 d = lm_sub3(position, record->position);
+	if (lm_dot3(d, lm_add3(normal, record->normal)) < -0.1f * record->radius)
+		return FLT_MAX; // the point is in front of the record
+	return lm_length3(d) / record->radius + sqrtf(lm_maxf(1.0f - lm_dot3(normal, record->normal), 0.0f));
+}
+
+// weighted extrapolation of all records that are valid at a surface point (out may be NULL).
+// returns the sum of the weights (0 => no valid records).
+static float lm_extrapolateIrradiance(lm_context *ctx, lm_vec3 position, lm_vec3 normal, float *out)
+{
+	if (!ctx->irradianceCache.recordCount)
+		return 0.0f;
+
+	float accuracy = ctx->irradianceCache.accuracy;
+	float sum[4] = { 0 };
+	float weightSum = 0.0f;
+	unsigned int entry = ctx->irradianceCache.buckets[lm_getCacheBucketAt(ctx, position)];
+	for (; entry != LM_NO_SAMPLE; entry = ctx->irradianceCache.entries[entry].next)
 	{
-		ctx->hemisphere.storage.writePosition.x = 0;
-		ctx->hemisphere.storage.writePosition.y += ctx->hemisphere.fbHemiCountY;
-		assert(ctx->hemisphere.storage.writePosition.y + (int)ctx->hemisphere.fbHemiCountY < ctx->lightmap.height);
+		const lm_cache_record *record = ctx->irradianceCache.records + ctx->irradianceCache.entries[entry].record;
+		float error = lm_getCacheRecordError(record, position, normal);
+		if (error >= accuracy)
+			continue;
+		float weight = 1.0f / lm_maxf(error, 1e-6f) - 1.0f / accuracy; // falls off to 0 at the border of the valid region
+		weightSum += weight;
+		if (!out)
+			continue;
+
+		lm_vec3 d = lm_sub3(position, record->position);
+		float dt = lm_dot3(d, record->tangent);
+		float db = lm_dot3(d, record->bitangent);
+		for (int j = 0; j < ctx->lightmap.channels; j++)
+			sum[j] += weight * lm_maxf(record->value[j] + record->gradient[0][j] * dt + record->gradient[1][j] * db, 0.0f);
 	}
-
-	ctx->hemisphere.fbHemiIndex = 0;
+	if (out && weightSum > 0.0f)
+		for (int j = 0; j < ctx->lightmap.channels; j++)
+			out[j] = lm_maxf(sum[j] / weightSum, FLT_MIN);
+	return weightSum;
 }
 
-static void lm_writeResultsToLightmap(lm_context *ctx)
+static void lm_addCacheRecord(lm_context *ctx, unsigned int index)
 {
-	// do the GPU->CPU transfer of downsampled hemispheres
-	float *hemi = (float*)LM_CALLOC(ctx->lightmap.width * ctx->lightmap.height, 4 * sizeof(float));
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.storage.texture);
-	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, hemi);
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+	lm_ivec2 texel = geometry->texel[index];
+	float pixel[4];
+	lm_getLightmapPixel(ctx, texel.x, texel.y, pixel);
+	if (lm_isZeroPixel(ctx, pixel))
+		return; // invalid hemisphere
+
+	if (ctx->irradianceCache.recordCount == ctx->irradianceCache.recordCapacity)
+	{
+		unsigned int capacity = lm_maxi(2 * ctx->irradianceCache.recordCapacity, 1024);
+		lm_cache_record *records = (lm_cache_record*)lm_allocate(ctx->allocator, capacity, sizeof(lm_cache_record));
+		if (ctx->irradianceCache.recordCount)
+			memcpy(records, ctx->irradianceCache.records, ctx->irradianceCache.recordCount * sizeof(lm_cache_record));
+		lm_deallocate(ctx->allocator, ctx->irradianceCache.records);
+		ctx->irradianceCache.records = records;
+		ctx->irradianceCache.recordCapacity = capacity;
+	}
+	unsigned int r = ctx->irradianceCache.recordCount++;
+	lm_cache_record *record = ctx->irradianceCache.records + r;
+	record->position = geometry->position[index];
+	record->normal = geometry->normal[index];
+	record->tangent = geometry->up[index];
+	record->bitangent = lm_cross3(record->normal, record->tangent);
+	for (int j = 0; j < ctx->lightmap.channels; j++)
+		record->value[j] = pixel[j];
+
+	// the radius is clamped so that every record covers its direct neighbors,
+	// but doesn't reach further than two coarsest grid steps.
+	float texelSize = lm_getTexelSize(geometry, index);
+	if (texelSize <= 0.0f)
+		texelSize = ctx->irradianceCache.texelSize;
+	float accuracy = ctx->irradianceCache.accuracy;
+	float coarsestStep = (float)(1 << ((ctx->meshPosition.passCount - 1) / 3));
+	float maxExtent = lm_minf(2.0f * coarsestStep * texelSize, 2.0f * ctx->irradianceCache.cellSize);
+	record->radius = lm_getTexelValue(&ctx->interpolationGuard.hitDistance, texel.x, texel.y).f;
+	record->radius = lm_minf(lm_maxf(record->radius, 1.5f * texelSize / accuracy), maxExtent / accuracy);
+
+	// neighbor clamping (Krivanek et al. 2006): the radii of overlapping records differ at most by their distance,
+	// so that the small radii next to occluders limit the reach of the records around them.
+	// shrinking the older records is fine, since they stay in all cells of their larger regions.
+	unsigned int entry = ctx->irradianceCache.buckets[lm_getCacheBucketAt(ctx, record->position)];
+	for (; entry != LM_NO_SAMPLE; entry = ctx->irradianceCache.entries[entry].next)
+	{
+		lm_cache_record *other = ctx->irradianceCache.records + ctx->irradianceCache.entries[entry].record;
+		float distance = lm_length3(lm_sub3(other->position, record->position));
+		if (distance >= accuracy * (other->radius + record->radius))
+			continue;
+		record->radius = lm_minf(record->radius, other->radius + distance);
+		other->radius = lm_minf(other->radius, record->radius + distance);
+	}
 
-	// write results to lightmap texture
-	for (int y = 0; y < ctx->hemisphere.storage.writePosition.y + (int)ctx->hemisphere.fbHemiCountY; y++)
+	// insert it into all grid cells that overlap its valid region
+	float extent = accuracy * record->radius;
+	float s = 1.0f / ctx->irradianceCache.cellSize;
+	int x0 = (int)floorf((record->position.x - extent) * s), x1 = (int)floorf((record->position.x + extent) * s);
+	int y0 = (int)floorf((record->position.y - extent) * s), y1 = (int)floorf((record->position.y + extent) * s);
+	int z0 = (int)floorf((record->position.z - extent) * s), z1 = (int)floorf((record->position.z + extent) * s);
+	for (int z = z0; z <= z1; z++)
 	{
-		for (int x = 0; x < ctx->lightmap.width; x++)
+		for (int y = y0; y <= y1; y++)
 		{
-			lm_ivec2 lmUV = ctx->hemisphere.storage.toLightmapLocation[y * ctx->lightmap.width + x];
-			if (lmUV.x >= 0)
+			for (int x = x0; x <= x1; x++)
 			{
-				float *c = hemi + (y * ctx->lightmap.width + x) * 4;
-				float validity = c[3];
-				float *lm = ctx->lightmap.data + (lmUV.y * ctx->lightmap.width + lmUV.x) * ctx->lightmap.channels;
-				if (!lm[0] && validity > 0.9)
-				{
-					float scale = 1.0f / validity;
-					switch (ctx->lightmap.channels)
-					{
-					case 1:
-						lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
-						break;
-					case 2:
-						lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
-						lm[1] = 1.0f; // do we want to support this format?
-						break;
-					case 3:
-						lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
-						lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
-						lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
-						break;
-					case 4:
-						lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
-						lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
-						lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
-						lm[3] = 1.0f;
-						break;
-					default:
-						assert(LM_FALSE);
-						break;
-					}
+				unsigned int bucket = lm_getCacheBucket(ctx, x, y, z);
+				unsigned int head = ctx->irradianceCache.buckets[bucket];
+				if (head != LM_NO_SAMPLE && ctx->irradianceCache.entries[head].record == r)
+					continue; // another cell of this record has the same hash
 
-#ifdef LM_DEBUG_INTERPOLATION
-					// set sampled pixel to red in debug output
-					ctx->lightmap.debug[(lmUV.y * ctx->lightmap.width + lmUV.x) * 3 + 0] = 255;
-#endif
+				if (ctx->irradianceCache.entryCount == ctx->irradianceCache.entryCapacity)
+				{
+					unsigned int capacity = lm_maxi(2 * ctx->irradianceCache.entryCapacity, 4096);
+					lm_cache_entry *entries = (lm_cache_entry*)lm_allocate(ctx->allocator, capacity, sizeof(lm_cache_entry));
+					if (ctx->irradianceCache.entryCount)
+						memcpy(entries, ctx->irradianceCache.entries, ctx->irradianceCache.entryCount * sizeof(lm_cache_entry));
+					lm_deallocate(ctx->allocator, ctx->irradianceCache.entries);
+					ctx->irradianceCache.entries = entries;
+					ctx->irradianceCache.entryCapacity = capacity;
 				}
+				lm_cache_entry *entry = ctx->irradianceCache.entries + ctx->irradianceCache.entryCount;
+				entry->record = r;
+				entry->next = head;
+				ctx->irradianceCache.buckets[bucket] = ctx->irradianceCache.entryCount++;
 			}
-			ctx->hemisphere.storage.toLightmapLocation[y * ctx->lightmap.width + x].x = -1; // reset
 		}
 	}
-
-	LM_FREE(hemi);
-	ctx->hemisphere.storage.writePosition = lm_i2(0, 0);
 }
 
-static void lm_setView(
-	int* viewport, int x, int y, int w, int h,
-	float* view,   lm_vec3 pos, lm_vec3 dir, lm_vec3 up,
-	float* proj,   float l, float r, float b, float t, float n, float f)
+// translational gradients: least squares fit of the values of the records that are valid at each record.
+// the gradients are limited so that the extrapolation stays within the range of the fitted values.
+static void lm_computeCacheGradients(lm_context *ctx)
 {
-	// viewport
-	viewport[0] = x; viewport[1] = y; viewport[2] = w; viewport[3] = h;
-
-	// view matrix: lookAt(pos, pos + dir, up)
-	lm_vec3 side = lm_cross3(dir, up);
-	//up = cross(side, dir);
-	dir = lm_negate3(dir); pos = lm_negate3(pos);
-	view[ 0] = side.x;             view[ 1] = up.x;             view[ 2] = dir.x;             view[ 3] = 0.0f;
-	view[ 4] = side.y;             view[ 5] = up.y;             view[ 6] = dir.y;             view[ 7] = 0.0f;
-	view[ 8] = side.z;             view[ 9] = up.z;             view[10] = dir.z;             view[11] = 0.0f;
-	view[12] = lm_dot3(side, pos); view[13] = lm_dot3(up, pos); view[14] = lm_dot3(dir, pos); view[15] = 1.0f;
+	lm_cache_record *records = ctx->irradianceCache.records;
+	for (unsigned int r = 0; r < ctx->irradianceCache.recordCount; r++)
+	{
+		lm_cache_record *record = records + r;
+		float att = 0.0f, atb = 0.0f, abb = 0.0f;
+		float bt[4] = { 0 }, bb[4] = { 0 }, maxChange[4] = { 0 };
+		unsigned int entry = ctx->irradianceCache.buckets[lm_getCacheBucketAt(ctx, record->position)];
+		for (; entry != LM_NO_SAMPLE; entry = ctx->irradianceCache.entries[entry].next)
+		{
+			const lm_cache_record *other = records + ctx->irradianceCache.entries[entry].record;
+			if (other == record || lm_getCacheRecordError(other, record->position, record->normal) >= ctx->irradianceCache.accuracy)
+				continue;
+			lm_vec3 d = lm_sub3(other->position, record->position);
+			float dt = lm_dot3(d, record->tangent);
+			float db = lm_dot3(d, record->bitangent);
+			att += dt * dt; atb += dt * db; abb += db * db;
+			for (int j = 0; j < ctx->lightmap.channels; j++)
+			{
+				float dv = other->value[j] - record->value[j];
+				bt[j] += dt * dv;
+				bb[j] += db * dv;
+				maxChange[j] = lm_maxf(maxChange[j], lm_absf(dv));
+			}
+		}
 
-	// projection matrix: frustum(l, r, b, t, n, f)
-	float ilr = 1.0f / (r - l), ibt = 1.0f / (t - b), ninf = -1.0f / (f - n), n2 = 2.0f * n;
-	proj[ 0] = n2 * ilr;      proj[ 1] = 0.0f;          proj[ 2] = 0.0f;           proj[ 3] = 0.0f;
-	proj[ 4] = 0.0f;          proj[ 5] = n2 * ibt;      proj[ 6] = 0.0f;           proj[ 7] = 0.0f;
-	proj[ 8] = (r + l) * ilr; proj[ 9] = (t + b) * ibt; proj[10] = (f + n) * ninf; proj[11] = -1.0f;
-	proj[12] = 0.0f;          proj[13] = 0.0f;          proj[14] = f * n2 * ninf;  proj[15] = 0.0f;
+		float det = att * abb - atb * atb;
+		if (det <= 1e-4f * (att + abb) * (att + abb))
+			continue; // less than two independent directions. no gradient.
+		float invDet = 1.0f / det;
+		float extent = ctx->irradianceCache.accuracy * record->radius;
+		for (int j = 0; j < ctx->lightmap.channels; j++)
+		{
+			float gt = (abb * bt[j] - atb * bb[j]) * invDet;
+			float gb = (att * bb[j] - atb * bt[j]) * invDet;
+			float change = sqrtf(gt * gt + gb * gb) * extent;
+			float scale = change > maxChange[j] ? maxChange[j] / change : 1.0f;
+			record->gradient[0][j] = gt * scale;
+			record->gradient[1][j] = gb * scale;
+		}
+	}
 }
 
-// returns true if a hemisphere side was prepared for rendering and
-// false if we finished the current hemisphere
-static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* view, float* proj)
+// selects the texels of the next pass that no record is valid for. returns false if there are none left.
+// all remaining texels are extrapolated from the cache at the end.
+static lm_bool lm_scheduleCacheRound(lm_context *ctx)
 {
-	if (ctx->meshPosition.hemisphere.side >= 5)
-		return LM_FALSE;
-
-	if (ctx->meshPosition.hemisphere.side == 0)
+	const lm_prepared_geometry *geometry = ctx->mesh.geometry;
+
+	// the hemispheres of the previous round become records
+	for (unsigned int s = 0; s < ctx->adaptive.selectionCount; s++)
+		lm_addCacheRecord(ctx, ctx->adaptive.selection[s]);
+	ctx->adaptive.selectionCount = 0;
+
+	// coarser passes first: their records decide which texels of the finer passes are needed.
+	// the new records may shrink the radii of older ones (see lm_addCacheRecord), so after the last pass
+	// all texels are checked again until every texel is rendered or has a valid record.
+	unsigned int left = ctx->adaptive.budget ? ctx->adaptive.budget - ctx->adaptive.rendered : geometry->count;
+	while (ctx->irradianceCache.pass <= ctx->meshPosition.passCount && !ctx->adaptive.selectionCount && left)
 	{
-		// prepare hemisphere
-		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[0]);
-		if (ctx->hemisphere.fbHemiIndex == 0)
+		lm_bool lastPass = ctx->irradianceCache.pass == ctx->meshPosition.passCount;
+		unsigned int k = lastPass ? 0 : ctx->irradianceCache.nextSample;
+		for (; k < geometry->count && (lastPass || ctx->adaptive.level[ctx->adaptive.order[k]] == ctx->irradianceCache.pass); k++)
 		{
-			// prepare hemisphere batch
-			glClearColor( // clear to valid background pixels!
-				ctx->hemisphere.clearColor.r,
-				ctx->hemisphere.clearColor.g,
-				ctx->hemisphere.clearColor.b, 1.0f);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			unsigned int i = ctx->adaptive.order[k];
+			if (ctx->adaptive.done[i] || lm_extrapolateIrradiance(ctx, geometry->position[i], geometry->normal[i], NULL) > 0.0f)
+				continue;
+			if (ctx->adaptive.selectionCount == left)
+				break; // out of budget
+			ctx->adaptive.selection[ctx->adaptive.selectionCount++] = i;
+			ctx->adaptive.done[i] = 1;
 		}
-		ctx->hemisphere.fbHemiToLightmapLocation[ctx->hemisphere.fbHemiIndex] =
-			lm_i2(ctx->meshPosition.rasterizer.x, ctx->meshPosition.rasterizer.y);
+		if (!lastPass)
+			ctx->irradianceCache.nextSample = k;
+		if (!lastPass || !ctx->adaptive.selectionCount)
+			ctx->irradianceCache.pass++;
 	}
+	ctx->adaptive.rendered += ctx->adaptive.selectionCount;
+	if (ctx->adaptive.selectionCount)
+		return LM_TRUE;
 
-	// find the target position in the batch
-	int x = (ctx->hemisphere.fbHemiIndex % ctx->hemisphere.fbHemiCountX) * ctx->hemisphere.size * 3;
-	int y = (ctx->hemisphere.fbHemiIndex / ctx->hemisphere.fbHemiCountX) * ctx->hemisphere.size;
-
-	int size = ctx->hemisphere.size;
-	float zNear = ctx->hemisphere.zNear;
-	float zFar = ctx->hemisphere.zFar;
+	lm_computeCacheGradients(ctx);
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		lm_ivec2 texel = geometry->texel[i];
+		float value[4];
+		if (ctx->adaptive.done[i] || !lm_extrapolateIrradiance(ctx, geometry->position[i], geometry->normal[i], value))
+			continue; // texels that no record is valid for only remain once the budget is used up
+		lm_setLightmapPixel(ctx, texel.x, texel.y, value);
 
-	lm_vec3 pos = ctx->meshPosition.sample.position;
-	lm_vec3 dir = ctx->meshPosition.sample.direction;
-	lm_vec3 up = ctx->meshPosition.sample.up;
-	lm_vec3 right = lm_cross3(dir, up);
+#ifdef LM_DEBUG_INTERPOLATION
+		// set extrapolated pixels to green in debug output
+		lm_setDebugFlag(ctx, texel.x, texel.y, LM_DEBUG_INTERPOLATED);
+#endif
+	}
+	return LM_FALSE;
+}
 
-	// find the view parameters of the hemisphere side that we will render next
-	// hemisphere layout in the framebuffer:
-	//       +-------+---+---+-------+
-	//       |       |   |   |   D   |
-	//       |   C   | R | L +-------+
-	//       |       |   |   |   U   |
-	//       +-------+---+---+-------+
-	switch (ctx->meshPosition.hemisphere.side)
-	{
-	case 0: // center
-		lm_setView(viewport, x, y, size, size,
-				   view,     pos, dir, up,
-				   proj,     -zNear, zNear, -zNear, zNear, zNear, zFar);
-		break;
-	case 1: // right
-		lm_setView(viewport, size + x, y, size / 2, size,
-				   view,     pos, right, up,
-				   proj,     -zNear, 0.0f, -zNear, zNear, zNear, zFar);
-		break;
-	case 2: // left
-		lm_setView(viewport, size + x + size / 2, y, size / 2, size,
-				   view,     pos, lm_negate3(right), up,
-				   proj,     0.0f, zNear, -zNear, zNear, zNear, zFar);
-		break;
-	case 3: // down
-		lm_setView(viewport, 2 * size + x, y + size / 2, size, size / 2,
-				   view,     pos, lm_negate3(up), dir,
-				   proj,     -zNear, zNear, 0.0f, zNear, zNear, zFar);
-		break;
-	case 4: // up
-		lm_setView(viewport, 2 * size + x, y, size, size / 2,
-				   view,     pos, up, lm_negate3(dir),
-				   proj,     -zNear, zNear, -zNear, 0.0f, zNear, zFar);
-		break;
-	default:
-		assert(LM_FALSE);
-		break;
+// bake queue: the passes (or adaptive sampling rounds) of all queued meshes are done side by side.
+// the hemispheres of a pass of one mesh are followed by those of the next mesh in the same batches,
+// and only when the pass of every mesh is gathered, the remaining results are waited for.
+static float lm_meshProgress(lm_context *ctx)
+{
+	if (ctx->meshPosition.pass == ctx->meshPosition.passCount)
+		return 1.0f;
+	if (ctx->irradianceCache.enabled)
+	{ // one round per pass
+		float roundProgress = ctx->adaptive.selectionCount ? (float)ctx->meshPosition.sampleIndex / (float)ctx->adaptive.selectionCount : 0.0f;
+		return lm_minf(lm_maxf((float)ctx->irradianceCache.pass - 1.0f + roundProgress, 0.0f) / (float)ctx->meshPosition.passCount, 1.0f);
+	}
+	if (ctx->adaptive.enabled)
+	{ // the number of rounds isn't known in advance
+		unsigned int total = ctx->adaptive.budget ? (unsigned int)lm_mini((int)ctx->adaptive.budget, (int)ctx->mesh.geometry->count) : ctx->mesh.geometry->count;
+		unsigned int rendered = ctx->adaptive.rendered - ctx->adaptive.selectionCount + ctx->meshPosition.sampleIndex;
+		return total ? lm_minf((float)rendered / (float)total, 1.0f) : 1.0f;
 	}
+	float passProgress = ctx->mesh.geometry->count ? (float)ctx->meshPosition.sampleIndex / (float)ctx->mesh.geometry->count : 1.0f;
+	return ((float)ctx->meshPosition.pass + passProgress) / (float)ctx->meshPosition.passCount;
+}
 
-	return LM_TRUE;
+static void lm_storeQueuedMesh(lm_context *ctx, lm_queued_mesh *mesh)
+{
+	mesh->mesh = ctx->mesh;
+	mesh->meshPosition = ctx->meshPosition;
+	mesh->lightmap = ctx->lightmap;
+	mesh->adaptive = ctx->adaptive;
+	mesh->interpolationGuard = ctx->interpolationGuard;
+	mesh->irradianceCache = ctx->irradianceCache;
+	mesh->progress = lm_meshProgress(ctx);
 }
 
-static void lm_endSampleHemisphere(lm_context *ctx)
+static void lm_loadQueuedMesh(lm_context *ctx, const lm_queued_mesh *mesh)
 {
-	if (++ctx->meshPosition.hemisphere.side == 5)
-	{
-		// finish hemisphere
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		if (++ctx->hemisphere.fbHemiIndex == ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY)
-		{
-			// downsample new hemisphere batch and store the results
-			lm_integrateHemisphereBatch(ctx);
-		}
-	}
+	ctx->mesh = mesh->mesh;
+	ctx->meshPosition = mesh->meshPosition;
+	ctx->lightmap = mesh->lightmap;
+	ctx->adaptive = mesh->adaptive;
+	ctx->interpolationGuard = mesh->interpolationGuard;
+	ctx->irradianceCache = mesh->irradianceCache;
 }
 
-static void lm_inverseTranspose(const float *m44, float *n33)
+// swaps the state of the current queued mesh in the context with the one of another queued mesh
+static void lm_selectQueuedMesh(lm_context *ctx, unsigned int index)
 {
-	if (!m44)
-	{
-		n33[0] = 1.0f; n33[1] = 0.0f; n33[2] = 0.0f;
-		n33[3] = 0.0f; n33[4] = 1.0f; n33[5] = 0.0f;
-		n33[6] = 0.0f; n33[7] = 0.0f; n33[8] = 1.0f;
+	if (index == ctx->queue.current)
 		return;
-	}
-
-	float determinant = m44[ 0] * (m44[ 5] * m44[10] - m44[ 9] * m44[ 6])
-					  - m44[ 1] * (m44[ 4] * m44[10] - m44[ 6] * m44[ 8])
-					  + m44[ 2] * (m44[ 4] * m44[ 9] - m44[ 5] * m44[ 8]);
+	lm_queued_mesh *mesh = ctx->queue.meshes + ctx->queue.current;
+	lm_storeQueuedMesh(ctx, mesh);
+	ctx->queue.progress += mesh->progress;
+	mesh = ctx->queue.meshes + index;
+	lm_loadQueuedMesh(ctx, mesh);
+	ctx->queue.progress -= mesh->progress;
+	ctx->queue.current = index;
+}
 
-	assert(fabs(determinant) > FLT_EPSILON);
-	float rcpDeterminant = 1.0f / determinant;
+// the mesh state in the context only points to the memory of a queued mesh (or to nothing): forget it without freeing it
+static void lm_detachMeshState(lm_context *ctx)
+{
+	ctx->mesh.geometry = 0;
+	ctx->mesh.owned = 0;
+	ctx->adaptive.level = 0;
+	ctx->adaptive.done = 0;
+	ctx->adaptive.priority = 0;
+	ctx->adaptive.order = 0;
+	ctx->adaptive.selection = 0;
+	ctx->adaptive.error.tiles = 0;
+	ctx->interpolationGuard.hitDistance.tiles = 0;
+	ctx->irradianceCache.records = 0;
+	ctx->irradianceCache.buckets = 0;
+	ctx->irradianceCache.entries = 0;
+	ctx->irradianceCache.recordCount = ctx->irradianceCache.recordCapacity = 0;
+	ctx->irradianceCache.entryCount = ctx->irradianceCache.entryCapacity = 0;
+}
 
-	n33[0] =  (m44[ 5] * m44[10] - m44[ 9] * m44[ 6]) * rcpDeterminant;
-	n33[3] = -(m44[ 1] * m44[10] - m44[ 2] * m44[ 9]) * rcpDeterminant;
-	n33[6] =  (m44[ 1] * m44[ 6] - m44[ 2] * m44[ 5]) * rcpDeterminant;
-	n33[1] = -(m44[ 4] * m44[10] - m44[ 6] * m44[ 8]) * rcpDeterminant;
-	n33[4] =  (m44[ 0] * m44[10] - m44[ 2] * m44[ 8]) * rcpDeterminant;
-	n33[7] = -(m44[ 0] * m44[ 6] - m44[ 4] * m44[ 2]) * rcpDeterminant;
-	n33[2] =  (m44[ 4] * m44[ 9] - m44[ 8] * m44[ 5]) * rcpDeterminant;
-	n33[5] = -(m44[ 0] * m44[ 9] - m44[ 8] * m44[ 1]) * rcpDeterminant;
-	n33[8] =  (m44[ 0] * m44[ 5] - m44[ 4] * m44[ 1]) * rcpDeterminant;
+static void lm_freeMeshState(lm_context *ctx)
+{
+	lmDestroyPreparedGeometry(ctx->mesh.owned);
+	ctx->mesh.owned = 0;
+	lm_freeAdaptiveSampling(ctx);
+	lm_freeIrradianceCache(ctx);
+	lm_freeTexelTiles(&ctx->interpolationGuard.hitDistance);
 }
 
-static lm_vec3 lm_transformNormal(const float *m, lm_vec3 n)
+#ifdef LM_DEBUG_INTERPOLATION
+// keeps the current target lightmap with the debug flags that the queued meshes share until the queue is done
+static void lm_keepDebugTarget(lm_context *ctx)
 {
-	lm_vec3 r;
-	r.x = m[0] * n.x + m[3] * n.y + m[6] * n.z;
-	r.y = m[1] * n.x + m[4] * n.y + m[7] * n.z;
-	r.z = m[2] * n.x + m[5] * n.y + m[8] * n.z;
-	return r;
+	if (ctx->queue.debugTargetCount == ctx->queue.debugTargetCapacity)
+	{
+		unsigned int capacity = lm_maxi(2 * ctx->queue.debugTargetCapacity, 4);
+		lm_target_lightmap *targets = (lm_target_lightmap*)lm_allocate(ctx->allocator, capacity, sizeof(lm_target_lightmap));
+		if (ctx->queue.debugTargetCount)
+			memcpy(targets, ctx->queue.debugTargets, ctx->queue.debugTargetCount * sizeof(lm_target_lightmap));
+		lm_deallocate(ctx->allocator, ctx->queue.debugTargets);
+		ctx->queue.debugTargets = targets;
+		ctx->queue.debugTargetCapacity = capacity;
+	}
+	ctx->queue.debugTargets[ctx->queue.debugTargetCount++] = ctx->lightmap;
 }
 
-static lm_vec3 lm_transformPosition(const float *m, lm_vec3 v)
+// whether the last queued mesh bakes into the current target lightmap
+static lm_bool lm_isQueueTarget(const lm_context *ctx)
 {
-	if (!m)
-		return v;
-	lm_vec3 r;
-	r.x =     m[0] * v.x + m[4] * v.y + m[ 8] * v.z + m[12];
-	r.y =     m[1] * v.x + m[5] * v.y + m[ 9] * v.z + m[13];
-	r.z =     m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14];
-	float d = m[3] * v.x + m[7] * v.y + m[11] * v.z + m[15];
-	assert(lm_absf(d - 1.0f) < 0.00001f); // could divide by d, but this shouldn't be a projection transform!
-	return r;
+	return ctx->queue.count && ctx->queue.meshes[ctx->queue.count - 1].lightmap.debug.tiles == ctx->lightmap.debug.tiles;
 }
+#endif
 
-static void lm_setMeshPosition(lm_context *ctx, unsigned int indicesTriangleBaseIndex)
+// drops all queued meshes (lmDestroy or after the last pass) and restores the target lightmap of the context
+static void lm_clearQueue(lm_context *ctx)
 {
-	// fetch triangle at the specified indicesTriangleBaseIndex
-	ctx->meshPosition.triangle.baseIndex = indicesTriangleBaseIndex;
+	if (!ctx->queue.count && !ctx->queue.baking)
+		return;
+	if (!ctx->queue.baking)
+		ctx->queue.lightmap = ctx->lightmap;
+	else if (ctx->queue.count)
+		lm_storeQueuedMesh(ctx, ctx->queue.meshes + ctx->queue.current);
+	for (unsigned int i = 0; i < ctx->queue.count; i++)
+	{
+		lm_loadQueuedMesh(ctx, ctx->queue.meshes + i);
+		lm_freeMeshState(ctx);
+	}
+	lm_detachMeshState(ctx);
+	ctx->lightmap = ctx->queue.lightmap;
+#ifdef LM_DEBUG_INTERPOLATION
+	for (unsigned int i = 0; i < ctx->queue.debugTargetCount; i++)
+	{
+		if (ctx->queue.debugTargets[i].debug.tiles != ctx->lightmap.debug.tiles) // the context keeps its own
+			lm_freeTexelTiles(&ctx->queue.debugTargets[i].debug);
+	}
+	ctx->queue.debugTargetCount = 0;
+#endif
+	ctx->meshPosition.pass = ctx->meshPosition.passCount; // like after the last pass of a single mesh
+	ctx->queue.count = 0;
+	ctx->queue.current = 0;
+	ctx->queue.baking = LM_FALSE;
+}
 
-	// load and transform triangle to process next
-	lm_vec2 uvMin = lm_v2(FLT_MAX, FLT_MAX), uvMax = lm_v2(-FLT_MAX, -FLT_MAX);
-	lm_vec2 uvScale = lm_v2i(ctx->lightmap.width, ctx->lightmap.height);
-	unsigned int vIndices[3];
-	for (int i = 0; i < 3; i++)
+static void lm_writeResultsToLightmap(lm_context *ctx, const float *hemi, const lm_ivec2 *toLightmapLocation, unsigned int count)
+{
+	// write results to lightmap texture
+	for (unsigned int i = 0; i < count; i++)
 	{
-		// decode index
-		unsigned int vIndex;
-		switch (ctx->mesh.indicesType)
-		{
-		case LM_NONE:
-			vIndex = ctx->meshPosition.triangle.baseIndex + i;
-			break;
-		case LM_UNSIGNED_BYTE:
-			vIndex = ((const unsigned char*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		case LM_UNSIGNED_SHORT:
-			vIndex = ((const unsigned short*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		case LM_UNSIGNED_INT:
-			vIndex = ((const unsigned int*)ctx->mesh.indices + ctx->meshPosition.triangle.baseIndex)[i];
-			break;
-		default:
-			assert(LM_FALSE);
-			break;
-		}
-		vIndices[i] = vIndex;
+		lm_ivec2 lmUV = toLightmapLocation[i];
+		const float *c = hemi + i * 4;
+		float validity = c[3];
+		float lm[4];
+		lm_getLightmapPixel(ctx, lmUV.x, lmUV.y, lm);
+		if (!lm[0] && validity > 0.9)
+		{
+			float scale = 1.0f / validity;
+			switch (ctx->lightmap.channels)
+			{
+			case 1:
+				lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
+				break;
+			case 2:
+				lm[0] = lm_maxf((c[0] + c[1] + c[2]) * scale / 3.0f, FLT_MIN);
+				lm[1] = 1.0f; // do we want to support this format?
+				break;
+			case 3:
+				lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
+				lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
+				lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
+				break;
+			case 4:
+				lm[0] = lm_maxf(c[0] * scale, FLT_MIN);
+				lm[1] = lm_maxf(c[1] * scale, FLT_MIN);
+				lm[2] = lm_maxf(c[2] * scale, FLT_MIN);
+				lm[3] = 1.0f;
+				break;
+			default:
+				assert(LM_FALSE);
+				break;
+			}
+			lm_setLightmapPixel(ctx, lmUV.x, lmUV.y, lm);
 
-		// decode and pre-transform vertex position
-		const void *pPtr = ctx->mesh.positions + vIndex * ctx->mesh.positionsStride;
-		lm_vec3 p;
-		switch (ctx->mesh.positionsType)
-		{
-		// TODO: signed formats
-		case LM_UNSIGNED_BYTE: {
-			const unsigned char *uc = (const unsigned char*)pPtr;
-			p = lm_v3(uc[0], uc[1], uc[2]);
-		} break;
-		case LM_UNSIGNED_SHORT: {
-			const unsigned short *us = (const unsigned short*)pPtr;
-			p = lm_v3(us[0], us[1], us[2]);
-		} break;
-		case LM_UNSIGNED_INT: {
-			const unsigned int *ui = (const unsigned int*)pPtr;
-			p = lm_v3((float)ui[0], (float)ui[1], (float)ui[2]);
-		} break;
-		case LM_FLOAT: {
-			p = *(const lm_vec3*)pPtr;
-		} break;
-		default: {
-			assert(LM_FALSE);
-		} break;
-		}
-		ctx->meshPosition.triangle.p[i] = lm_transformPosition(ctx->mesh.modelMatrix, p);
-
-		// decode and scale (to lightmap resolution) vertex lightmap texture coords
-		const void *uvPtr = ctx->mesh.uvs + vIndex * ctx->mesh.uvsStride;
-		lm_vec2 uv;
-		switch (ctx->mesh.uvsType)
-		{
-		case LM_UNSIGNED_BYTE: {
-			const unsigned char *uc = (const unsigned char*)uvPtr;
-			uv = lm_v2(uc[0] / (float)UCHAR_MAX, uc[1] / (float)UCHAR_MAX);
-		} break;
-		case LM_UNSIGNED_SHORT: {
-			const unsigned short *us = (const unsigned short*)uvPtr;
-			uv = lm_v2(us[0] / (float)USHRT_MAX, us[1] / (float)USHRT_MAX);
-		} break;
-		case LM_UNSIGNED_INT: {
-			const unsigned int *ui = (const unsigned int*)uvPtr;
-			uv = lm_v2(ui[0] / (float)UINT_MAX, ui[1] / (float)UINT_MAX);
-		} break;
-		case LM_FLOAT: {
-			uv = *(const lm_vec2*)uvPtr;
-		} break;
-		default: {
-			assert(LM_FALSE);
-		} break;
+#ifdef LM_DEBUG_INTERPOLATION
+			// set sampled pixel to red in debug output
+			lm_setDebugFlag(ctx, lmUV.x, lmUV.y, LM_DEBUG_RENDERED);
+#endif
 		}
+	}
+}
 
-		ctx->meshPosition.triangle.uv[i] = lm_mul2(lm_pmod2(uv, 1.0f), uvScale); // maybe clamp to 0.0-1.0 instead of pmod?
+// hemisphere batch results are transferred through a ring of pixel pack buffers.
+// each readback is guarded by a fence and consumed as soon as the fence signals,
+// so that the CPU can keep preparing the next batches in the meantime.
+// the ring only grows when all of its batches are still in flight, so its size
+// depends on the number of hemispheres in flight and not on the lightmap size.
+static lm_bool lm_isReadbackReady(lm_context *ctx, unsigned int slot)
+{
+	GLenum status = glClientWaitSync(ctx->hemisphere.readback.slots[slot].fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
 
-		// update bounds on lightmap
-		uvMin = lm_min2(uvMin, ctx->meshPosition.triangle.uv[i]);
-		uvMax = lm_max2(uvMax, ctx->meshPosition.triangle.uv[i]);
-	}
+static void lm_waitForReadback(lm_context *ctx, unsigned int slot)
+{
+	if (lm_isReadbackReady(ctx, slot))
+		return;
 
-	lm_vec3 flatNormal = lm_cross3(
-		lm_sub3(ctx->meshPosition.triangle.p[1], ctx->meshPosition.triangle.p[0]),
-		lm_sub3(ctx->meshPosition.triangle.p[2], ctx->meshPosition.triangle.p[0]));
+	double start = lm_time();
+	GLenum status;
+	do status = glClientWaitSync(ctx->hemisphere.readback.slots[slot].fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	while (status == GL_TIMEOUT_EXPIRED);
+	assert(status != GL_WAIT_FAILED);
+	ctx->statistics.readbackStalls++;
+	ctx->statistics.readbackStallSeconds += lm_time() - start;
+}
 
-	for (int i = 0; i < 3; i++)
+static void lm_consumeReadback(lm_context *ctx)
+{
+	assert(ctx->hemisphere.readback.count > 0);
+	unsigned int slot = ctx->hemisphere.readback.first;
+	lm_readback *readback = ctx->hemisphere.readback.slots + slot;
+
+	lm_waitForReadback(ctx, slot);
+	glDeleteSync(readback->fence);
+	readback->fence = 0;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+	const float *hemi = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback->hemiCount * 4 * sizeof(float), GL_MAP_READ_BIT);
+	const float *sums = 0;
+	if (readback->distanceBuffer)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->distanceBuffer);
+		sums = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback->hemiCount * 4 * sizeof(float), GL_MAP_READ_BIT);
+	}
+	if (!hemi || (readback->distanceBuffer && !sums))
+		ctx->statistics.readbackFailures++; // the results of the batch that couldn't be mapped are lost
+	assert(hemi && (sums || !readback->distanceBuffer));
+
+	// the batch may contain the hemispheres of several queued meshes: the results of each run of hemispheres
+	// of the same mesh are written with its state in the context
+	unsigned int current = ctx->queue.current;
+	for (unsigned int first = 0, end; first < readback->hemiCount; first = end)
 	{
-		// decode and pre-transform vertex normal
-		const void *nPtr = ctx->mesh.normals + vIndices[i] * ctx->mesh.normalsStride;
-		lm_vec3 n;
-		switch (ctx->mesh.normalsType)
-		{
-		// TODO: signed formats
-		case LM_FLOAT: {
-			n = *(const lm_vec3*)nPtr;
-		} break;
-		case LM_NONE: {
-			n = flatNormal;
-		} break;
-		default: {
-			assert(LM_FALSE);
-		} break;
+		for (end = first + 1; end < readback->hemiCount && readback->toMesh[end] == readback->toMesh[first]; end++);
+		if (ctx->queue.baking)
+			lm_selectQueuedMesh(ctx, readback->toMesh[first]);
+
+		if (hemi)
+			lm_writeResultsToLightmap(ctx, hemi + first * 4, readback->toLightmapLocation + first, end - first);
+		if (sums && ctx->interpolationGuard.hitDistance.tiles)
+		{
+			for (unsigned int i = first; i < end; i++)
+			{ // harmonic mean
+				lm_ivec2 lmUV = readback->toLightmapLocation[i];
+				float distance = sums[i * 4 + 0] > 0.0f ? sums[i * 4 + 1] / sums[i * 4 + 0] : ctx->hemisphere.zFar;
+				lm_setTexelValue(&ctx->interpolationGuard.hitDistance, lmUV.x, lmUV.y, lm_texelF(distance));
+			}
 		}
-		ctx->meshPosition.triangle.n[i] = lm_normalize3(lm_transformNormal(ctx->mesh.normalMatrix, n));
 	}
+	if (ctx->queue.baking)
+		lm_selectQueuedMesh(ctx, current);
 
-	// calculate area of interest (on lightmap) for conservative rasterization
-	lm_vec2 bbMin = lm_floor2(uvMin);
-	lm_vec2 bbMax = lm_ceil2 (uvMax);
-	ctx->meshPosition.rasterizer.minx = lm_maxi((int)bbMin.x - 1, 0);
-	ctx->meshPosition.rasterizer.miny = lm_maxi((int)bbMin.y - 1, 0);
-	ctx->meshPosition.rasterizer.maxx = lm_mini((int)bbMax.x + 1, ctx->lightmap.width - 1);
-	ctx->meshPosition.rasterizer.maxy = lm_mini((int)bbMax.y + 1, ctx->lightmap.height - 1);
-	assert(ctx->meshPosition.rasterizer.minx <= ctx->meshPosition.rasterizer.maxx &&
-		   ctx->meshPosition.rasterizer.miny <= ctx->meshPosition.rasterizer.maxy);
-	ctx->meshPosition.rasterizer.x = ctx->meshPosition.rasterizer.minx + lm_passOffsetX(ctx);
-	ctx->meshPosition.rasterizer.y = ctx->meshPosition.rasterizer.miny + lm_passOffsetY(ctx);
-
-	// try moving to first valid sample position
-	if (ctx->meshPosition.rasterizer.x <= ctx->meshPosition.rasterizer.maxx &&
-		ctx->meshPosition.rasterizer.y <= ctx->meshPosition.rasterizer.maxy &&
-		lm_findFirstConservativeTriangleRasterizerPosition(ctx))
-		ctx->meshPosition.hemisphere.side = 0; // we can start sampling the hemisphere
-	else
-		ctx->meshPosition.hemisphere.side = 5; // no samples on this triangle! put hemisphere sampler into finished state
+	if (sums)
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	if (hemi)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	ctx->hemisphere.readback.first = (slot + 1) % ctx->hemisphere.readback.capacity;
+	ctx->hemisphere.readback.count--;
 }
 
-static GLuint lm_LoadShader(GLenum type, const char *source)
+static void lm_processReadbacks(lm_context *ctx, lm_bool waitForAll)
 {
-	GLuint shader = glCreateShader(type);
-	if (shader == 0)
+	while (ctx->hemisphere.readback.count > 0 &&
+		(waitForAll || lm_isReadbackReady(ctx, ctx->hemisphere.readback.first)))
+		lm_consumeReadback(ctx);
+}
+
+static void lm_discardReadbacks(lm_context *ctx)
+{
+	for (; ctx->hemisphere.readback.count > 0; ctx->hemisphere.readback.count--)
 	{
-		fprintf(stderr, "Could not create shader!\n");
-		return 0;
+		lm_readback *readback = ctx->hemisphere.readback.slots + ctx->hemisphere.readback.first;
+		glDeleteSync(readback->fence);
+		readback->fence = 0;
+		ctx->hemisphere.readback.first = (ctx->hemisphere.readback.first + 1) % ctx->hemisphere.readback.capacity;
 	}
-	glShaderSource(shader, 1, &source, NULL);
-	glCompileShader(shader);
-	GLint compiled;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-	if (!compiled)
+}
+
+static void lm_growReadbacks(lm_context *ctx)
+{
+	unsigned int batchSize = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY;
+	unsigned int capacity = lm_mini(lm_maxi(2 * ctx->hemisphere.readback.capacity, 2), LM_READBACK_BUFFERS);
+	lm_readback *slots = (lm_readback*)lm_allocate(ctx->allocator, capacity, sizeof(lm_readback));
+
+	// keep the batches in flight in their order
+	for (unsigned int i = 0; i < ctx->hemisphere.readback.capacity; i++)
+		slots[i] = ctx->hemisphere.readback.slots[(ctx->hemisphere.readback.first + i) % ctx->hemisphere.readback.capacity];
+	for (unsigned int i = ctx->hemisphere.readback.capacity; i < capacity; i++)
 	{
-		fprintf(stderr, "Could not compile shader!\n");
-		GLint infoLen = 0;
-		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
-		if (infoLen)
+		glGenBuffers(1, &slots[i].buffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, batchSize * 4 * sizeof(float), 0, GL_STREAM_READ);
+		ctx->statistics.glAllocations++;
+		slots[i].toLightmapLocation = (lm_ivec2*)lm_allocate(ctx->allocator, batchSize, sizeof(lm_ivec2));
+		slots[i].toMesh = (unsigned int*)lm_allocate(ctx->allocator, batchSize, sizeof(unsigned int));
+		if (ctx->hemisphere.distancePass.programID)
 		{
-			char* infoLog = (char*)malloc(infoLen);
-			glGetShaderInfoLog(shader, infoLen, NULL, infoLog);
-			fprintf(stderr, "%s\n", infoLog);
-			free(infoLog);
+			glGenBuffers(1, &slots[i].distanceBuffer);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].distanceBuffer);
+			glBufferData(GL_PIXEL_PACK_BUFFER, batchSize * 4 * sizeof(float), 0, GL_STREAM_READ);
+			ctx->statistics.glAllocations++;
 		}
-		glDeleteShader(shader);
-		return 0;
 	}
-	return shader;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	lm_deallocate(ctx->allocator, ctx->hemisphere.readback.slots);
+	ctx->hemisphere.readback.slots = slots;
+	ctx->hemisphere.readback.capacity = capacity;
+	ctx->hemisphere.readback.first = 0;
 }
 
-static GLuint lm_LoadProgram(const char *vp, const char *fp)
+static void lm_destroyReadbacks(lm_context *ctx)
 {
-	GLuint program = glCreateProgram();
-	if (program == 0)
+	lm_discardReadbacks(ctx);
+	for (unsigned int i = 0; i < ctx->hemisphere.readback.capacity; i++)
 	{
-		fprintf(stderr, "Could not create program!\n");
+		glDeleteBuffers(1, &ctx->hemisphere.readback.slots[i].buffer);
+		glDeleteBuffers(1, &ctx->hemisphere.readback.slots[i].distanceBuffer);
+		lm_deallocate(ctx->allocator, ctx->hemisphere.readback.slots[i].toLightmapLocation);
+		lm_deallocate(ctx->allocator, ctx->hemisphere.readback.slots[i].toMesh);
+	}
+	lm_deallocate(ctx->allocator, ctx->hemisphere.readback.slots);
+	ctx->hemisphere.readback.slots = 0;
+	ctx->hemisphere.readback.capacity = 0;
+}
+
+static lm_readback *lm_beginReadback(lm_context *ctx)
+{
+	if (ctx->hemisphere.readback.count == ctx->hemisphere.readback.capacity)
+	{ // all buffers in flight: add more buffers if we may or wait for the oldest one
+		if (ctx->hemisphere.readback.capacity < LM_READBACK_BUFFERS &&
+			(!ctx->hemisphere.readback.count || !lm_isReadbackReady(ctx, ctx->hemisphere.readback.first)))
+			lm_growReadbacks(ctx);
+		else
+			lm_consumeReadback(ctx);
+	}
+
+	unsigned int slot = (ctx->hemisphere.readback.first + ctx->hemisphere.readback.count) % ctx->hemisphere.readback.capacity;
+	return ctx->hemisphere.readback.slots + slot;
+}
+
+static void lm_endReadback(lm_context *ctx, lm_readback *readback)
+{
+	readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	// remember where the results have to go
+	for (unsigned int i = 0; i < ctx->hemisphere.fbHemiIndex; i++)
+	{
+		readback->toLightmapLocation[i] = ctx->hemisphere.fbHemiToLightmapLocation[i];
+		readback->toMesh[i] = ctx->hemisphere.fbHemiToMesh[i];
+	}
+	readback->hemiCount = ctx->hemisphere.fbHemiIndex;
+	ctx->hemisphere.readback.count++;
+
+	// consume everything that already arrived
+	lm_processReadbacks(ctx, LM_FALSE);
+}
+
+// integrates the depth buffers of the hemispheres in the batch into their mean hit distances
+// with the downsampling passes and transfers them with the results of the batch.
+static void lm_integrateHitDistances(lm_context *ctx, lm_readback *readback)
+{
+	if (!ctx->hemisphere.distancePass.programID)
+		return;
+
+	glDisable(GL_DEPTH_TEST);
+	glBindVertexArray(ctx->hemisphere.vao);
+
+	int fbRead = 0;
+	int fbWrite = 1;
+	int rows = (ctx->hemisphere.fbHemiIndex + ctx->hemisphere.fbHemiCountX - 1) / ctx->hemisphere.fbHemiCountX;
+
+	// weighted downsampling pass
+	int outHemiSize = ctx->hemisphere.size / 2;
+	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbWrite], 0);
+	glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * rows);
+	glUseProgram(ctx->hemisphere.distancePass.programID);
+	glUniform1i(ctx->hemisphere.distancePass.depthsTextureID, 0);
+	glUniform1i(ctx->hemisphere.distancePass.weightsTextureID, 1);
+	glUniform2f(ctx->hemisphere.distancePass.zNearFarID, ctx->hemisphere.zNear, ctx->hemisphere.zFar);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbDepth);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+	// downsampling passes
+	glUseProgram(ctx->hemisphere.downsamplePass.programID);
+	glUniform1i(ctx->hemisphere.downsamplePass.hemispheresTextureID, 0);
+	while (outHemiSize > 1)
+	{
+		LM_SWAP(int, fbRead, fbWrite);
+		outHemiSize /= 2;
+		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+		glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * rows);
+		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->distanceBuffer);
+	glReadPixels(0, 0, ctx->hemisphere.fbHemiCountX, rows, GL_RGBA, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindVertexArray(0);
+	glEnable(GL_DEPTH_TEST);
+}
+
+static void lm_downsampleHemisphereBatch(lm_context *ctx)
+{
+	glDisable(GL_DEPTH_TEST);
+	glBindVertexArray(ctx->hemisphere.vao);
+
+	int fbRead = 0;
+	int fbWrite = 1;
+
+	// only process the rows of the batch that contain hemispheres
+	int rows = (ctx->hemisphere.fbHemiIndex + ctx->hemisphere.fbHemiCountX - 1) / ctx->hemisphere.fbHemiCountX;
+
+	// weighted downsampling pass
+	int outHemiSize = ctx->hemisphere.size / 2;
+	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbWrite], 0);
+	glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * rows);
+	glUseProgram(ctx->hemisphere.firstPass.programID);
+	glUniform1i(ctx->hemisphere.firstPass.hemispheresTextureID, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
+	glUniform1i(ctx->hemisphere.firstPass.weightsTextureID, 1);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	//glBindTexture(GL_TEXTURE_2D, 0);
+
+#if 0
+	// debug output
+	int w = outHemiSize * ctx->hemisphere.fbHemiCountX, h = outHemiSize * ctx->hemisphere.fbHemiCountY;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	float *image = new float[3 * w * h];
+	glReadPixels(0, 0, w, h, GL_RGB, GL_FLOAT, image);
+	lmImageSaveTGAf("firstpass.png", image, w, h, 3);
+	delete[] image;
+#endif
+
+	// downsampling passes
+	glUseProgram(ctx->hemisphere.downsamplePass.programID);
+	glUniform1i(ctx->hemisphere.downsamplePass.hemispheresTextureID, 0);
+	while (outHemiSize > 1)
+	{
+		LM_SWAP(int, fbRead, fbWrite);
+		outHemiSize /= 2;
+		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+		glViewport(0, 0, outHemiSize * ctx->hemisphere.fbHemiCountX, outHemiSize * rows);
+		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[fbRead]);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		//glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// start the GPU->CPU transfer of the downsampled hemispheres
+	lm_readback *readback = lm_beginReadback(ctx);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->hemisphere.fb[fbWrite]);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+	glReadPixels(0, 0, ctx->hemisphere.fbHemiCountX, rows, GL_RGBA, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	lm_integrateHitDistances(ctx, readback);
+	lm_endReadback(ctx, readback);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindVertexArray(0);
+	glEnable(GL_DEPTH_TEST);
+}
+
+#ifdef GL_COMPUTE_SHADER
+static void lm_reduceHemisphereBatch(lm_context *ctx)
+{
+	// reduce every hemisphere to its weighted sum with one compute shader dispatch.
+	// the results are written straight into the next readback buffer.
+	lm_readback *readback = lm_beginReadback(ctx);
+	glUseProgram(ctx->hemisphere.computePass.programID);
+	glUniform1i(ctx->hemisphere.computePass.hemispheresTextureID, 0);
+	glUniform1i(ctx->hemisphere.computePass.weightsTextureID, 1);
+	glUniform1i(ctx->hemisphere.computePass.hemiCountXID, ctx->hemisphere.fbHemiCountX);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[0]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, readback->buffer);
+	glDispatchCompute(ctx->hemisphere.fbHemiIndex, 1, 1);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	lm_integrateHitDistances(ctx, readback);
+	lm_endReadback(ctx, readback);
+}
+#endif
+
+static void lm_integrateHemisphereBatch(lm_context *ctx)
+{
+	if (!ctx->hemisphere.fbHemiIndex)
+		return; // nothing to do
+
+#ifdef GL_COMPUTE_SHADER
+	if (ctx->hemisphere.computePass.programID)
+		lm_reduceHemisphereBatch(ctx);
+	else
+#endif
+		lm_downsampleHemisphereBatch(ctx);
+
+	ctx->statistics.hemispheres += ctx->hemisphere.fbHemiIndex;
+	ctx->statistics.batches++;
+	ctx->hemisphere.fbHemiIndex = 0;
+}
+
+static void lm_setView(
+	int* viewport, int x, int y, int w, int h,
+	float* view,   lm_vec3 pos, lm_vec3 dir, lm_vec3 up,
+	float* proj,   float l, float r, float b, float t, float n, float f)
+{
+	// viewport
+	viewport[0] = x; viewport[1] = y; viewport[2] = w; viewport[3] = h;
+
+	// view matrix: lookAt(pos, pos + dir, up)
+	lm_vec3 side = lm_cross3(dir, up);
+	//up = cross(side, dir);
+	dir = lm_negate3(dir); pos = lm_negate3(pos);
+	view[ 0] = side.x;             view[ 1] = up.x;             view[ 2] = dir.x;             view[ 3] = 0.0f;
+	view[ 4] = side.y;             view[ 5] = up.y;             view[ 6] = dir.y;             view[ 7] = 0.0f;
+	view[ 8] = side.z;             view[ 9] = up.z;             view[10] = dir.z;             view[11] = 0.0f;
+	view[12] = lm_dot3(side, pos); view[13] = lm_dot3(up, pos); view[14] = lm_dot3(dir, pos); view[15] = 1.0f;
+
+	// projection matrix: frustum(l, r, b, t, n, f)
+	float ilr = 1.0f / (r - l), ibt = 1.0f / (t - b), ninf = -1.0f / (f - n), n2 = 2.0f * n;
+	proj[ 0] = n2 * ilr;      proj[ 1] = 0.0f;          proj[ 2] = 0.0f;           proj[ 3] = 0.0f;
+	proj[ 4] = 0.0f;          proj[ 5] = n2 * ibt;      proj[ 6] = 0.0f;           proj[ 7] = 0.0f;
+	proj[ 8] = (r + l) * ilr; proj[ 9] = (t + b) * ibt; proj[10] = (f + n) * ninf; proj[11] = -1.0f;
+	proj[12] = 0.0f;          proj[13] = 0.0f;          proj[14] = f * n2 * ninf;  proj[15] = 0.0f;
+}
+
+// finds the viewport and camera of a side of the current hemisphere in the batch framebuffer
+static void lm_getHemisphereSideView(lm_context *ctx, int side, int* viewport, float* view, float* proj)
+{
+	// find the target position in the batch
+	int x = (ctx->hemisphere.fbHemiIndex % ctx->hemisphere.fbHemiCountX) * ctx->hemisphere.size * 3;
+	int y = (ctx->hemisphere.fbHemiIndex / ctx->hemisphere.fbHemiCountX) * ctx->hemisphere.size;
+
+	int size = ctx->hemisphere.size;
+	float zNear = ctx->hemisphere.zNear;
+	float zFar = ctx->hemisphere.zFar;
+
+	lm_vec3 pos = ctx->meshPosition.sample.position;
+	lm_vec3 dir = ctx->meshPosition.sample.direction;
+	lm_vec3 up = ctx->meshPosition.sample.up;
+	lm_vec3 right = lm_cross3(dir, up);
+
+	// find the view parameters of the hemisphere side
+	// hemisphere layout in the framebuffer:
+	//       +-------+---+---+-------+
+	//       |       |   |   |   D   |
+	//       |   C   | R | L +-------+
+	//       |       |   |   |   U   |
+	//       +-------+---+---+-------+
+	switch (side)
+	{
+	case 0: // center
+		lm_setView(viewport, x, y, size, size,
+				   view,     pos, dir, up,
+				   proj,     -zNear, zNear, -zNear, zNear, zNear, zFar);
+		break;
+	case 1: // right
+		lm_setView(viewport, size + x, y, size / 2, size,
+				   view,     pos, right, up,
+				   proj,     -zNear, 0.0f, -zNear, zNear, zNear, zFar);
+		break;
+	case 2: // left
+		lm_setView(viewport, size + x + size / 2, y, size / 2, size,
+				   view,     pos, lm_negate3(right), up,
+				   proj,     0.0f, zNear, -zNear, zNear, zNear, zFar);
+		break;
+	case 3: // down
+		lm_setView(viewport, 2 * size + x, y + size / 2, size, size / 2,
+				   view,     pos, lm_negate3(up), dir,
+				   proj,     -zNear, zNear, 0.0f, zNear, zNear, zFar);
+		break;
+	case 4: // up
+		lm_setView(viewport, 2 * size + x, y, size, size / 2,
+				   view,     pos, up, lm_negate3(dir),
+				   proj,     -zNear, zNear, -zNear, 0.0f, zNear, zFar);
+		break;
+	default:
+		assert(LM_FALSE);
+		break;
+	}
+}
+
+// returns true if a hemisphere side was prepared for rendering and
+// false if we finished the current hemisphere
+static lm_bool lm_beginSampleHemisphere(lm_context *ctx, int* viewport, float* view, float* proj)
+{
+	if (ctx->meshPosition.hemisphere.side >= 5)
+		return LM_FALSE;
+
+	if (ctx->meshPosition.hemisphere.side == 0)
+	{
+		// prepare hemisphere
+		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[0]);
+		if (ctx->hemisphere.fbHemiIndex == 0)
+		{
+			// prepare hemisphere batch
+			glClearColor( // clear to valid background pixels!
+				ctx->hemisphere.clearColor.r,
+				ctx->hemisphere.clearColor.g,
+				ctx->hemisphere.clearColor.b, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		}
+		ctx->hemisphere.fbHemiToLightmapLocation[ctx->hemisphere.fbHemiIndex] =
+			lm_i2(ctx->meshPosition.sample.x, ctx->meshPosition.sample.y);
+		ctx->hemisphere.fbHemiToMesh[ctx->hemisphere.fbHemiIndex] = ctx->queue.current;
+	}
+
+	lm_getHemisphereSideView(ctx, ctx->meshPosition.hemisphere.side, viewport, view, proj);
+
+	return LM_TRUE;
+}
+
+static void lm_endSampleHemisphere(lm_context *ctx)
+{
+	if (++ctx->meshPosition.hemisphere.side == 5)
+	{
+		// finish hemisphere
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		if (++ctx->hemisphere.fbHemiIndex == ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY)
+		{
+			// downsample new hemisphere batch and store the results
+			lm_integrateHemisphereBatch(ctx);
+		}
+	}
+}
+
+static void lm_inverseTranspose(const float *m44, float *n33)
+{
+	if (!m44)
+	{
+		n33[0] = 1.0f; n33[1] = 0.0f; n33[2] = 0.0f;
+		n33[3] = 0.0f; n33[4] = 1.0f; n33[5] = 0.0f;
+		n33[6] = 0.0f; n33[7] = 0.0f; n33[8] = 1.0f;
+		return;
+	}
+
+	float determinant = m44[ 0] * (m44[ 5] * m44[10] - m44[ 9] * m44[ 6])
+					  - m44[ 1] * (m44[ 4] * m44[10] - m44[ 6] * m44[ 8])
+					  + m44[ 2] * (m44[ 4] * m44[ 9] - m44[ 5] * m44[ 8]);
+
+	assert(fabs(determinant) > FLT_EPSILON);
+	float rcpDeterminant = 1.0f / determinant;
+
+	n33[0] =  (m44[ 5] * m44[10] - m44[ 9] * m44[ 6]) * rcpDeterminant;
+	n33[3] = -(m44[ 1] * m44[10] - m44[ 2] * m44[ 9]) * rcpDeterminant;
+	n33[6] =  (m44[ 1] * m44[ 6] - m44[ 2] * m44[ 5]) * rcpDeterminant;
+	n33[1] = -(m44[ 4] * m44[10] - m44[ 6] * m44[ 8]) * rcpDeterminant;
+	n33[4] =  (m44[ 0] * m44[10] - m44[ 2] * m44[ 8]) * rcpDeterminant;
+	n33[7] = -(m44[ 0] * m44[ 6] - m44[ 4] * m44[ 2]) * rcpDeterminant;
+	n33[2] =  (m44[ 4] * m44[ 9] - m44[ 8] * m44[ 5]) * rcpDeterminant;
+	n33[5] = -(m44[ 0] * m44[ 9] - m44[ 8] * m44[ 1]) * rcpDeterminant;
+	n33[8] =  (m44[ 0] * m44[ 5] - m44[ 4] * m44[ 1]) * rcpDeterminant;
+}
+
+static lm_vec3 lm_transformNormal(const float *m, lm_vec3 n)
+{
+	lm_vec3 r;
+	r.x = m[0] * n.x + m[3] * n.y + m[6] * n.z;
+	r.y = m[1] * n.x + m[4] * n.y + m[7] * n.z;
+	r.z = m[2] * n.x + m[5] * n.y + m[8] * n.z;
+	return r;
+}
+
+static lm_vec3 lm_transformPosition(const float *m, lm_vec3 v)
+{
+	if (!m)
+		return v;
+	lm_vec3 r;
+	r.x =     m[0] * v.x + m[4] * v.y + m[ 8] * v.z + m[12];
+	r.y =     m[1] * v.x + m[5] * v.y + m[ 9] * v.z + m[13];
+	r.z =     m[2] * v.x + m[6] * v.y + m[10] * v.z + m[14];
+	float d = m[3] * v.x + m[7] * v.y + m[11] * v.z + m[15];
+	assert(lm_absf(d - 1.0f) < 0.00001f); // could divide by d, but this shouldn't be a projection transform!
+	return r;
+}
+
+// vertex attribute decoders. one per format, chosen once per attribute when the geometry is prepared.
+// they convert up to 3 components of count vertices into separate float arrays (structure of arrays).
+// integer values are divided by the divisor (1.0f for raw values) and clamped to minValue (-1.0f for signed normalized values).
+typedef void (*lm_decode_func)(const unsigned char *data, int stride, unsigned int count, int components, float divisor, float minValue, float **out);
+
+#define LM_DEFINE_DECODER(name, type, toFloat)                                                                                   \
+static void name(const unsigned char *data, int stride, unsigned int count, int components, float divisor, float minValue, float **out) \
+{                                                                                                                                \
+	for (unsigned int i = 0; i < count; i++, data += stride)                                                                     \
+	{                                                                                                                            \
+		const type *v = (const type*)data;                                                                                       \
+		for (int c = 0; c < components; c++)                                                                                     \
+			out[c][i] = lm_maxf(toFloat(v[c]) / divisor, minValue);                                                              \
+	}                                                                                                                            \
+}
+#define LM_CAST_FLOAT(v) ((float)(v))
+LM_DEFINE_DECODER(lm_decodeUnsignedBytes,  unsigned char,  LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeBytes,          signed char,    LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeUnsignedShorts, unsigned short, LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeShorts,         short,          LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeUnsignedInts,   unsigned int,   LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeInts,           int,            LM_CAST_FLOAT)
+LM_DEFINE_DECODER(lm_decodeHalfFloats,     unsigned short, lm_halfToFloat)
+LM_DEFINE_DECODER(lm_decodeFloats,         float,          LM_CAST_FLOAT)
+#undef LM_CAST_FLOAT
+#undef LM_DEFINE_DECODER
+
+static lm_decode_func lm_getDecoder(lm_type type, lm_bool normalized, float *outDivisor, float *outMinValue)
+{
+	*outDivisor = 1.0f;
+	*outMinValue = -FLT_MAX;
+	switch (type)
+	{
+	case LM_UNSIGNED_BYTE:  if (normalized) *outDivisor = (float)UCHAR_MAX; return lm_decodeUnsignedBytes;
+	case LM_UNSIGNED_SHORT: if (normalized) *outDivisor = (float)USHRT_MAX; return lm_decodeUnsignedShorts;
+	case LM_UNSIGNED_INT:   if (normalized) *outDivisor = (float)UINT_MAX;  return lm_decodeUnsignedInts;
+	case LM_BYTE:           if (normalized) { *outDivisor = (float)SCHAR_MAX; *outMinValue = -1.0f; } return lm_decodeBytes;
+	case LM_SHORT:          if (normalized) { *outDivisor = (float)SHRT_MAX;  *outMinValue = -1.0f; } return lm_decodeShorts;
+	case LM_INT:            if (normalized) { *outDivisor = (float)INT_MAX;   *outMinValue = -1.0f; } return lm_decodeInts;
+	case LM_HALF_FLOAT:     return lm_decodeHalfFloats;
+	case LM_FLOAT:          return lm_decodeFloats;
+	default:                assert(LM_FALSE); return NULL;
+	}
+}
+
+static unsigned int lm_getVertexIndex(const lm_mesh *mesh, unsigned int index)
+{
+	switch (mesh->indicesType)
+	{
+	case LM_NONE:           return index;
+	case LM_UNSIGNED_BYTE:  return ((const unsigned char*)mesh->indices)[index];
+	case LM_UNSIGNED_SHORT: return ((const unsigned short*)mesh->indices)[index];
+	case LM_UNSIGNED_INT:   return ((const unsigned int*)mesh->indices)[index];
+	default:                assert(LM_FALSE); return 0;
+	}
+}
+
+// all vertices of a mesh decoded and transformed to world space once
+typedef struct lm_vertex_cache
+{
+	unsigned int count;
+	float *px, *py, *pz; // world space positions
+	float *nx, *ny, *nz; // normalized world space normals (NULL => flat normals are calculated per triangle)
+	float *u, *v;        // lightmap coords scaled to the lightmap resolution
+	float *memory;       // all arrays in one allocation. each one starts at a 16 byte aligned offset
+} lm_vertex_cache;
+
+static void lm_transformPositions(const float *m, float *x, float *y, float *z, unsigned int count)
+{
+	if (!m)
+		return;
+
+	// same order of operations as lm_transformPosition
+	assert(lm_absf(m[3]) + lm_absf(m[7]) + lm_absf(m[11]) + lm_absf(m[15] - 1.0f) < 0.00001f); // this shouldn't be a projection transform!
+	unsigned int i = 0;
+#if defined(LM_SSE2)
+	__m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2  = _mm_set1_ps(m[2]);
+	__m128 m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]), m6  = _mm_set1_ps(m[6]);
+	__m128 m8 = _mm_set1_ps(m[8]), m9 = _mm_set1_ps(m[9]), m10 = _mm_set1_ps(m[10]);
+	__m128 m12 = _mm_set1_ps(m[12]), m13 = _mm_set1_ps(m[13]), m14 = _mm_set1_ps(m[14]);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+		_mm_storeu_ps(x + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, vx), _mm_mul_ps(m4, vy)), _mm_mul_ps(m8,  vz)), m12));
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, vx), _mm_mul_ps(m5, vy)), _mm_mul_ps(m9,  vz)), m13));
+		_mm_storeu_ps(z + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, vx), _mm_mul_ps(m6, vy)), _mm_mul_ps(m10, vz)), m14));
+	}
+#elif defined(LM_NEON)
+	float32x4_t m0 = vdupq_n_f32(m[0]), m1 = vdupq_n_f32(m[1]), m2  = vdupq_n_f32(m[2]);
+	float32x4_t m4 = vdupq_n_f32(m[4]), m5 = vdupq_n_f32(m[5]), m6  = vdupq_n_f32(m[6]);
+	float32x4_t m8 = vdupq_n_f32(m[8]), m9 = vdupq_n_f32(m[9]), m10 = vdupq_n_f32(m[10]);
+	float32x4_t m12 = vdupq_n_f32(m[12]), m13 = vdupq_n_f32(m[13]), m14 = vdupq_n_f32(m[14]);
+	for (; i + 4 <= count; i += 4)
+	{
+		float32x4_t vx = vld1q_f32(x + i), vy = vld1q_f32(y + i), vz = vld1q_f32(z + i);
+		vst1q_f32(x + i, vaddq_f32(vaddq_f32(vaddq_f32(vmulq_f32(m0, vx), vmulq_f32(m4, vy)), vmulq_f32(m8,  vz)), m12));
+		vst1q_f32(y + i, vaddq_f32(vaddq_f32(vaddq_f32(vmulq_f32(m1, vx), vmulq_f32(m5, vy)), vmulq_f32(m9,  vz)), m13));
+		vst1q_f32(z + i, vaddq_f32(vaddq_f32(vaddq_f32(vmulq_f32(m2, vx), vmulq_f32(m6, vy)), vmulq_f32(m10, vz)), m14));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		lm_vec3 p = lm_transformPosition(m, lm_v3(x[i], y[i], z[i]));
+		x[i] = p.x; y[i] = p.y; z[i] = p.z;
+	}
+}
+
+static void lm_transformNormals(const float *m, float *x, float *y, float *z, unsigned int count)
+{
+	// same order of operations as lm_normalize3(lm_transformNormal(m, n))
+	unsigned int i = 0;
+#if defined(LM_SSE2)
+	__m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]);
+	__m128 m3 = _mm_set1_ps(m[3]), m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]);
+	__m128 m6 = _mm_set1_ps(m[6]), m7 = _mm_set1_ps(m[7]), m8 = _mm_set1_ps(m[8]);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, vx), _mm_mul_ps(m3, vy)), _mm_mul_ps(m6, vz));
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, vx), _mm_mul_ps(m4, vy)), _mm_mul_ps(m7, vz));
+		__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, vx), _mm_mul_ps(m5, vy)), _mm_mul_ps(m8, vz));
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, rx), _mm_mul_ps(ry, ry)), _mm_mul_ps(rz, rz)));
+		__m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), length);
+		_mm_storeu_ps(x + i, _mm_mul_ps(rx, scale));
+		_mm_storeu_ps(y + i, _mm_mul_ps(ry, scale));
+		_mm_storeu_ps(z + i, _mm_mul_ps(rz, scale));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		lm_vec3 n = lm_normalize3(lm_transformNormal(m, lm_v3(x[i], y[i], z[i])));
+		x[i] = n.x; y[i] = n.y; z[i] = n.z;
+	}
+}
+
+static lm_bool lm_createVertexCache(lm_allocator *allocator, const lm_mesh *mesh, int w, int h, lm_vertex_cache *cache)
+{
+	// only the referenced vertices are needed
+	unsigned int count = 0;
+	if (mesh->indicesType == LM_NONE)
+		count = mesh->count;
+	else
+		for (unsigned int i = 0; i < mesh->count; i++)
+			count = lm_maxi(count, lm_getVertexIndex(mesh, i) + 1);
+
+	unsigned int paddedCount = (count + 3) & ~3u;
+	cache->count = count;
+	cache->memory = (float*)lm_allocate(allocator, (size_t)paddedCount * 8, sizeof(float));
+	if (!cache->memory)
+		return LM_FALSE;
+	float *arrays[8];
+	for (int i = 0; i < 8; i++)
+		arrays[i] = cache->memory + (size_t)paddedCount * i;
+	cache->px = arrays[0]; cache->py = arrays[1]; cache->pz = arrays[2];
+	cache->u  = arrays[6]; cache->v  = arrays[7];
+	cache->nx = cache->ny = cache->nz = NULL;
+
+	float divisor, minValue;
+	lm_decode_func decode = lm_getDecoder(mesh->positionsType, LM_FALSE, &divisor, &minValue);
+	decode(mesh->positions, mesh->positionsStride, count, 3, divisor, minValue, arrays);
+	lm_transformPositions(mesh->modelMatrix, cache->px, cache->py, cache->pz, count);
+
+	if (mesh->normalsType != LM_NONE)
+	{
+		cache->nx = arrays[3]; cache->ny = arrays[4]; cache->nz = arrays[5];
+		decode = lm_getDecoder(mesh->normalsType, LM_TRUE, &divisor, &minValue);
+		decode(mesh->normals, mesh->normalsStride, count, 3, divisor, minValue, arrays + 3);
+		lm_transformNormals(mesh->normalMatrix, cache->nx, cache->ny, cache->nz, count);
+	}
+
+	// scale (to lightmap resolution) vertex lightmap texture coords
+	decode = lm_getDecoder(mesh->uvsType, LM_TRUE, &divisor, &minValue);
+	decode(mesh->uvs, mesh->uvsStride, count, 2, divisor, minValue, arrays + 6);
+	lm_vec2 uvScale = lm_v2i(w, h);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		lm_vec2 uv = lm_mul2(lm_pmod2(lm_v2(cache->u[i], cache->v[i]), 1.0f), uvScale); // maybe clamp to 0.0-1.0 instead of pmod?
+		cache->u[i] = uv.x;
+		cache->v[i] = uv.y;
+	}
+	return LM_TRUE;
+}
+
+static void lm_loadTriangle(const lm_mesh *mesh, const lm_vertex_cache *cache, unsigned int baseIndex, int w, int h, lm_triangle *triangle)
+{
+	// load triangle to process next
+	lm_vec2 uvMin = lm_v2(FLT_MAX, FLT_MAX), uvMax = lm_v2(-FLT_MAX, -FLT_MAX);
+	unsigned int vIndices[3];
+	for (int i = 0; i < 3; i++)
+	{
+		unsigned int vIndex = lm_getVertexIndex(mesh, baseIndex + i);
+		vIndices[i] = vIndex;
+		triangle->p[i] = lm_v3(cache->px[vIndex], cache->py[vIndex], cache->pz[vIndex]);
+		triangle->uv[i] = lm_v2(cache->u[vIndex], cache->v[vIndex]);
+
+		// update bounds on lightmap
+		uvMin = lm_min2(uvMin, triangle->uv[i]);
+		uvMax = lm_max2(uvMax, triangle->uv[i]);
+	}
+
+	if (cache->nx)
+	{
+		for (int i = 0; i < 3; i++)
+			triangle->n[i] = lm_v3(cache->nx[vIndices[i]], cache->ny[vIndices[i]], cache->nz[vIndices[i]]);
+	}
+	else
+	{
+		lm_vec3 flatNormal = lm_cross3(
+			lm_sub3(triangle->p[1], triangle->p[0]),
+			lm_sub3(triangle->p[2], triangle->p[0]));
+		triangle->n[0] = triangle->n[1] = triangle->n[2] = lm_normalize3(lm_transformNormal(mesh->normalMatrix, flatNormal));
+	}
+
+	// calculate area of interest (on lightmap) for conservative rasterization
+	lm_vec2 bbMin = lm_floor2(uvMin);
+	lm_vec2 bbMax = lm_ceil2 (uvMax);
+	triangle->rasterMin = lm_i2(lm_maxi((int)bbMin.x - 1, 0), lm_maxi((int)bbMin.y - 1, 0));
+	triangle->rasterMax = lm_i2(lm_mini((int)bbMax.x + 1, w - 1), lm_mini((int)bbMax.y + 1, h - 1));
+	assert(triangle->rasterMin.x <= triangle->rasterMax.x &&
+		   triangle->rasterMin.y <= triangle->rasterMax.y);
+}
+
+#if defined(LM_SSE2) || defined(LM_NEON)
+// edge functions of a triangle on the lightmap to find texels that are fully inside or outside of it 4 at a time.
+// only the remaining texels on the triangle edges need to be clipped exactly. the margins are conservative,
+// so the fast path never changes the result: a fully covered texel gets the same centroid (its center)
+// that clipping would produce and a texel that is fully outside of an edge would be clipped away entirely.
+#define LM_COVERAGE
+
+typedef struct lm_coverage_edges
+{
+	lm_bool valid;                              // false for degenerate triangles. all texels are clipped exactly.
+	float a[3], b[3];                           // e(p) = a * (p.x - o.x) + b * (p.y - o.y), positive inside
+	float ox[3], oy[3];
+	float minOffset[3], maxOffset[3];           // smallest/largest change of e from a texel's lower left corner to its other corners
+	float margin[3];                            // rounding error bound of e (and of the clipping code)
+} lm_coverage_edges;
+
+static void lm_setupCoverageEdges(const lm_triangle *triangle, int w, int h, lm_coverage_edges *edges)
+{
+	// same orientation test as lm_convexClip
+	int dir = lm_leftOf(triangle->uv[0], triangle->uv[1], triangle->uv[2]);
+	edges->valid = dir != 0;
+
+	// clipping works on absolute lightmap coordinates. its rounding errors grow with them.
+	float errorScale = 1e-5f * (float)(lm_maxi(w, h) + 16);
+	for (int i = 0, j = 2; i < 3; j = i++)
+	{
+		lm_vec2 e = lm_sub2(triangle->uv[i], triangle->uv[j]);
+		edges->a[i] = -(float)dir * e.y;
+		edges->b[i] = (float)dir * e.x;
+		edges->ox[i] = triangle->uv[i].x;
+		edges->oy[i] = triangle->uv[i].y;
+		edges->minOffset[i] = lm_minf(edges->a[i], 0.0f) + lm_minf(edges->b[i], 0.0f);
+		edges->maxOffset[i] = lm_maxf(edges->a[i], 0.0f) + lm_maxf(edges->b[i], 0.0f);
+		edges->margin[i] = (lm_absf(edges->a[i]) + lm_absf(edges->b[i])) * errorScale;
+	}
+}
+
+// classifies the texels x..x+3 in row y. bit k of *outInside/*outOutside is set if texel x+k is fully inside/outside of the triangle.
+static void lm_classifyTexels4(const lm_coverage_edges *edges, int x, int y, int *outInside, int *outOutside)
+{
+#if defined(LM_SSE2)
+	__m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+	__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	__m128 outside = _mm_setzero_ps();
+	for (int i = 0; i < 3; i++)
+	{
+		__m128 e = _mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(edges->a[i]), _mm_sub_ps(px, _mm_set1_ps(edges->ox[i]))),
+			_mm_set1_ps(edges->b[i] * ((float)y - edges->oy[i])));
+		inside = _mm_and_ps(inside, _mm_cmpgt_ps(_mm_add_ps(e, _mm_set1_ps(edges->minOffset[i])), _mm_set1_ps(edges->margin[i])));
+		outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(e, _mm_set1_ps(edges->maxOffset[i])), _mm_set1_ps(-edges->margin[i])));
+	}
+	*outInside = _mm_movemask_ps(inside);
+	*outOutside = _mm_movemask_ps(outside);
+#else
+	static const float offsets[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	float32x4_t px = vaddq_f32(vdupq_n_f32((float)x), vld1q_f32(offsets));
+	uint32x4_t inside = vdupq_n_u32(0xffffffff);
+	uint32x4_t outside = vdupq_n_u32(0);
+	for (int i = 0; i < 3; i++)
+	{
+		float32x4_t e = vaddq_f32(
+			vmulq_f32(vdupq_n_f32(edges->a[i]), vsubq_f32(px, vdupq_n_f32(edges->ox[i]))),
+			vdupq_n_f32(edges->b[i] * ((float)y - edges->oy[i])));
+		inside = vandq_u32(inside, vcgtq_f32(vaddq_f32(e, vdupq_n_f32(edges->minOffset[i])), vdupq_n_f32(edges->margin[i])));
+		outside = vorrq_u32(outside, vcltq_f32(vaddq_f32(e, vdupq_n_f32(edges->maxOffset[i])), vdupq_n_f32(-edges->margin[i])));
+	}
+	uint32x4_t bitMask = vld1q_u32(bits);
+	uint32x4_t in = vandq_u32(inside, bitMask), out = vandq_u32(outside, bitMask);
+	*outInside = (int)(vgetq_lane_u32(in, 0) | vgetq_lane_u32(in, 1) | vgetq_lane_u32(in, 2) | vgetq_lane_u32(in, 3));
+	*outOutside = (int)(vgetq_lane_u32(out, 0) | vgetq_lane_u32(out, 1) | vgetq_lane_u32(out, 2) | vgetq_lane_u32(out, 3));
+#endif
+}
+#endif
+
+// returns true if the triangle covers some area of the lightmap texel at x, y and
+// calculates the centroid of the covered part
+static lm_bool lm_clipTexelCentroid(const lm_triangle *triangle, int x, int y, lm_vec2 *outCentroid)
+{
+	// try calculating centroid by clipping the pixel against the triangle
+	lm_vec2 pixel[16];
+	pixel[0] = lm_v2i(x, y);
+	pixel[1] = lm_v2i(x + 1, y);
+	pixel[2] = lm_v2i(x + 1, y + 1);
+	pixel[3] = lm_v2i(x, y + 1);
+
+	lm_vec2 res[16];
+	int nRes = lm_convexClip(pixel, 4, triangle->uv, 3, res);
+	if (nRes == 0)
+		return LM_FALSE; // nothing left
+
+	// calculate centroid position and area
+	lm_vec2 centroid = res[0];
+	float area = res[nRes - 1].x * res[0].y - res[nRes - 1].y * res[0].x;
+	for (int i = 1; i < nRes; i++)
+	{
+		centroid = lm_add2(centroid, res[i]);
+		area += res[i - 1].x * res[i].y - res[i - 1].y * res[i].x;
+	}
+	centroid = lm_div2(centroid, (float)nRes);
+	area = lm_absf(area / 2.0f);
+
+	if (area <= 0.0f)
+		return LM_FALSE; // no area left
+
+	*outCentroid = centroid;
+	return LM_TRUE;
+}
+
+// calculates the surface position, normal and hemisphere up vector at a point on the lightmap inside the triangle
+static lm_bool lm_sampleTriangle(const lm_triangle *triangle, lm_vec2 centroid, lm_vec3 *outPosition, lm_vec3 *outNormal, lm_vec3 *outUp)
+{
+	// calculate barycentric coords
+	lm_vec2 uv = lm_toBarycentric(
+		triangle->uv[0],
+		triangle->uv[1],
+		triangle->uv[2],
+		centroid);
+
+	if (!lm_finite2(uv))
+		return LM_FALSE; // degenerate
+
+	// calculate 3D sample position and orientation
+	lm_vec3 p0 = triangle->p[0];
+	lm_vec3 p1 = triangle->p[1];
+	lm_vec3 p2 = triangle->p[2];
+	lm_vec3 v1 = lm_sub3(p1, p0);
+	lm_vec3 v2 = lm_sub3(p2, p0);
+	lm_vec3 position = lm_add3(p0, lm_add3(lm_scale3(v2, uv.x), lm_scale3(v1, uv.y)));
+
+	lm_vec3 n0 = triangle->n[0];
+	lm_vec3 n1 = triangle->n[1];
+	lm_vec3 n2 = triangle->n[2];
+	lm_vec3 nv1 = lm_sub3(n1, n0);
+	lm_vec3 nv2 = lm_sub3(n2, n0);
+	lm_vec3 normal = lm_normalize3(lm_add3(n0, lm_add3(lm_scale3(nv2, uv.x), lm_scale3(nv1, uv.y))));
+	normal = lm_normalize3(normal);
+
+	if (!lm_finite3(position) ||
+		!lm_finite3(normal) ||
+		lm_length3sq(normal) < 0.5f) // don't allow 0.0f. should always be ~1.0f
+		return LM_FALSE;
+
+	lm_vec3 up = lm_v3(0.0f, 1.0f, 0.0f);
+	if (lm_absf(lm_dot3(up, normal)) > 0.8f)
+		up = lm_v3(0.0f, 0.0f, 1.0f);
+	lm_vec3 side = lm_normalize3(lm_cross3(up, normal));
+
+	*outPosition = position;
+	*outNormal = normal;
+	*outUp = lm_normalize3(lm_cross3(side, normal));
+	return LM_TRUE;
+}
+
+static lm_bool lm_reservePreparedSamples(lm_prepared_geometry *geometry, unsigned int capacity)
+{
+	if (capacity <= geometry->capacity)
+		return LM_TRUE;
+	capacity = lm_maxi(capacity, geometry->capacity * 2);
+
+	lm_ivec2 *texel = (lm_ivec2*)lm_allocate(geometry->allocator, capacity, sizeof(lm_ivec2));
+	unsigned int *triangle = (unsigned int*)lm_allocate(geometry->allocator, capacity, sizeof(unsigned int));
+	lm_vec3 *position = (lm_vec3*)lm_allocate(geometry->allocator, capacity, sizeof(lm_vec3));
+	lm_vec3 *normal = (lm_vec3*)lm_allocate(geometry->allocator, capacity, sizeof(lm_vec3));
+	lm_vec3 *up = (lm_vec3*)lm_allocate(geometry->allocator, capacity, sizeof(lm_vec3));
+	if (!texel || !triangle || !position || !normal || !up)
+	{ // keeps the current samples
+		lm_deallocate(geometry->allocator, texel);
+		lm_deallocate(geometry->allocator, triangle);
+		lm_deallocate(geometry->allocator, position);
+		lm_deallocate(geometry->allocator, normal);
+		lm_deallocate(geometry->allocator, up);
+		return LM_FALSE;
+	}
+	if (geometry->count)
+	{
+		memcpy(texel, geometry->texel, geometry->count * sizeof(lm_ivec2));
+		memcpy(triangle, geometry->triangle, geometry->count * sizeof(unsigned int));
+		memcpy(position, geometry->position, geometry->count * sizeof(lm_vec3));
+		memcpy(normal, geometry->normal, geometry->count * sizeof(lm_vec3));
+		memcpy(up, geometry->up, geometry->count * sizeof(lm_vec3));
+	}
+	lm_deallocate(geometry->allocator, geometry->texel);
+	lm_deallocate(geometry->allocator, geometry->triangle);
+	lm_deallocate(geometry->allocator, geometry->position);
+	lm_deallocate(geometry->allocator, geometry->normal);
+	lm_deallocate(geometry->allocator, geometry->up);
+	geometry->texel = texel;
+	geometry->triangle = triangle;
+	geometry->position = position;
+	geometry->normal = normal;
+	geometry->up = up;
+	geometry->capacity = capacity;
+	return LM_TRUE;
+}
+
+static lm_bool lm_appendPreparedSample(lm_prepared_geometry *geometry, lm_ivec2 texel, unsigned int triangle, lm_vec3 position, lm_vec3 normal, lm_vec3 up)
+{
+	if (!lm_reservePreparedSamples(geometry, geometry->count + 1))
+		return LM_FALSE;
+	geometry->texel[geometry->count] = texel;
+	geometry->triangle[geometry->count] = triangle;
+	geometry->position[geometry->count] = position;
+	geometry->normal[geometry->count] = normal;
+	geometry->up[geometry->count] = up;
+	geometry->count++;
+	return LM_TRUE;
+}
+
+// one bit per lightmap texel
+static inline lm_bool lm_isCovered(const unsigned char *covered, int w, int x, int y)
+{
+	size_t i = (size_t)y * w + x;
+	return (covered[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void lm_setCovered(unsigned char *covered, int w, int x, int y)
+{
+	size_t i = (size_t)y * w + x;
+	covered[i >> 3] |= (unsigned char)(1 << (i & 7));
+}
+
+// rasterizes a range of triangles into its own sample list
+typedef struct lm_prepare_job
+{
+	const lm_mesh *mesh;
+	const lm_vertex_cache *vertices;
+	int width, height;
+	unsigned int firstTriangle, endTriangle;
+	lm_ivec2 *rasterMin, *rasterMax; // shared by all jobs. each job only writes its own triangles
+	lm_ivec2 boundsMin, boundsMax;   // raster bounds of the whole mesh
+	lm_prepared_geometry samples;
+	lm_bool failed;                  // an allocation failed
+} lm_prepare_job;
+
+static void lm_runPrepareJob(void *data)
+{
+	lm_prepare_job *job = (lm_prepare_job*)data;
+	// texels that already belong to a triangle of this job ("first triangle wins").
+	// the bitmap only spans the raster bounds of the mesh, which are small for the meshes of a shared atlas.
+	int w = job->width, h = job->height;
+	lm_ivec2 o = job->boundsMin;
+	int bw = job->boundsMax.x - o.x + 1, bh = job->boundsMax.y - o.y + 1;
+	unsigned char *covered = (unsigned char*)lm_allocate(job->samples.allocator, ((size_t)bw * bh + 7) / 8, 1);
+	job->failed = !covered;
+
+	for (unsigned int t = job->firstTriangle; t < job->endTriangle && !job->failed; t++)
+	{
+		lm_triangle triangle;
+		lm_loadTriangle(job->mesh, job->vertices, t * 3, w, h, &triangle);
+		job->rasterMin[t] = triangle.rasterMin;
+		job->rasterMax[t] = triangle.rasterMax;
+
+#ifdef LM_COVERAGE
+		lm_coverage_edges edges;
+		lm_setupCoverageEdges(&triangle, w, h, &edges);
+		int inside = 0, outside = 0;
+#endif
+
+		for (int y = triangle.rasterMin.y; y < triangle.rasterMax.y && !job->failed; y++)
+		{
+			for (int x = triangle.rasterMin.x; x < triangle.rasterMax.x; x++)
+			{
+#ifdef LM_COVERAGE
+				int k = (x - triangle.rasterMin.x) & 3;
+				if (k == 0 && edges.valid)
+					lm_classifyTexels4(&edges, x, y, &inside, &outside);
+				if (outside & (1 << k))
+					continue;
+#endif
+				if (lm_isCovered(covered, bw, x - o.x, y - o.y))
+					continue;
+
+				lm_vec2 centroid;
+#ifdef LM_COVERAGE
+				if (inside & (1 << k))
+					centroid = lm_v2((float)x + 0.5f, (float)y + 0.5f); // the texel center is what clipping the full texel gives
+				else
+#endif
+				if (!lm_clipTexelCentroid(&triangle, x, y, &centroid))
+					continue;
+
+				lm_vec3 position, normal, up;
+				if (!lm_sampleTriangle(&triangle, centroid, &position, &normal, &up))
+					continue;
+
+				lm_setCovered(covered, bw, x - o.x, y - o.y);
+				if (!lm_appendPreparedSample(&job->samples, lm_i2(x, y), t, position, normal, up))
+				{
+					job->failed = LM_TRUE;
+					break;
+				}
+			}
+		}
+	}
+
+	lm_deallocate(job->samples.allocator, covered);
+}
+
+typedef void (*lm_job_func)(void *job);
+typedef struct lm_job_call
+{
+	lm_job_func run;
+	void *job;
+} lm_job_call;
+
+#ifndef LM_NO_THREADS
+#if defined(_WIN32)
+typedef HANDLE lm_thread;
+static DWORD WINAPI lm_jobThread(LPVOID call) { ((lm_job_call*)call)->run(((lm_job_call*)call)->job); return 0; }
+static lm_bool lm_startThread(lm_thread *thread, lm_job_call *call) { *thread = CreateThread(NULL, 0, lm_jobThread, call, 0, NULL); return *thread != NULL; }
+static void lm_joinThread(lm_thread thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+#else
+typedef pthread_t lm_thread;
+static void *lm_jobThread(void *call) { ((lm_job_call*)call)->run(((lm_job_call*)call)->job); return NULL; }
+static lm_bool lm_startThread(lm_thread *thread, lm_job_call *call) { return pthread_create(thread, NULL, lm_jobThread, call) == 0; }
+static void lm_joinThread(lm_thread thread) { pthread_join(thread, NULL); }
+#endif
+#endif
+
+// runs an array of jobs (jobSize bytes each, at most LM_MAX_THREADS) in parallel.
+// the calling thread takes the first job and the jobs of threads that couldn't be started.
+static void lm_runJobs(lm_job_func run, void *jobs, size_t jobSize, int jobCount)
+{
+	assert(jobCount <= LM_MAX_THREADS);
+#ifndef LM_NO_THREADS
+	lm_thread threads[LM_MAX_THREADS];
+	lm_job_call calls[LM_MAX_THREADS];
+	lm_bool started[LM_MAX_THREADS] = { 0 };
+	for (int i = 1; i < jobCount; i++)
+	{
+		calls[i].run = run;
+		calls[i].job = (char*)jobs + i * jobSize;
+		started[i] = lm_startThread(&threads[i], calls + i);
+	}
+	if (jobCount > 0)
+		run(jobs);
+	for (int i = 1; i < jobCount; i++)
+	{
+		if (started[i])
+			lm_joinThread(threads[i]);
+		else
+			run((char*)jobs + i * jobSize);
+	}
+#else
+	for (int i = 0; i < jobCount; i++)
+		run((char*)jobs + i * jobSize);
+#endif
+}
+
+static int lm_processorCount(void)
+{
+#if defined(LM_NO_THREADS)
+	return 1;
+#elif defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return lm_maxi((int)info.dwNumberOfProcessors, 1);
+#else
+	return lm_maxi((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+}
+
+#define LM_SAMPLE_ORDER_SPATIAL 1
+#define LM_SAMPLE_ORDER_NORMAL  2
+
+typedef struct lm_sample_key
+{
+	unsigned long long key;
+	unsigned int index;
+} lm_sample_key;
+
+static int lm_compareSampleKeys(const void *a, const void *b)
+{
+	const lm_sample_key *ka = (const lm_sample_key*)a;
+	const lm_sample_key *kb = (const lm_sample_key*)b;
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	return ka->index < kb->index ? -1 : ka->index > kb->index; // keep the triangle order of equal keys
+}
+
+static unsigned long long lm_mortonExpand(unsigned int v)
+{
+	// spread the lower 21 bits of v to every third bit
+	unsigned long long x = v & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x <<  8) & 0x100f00f00f00f00fULL;
+	x = (x | x <<  4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x <<  2) & 0x1249249249249249ULL;
+	return x;
+}
+
+// reorders the samples along a 3D morton curve through their positions (optionally grouped by normal octant first).
+// the order of the samples within a pass doesn't matter, since interpolation only depends on the previous passes.
+static lm_bool lm_sortSamples(lm_prepared_geometry *geometry, int order)
+{
+	if (geometry->count < 2)
+		return LM_TRUE;
+
+	lm_vec3 bbMin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX), bbMax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		bbMin = lm_min3(bbMin, geometry->position[i]);
+		bbMax = lm_max3(bbMax, geometry->position[i]);
+	}
+	lm_vec3 extent = lm_sub3(bbMax, bbMin);
+	float scale = (float)0x1fffff / lm_maxf(lm_maxf(lm_maxf(extent.x, extent.y), extent.z), FLT_MIN);
+
+	lm_sample_key *keys = (lm_sample_key*)lm_allocate(geometry->allocator, geometry->count, sizeof(lm_sample_key));
+	if (!keys)
+		return LM_FALSE;
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		lm_vec3 p = lm_scale3(lm_sub3(geometry->position[i], bbMin), scale);
+		unsigned long long key =
+			lm_mortonExpand((unsigned int)p.x) << 2 |
+			lm_mortonExpand((unsigned int)p.y) << 1 |
+			lm_mortonExpand((unsigned int)p.z);
+		if (order & LM_SAMPLE_ORDER_NORMAL)
+		{
+			lm_vec3 n = geometry->normal[i];
+			unsigned long long octant = (n.x < 0.0f ? 4 : 0) | (n.y < 0.0f ? 2 : 0) | (n.z < 0.0f ? 1 : 0);
+			key = (key >> 3) | (octant << 60); // drop the least significant morton level
+		}
+		keys[i].key = key;
+		keys[i].index = i;
+	}
+	qsort(keys, geometry->count, sizeof(lm_sample_key), lm_compareSampleKeys);
+
+	lm_prepared_geometry sorted;
+	memset(&sorted, 0, sizeof(sorted));
+	sorted.allocator = geometry->allocator;
+	if (!lm_reservePreparedSamples(&sorted, geometry->count))
+	{
+		lm_deallocate(geometry->allocator, keys);
+		return LM_FALSE;
+	}
+	for (unsigned int i = 0; i < geometry->count; i++)
+	{
+		unsigned int j = keys[i].index;
+		sorted.texel[i] = geometry->texel[j];
+		sorted.triangle[i] = geometry->triangle[j];
+		sorted.position[i] = geometry->position[j];
+		sorted.normal[i] = geometry->normal[j];
+		sorted.up[i] = geometry->up[j];
+	}
+	LM_SWAP(lm_ivec2*, geometry->texel, sorted.texel);
+	LM_SWAP(unsigned int*, geometry->triangle, sorted.triangle);
+	LM_SWAP(lm_vec3*, geometry->position, sorted.position);
+	LM_SWAP(lm_vec3*, geometry->normal, sorted.normal);
+	LM_SWAP(lm_vec3*, geometry->up, sorted.up);
+	geometry->capacity = sorted.capacity;
+	lm_deallocate(geometry->allocator, sorted.texel);
+	lm_deallocate(geometry->allocator, sorted.triangle);
+	lm_deallocate(geometry->allocator, sorted.position);
+	lm_deallocate(geometry->allocator, sorted.normal);
+	lm_deallocate(geometry->allocator, sorted.up);
+	lm_deallocate(geometry->allocator, keys);
+	return LM_TRUE;
+}
+
+// UV charts: triangles that share a lightmap coordinate are connected
+typedef struct lm_uv_corner
+{
+	float u, v;
+	unsigned int triangle;
+} lm_uv_corner;
+
+static int lm_compareUVCorners(const void *a, const void *b)
+{
+	const lm_uv_corner *ca = (const lm_uv_corner*)a;
+	const lm_uv_corner *cb = (const lm_uv_corner*)b;
+	if (ca->u != cb->u) return ca->u < cb->u ? -1 : 1;
+	if (ca->v != cb->v) return ca->v < cb->v ? -1 : 1;
+	return ca->triangle < cb->triangle ? -1 : (ca->triangle > cb->triangle ? 1 : 0);
+}
+
+static unsigned int lm_findChartRoot(unsigned int *parent, unsigned int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]]; // path halving
+		i = parent[i];
+	}
+	return i;
+}
+
+static lm_bool lm_findCharts(const lm_mesh *mesh, const lm_vertex_cache *vertices, lm_prepared_geometry *geometry)
+{
+	unsigned int *chart = geometry->chart; // union-find forest, roots are the lowest triangle index of each chart
+	for (unsigned int t = 0; t < geometry->triangleCount; t++)
+		chart[t] = t;
+
+	// sorting the corners by their lightmap coords brings the shared ones together
+	unsigned int cornerCount = geometry->triangleCount * 3;
+	lm_uv_corner *corners = (lm_uv_corner*)lm_allocate(geometry->allocator, cornerCount, sizeof(lm_uv_corner));
+	if (!corners)
+		return LM_FALSE;
+	for (unsigned int i = 0; i < cornerCount; i++)
+	{
+		unsigned int index = lm_getVertexIndex(mesh, i);
+		corners[i].u = vertices->u[index];
+		corners[i].v = vertices->v[index];
+		corners[i].triangle = i / 3;
+	}
+	qsort(corners, cornerCount, sizeof(lm_uv_corner), lm_compareUVCorners);
+
+	for (unsigned int i = 1; i < cornerCount; i++)
+	{
+		if (corners[i].u != corners[i - 1].u || corners[i].v != corners[i - 1].v)
+			continue;
+		unsigned int a = lm_findChartRoot(chart, corners[i - 1].triangle);
+		unsigned int b = lm_findChartRoot(chart, corners[i].triangle);
+		if (a < b)
+			chart[b] = a;
+		else
+			chart[a] = b;
+	}
+	for (unsigned int t = 0; t < geometry->triangleCount; t++)
+		chart[t] = lm_findChartRoot(chart, t);
+	lm_deallocate(geometry->allocator, corners);
+	return LM_TRUE;
+}
+
+// rasterizes the triangles into the samples of the geometry on up to threadCount threads
+static lm_bool lm_rasterizeGeometry(lm_prepared_geometry *geometry, const lm_mesh *mesh, const lm_vertex_cache *vertices, int threadCount)
+{
+	lm_allocator *allocator = geometry->allocator;
+	int w = geometry->width, h = geometry->height;
+
+	// the raster bounds of all triangles are within the (conservative) bounds of the vertices
+	lm_ivec2 boundsMin = lm_i2(0, 0), boundsMax = lm_i2(-1, -1);
+	if (vertices->count > 0)
+	{
+		lm_vec2 uvMin = lm_v2(FLT_MAX, FLT_MAX), uvMax = lm_v2(-FLT_MAX, -FLT_MAX);
+		for (unsigned int i = 0; i < vertices->count; i++)
+		{
+			uvMin = lm_min2(uvMin, lm_v2(vertices->u[i], vertices->v[i]));
+			uvMax = lm_max2(uvMax, lm_v2(vertices->u[i], vertices->v[i]));
+		}
+		lm_vec2 bbMin = lm_floor2(uvMin);
+		lm_vec2 bbMax = lm_ceil2 (uvMax);
+		boundsMin = lm_i2(lm_maxi((int)bbMin.x - 1, 0), lm_maxi((int)bbMin.y - 1, 0));
+		boundsMax = lm_i2(lm_mini((int)bbMax.x + 1, w - 1), lm_mini((int)bbMax.y + 1, h - 1));
+	}
+	int bw = boundsMax.x - boundsMin.x + 1, bh = boundsMax.y - boundsMin.y + 1;
+
+	// split the triangles into contiguous ranges. small meshes are not worth a thread.
+	const unsigned int minTrianglesPerJob = 256;
+	int jobCount = lm_maxi(lm_mini(lm_mini(threadCount, LM_MAX_THREADS), (int)(geometry->triangleCount / minTrianglesPerJob)), 1);
+	lm_prepare_job *jobs = (lm_prepare_job*)lm_allocate(allocator, jobCount, sizeof(lm_prepare_job));
+	if (!jobs)
+		return LM_FALSE;
+	for (int i = 0; i < jobCount; i++)
+	{
+		jobs[i].mesh = mesh;
+		jobs[i].vertices = vertices;
+		jobs[i].width = w;
+		jobs[i].height = h;
+		jobs[i].firstTriangle = (unsigned int)((unsigned long long)geometry->triangleCount * i / jobCount);
+		jobs[i].endTriangle = (unsigned int)((unsigned long long)geometry->triangleCount * (i + 1) / jobCount);
+		jobs[i].rasterMin = geometry->rasterMin;
+		jobs[i].rasterMax = geometry->rasterMax;
+		jobs[i].boundsMin = boundsMin;
+		jobs[i].boundsMax = boundsMax;
+		jobs[i].samples.allocator = allocator;
+	}
+
+	lm_runJobs(lm_runPrepareJob, jobs, sizeof(lm_prepare_job), jobCount);
+
+	// merge the jobs in triangle order, so that a texel still belongs to the first triangle that covers it
+	unsigned int count = 0;
+	lm_bool failed = LM_FALSE;
+	for (int i = 0; i < jobCount; i++)
+	{
+		count += jobs[i].samples.count;
+		failed = failed || jobs[i].failed;
+	}
+	failed = failed || !lm_reservePreparedSamples(geometry, count);
+	unsigned char *covered = jobCount > 1 && !failed ? (unsigned char*)lm_allocate(allocator, ((size_t)bw * bh + 7) / 8, 1) : NULL;
+	failed = failed || (jobCount > 1 && !covered);
+	for (int i = 0; i < jobCount; i++)
+	{
+		lm_prepared_geometry *samples = &jobs[i].samples;
+		for (unsigned int j = 0; j < samples->count && !failed; j++)
+		{
+			lm_ivec2 texel = samples->texel[j];
+			if (covered)
+			{
+				if (lm_isCovered(covered, bw, texel.x - boundsMin.x, texel.y - boundsMin.y))
+					continue; // an earlier job already owns this texel
+				lm_setCovered(covered, bw, texel.x - boundsMin.x, texel.y - boundsMin.y);
+			}
+			lm_appendPreparedSample(geometry, texel, samples->triangle[j], samples->position[j], samples->normal[j], samples->up[j]); // reserved above
+		}
+		lm_deallocate(allocator, samples->texel);
+		lm_deallocate(allocator, samples->triangle);
+		lm_deallocate(allocator, samples->position);
+		lm_deallocate(allocator, samples->normal);
+		lm_deallocate(allocator, samples->up);
+	}
+	lm_deallocate(allocator, covered);
+	lm_deallocate(allocator, jobs);
+	return !failed;
+}
+
+// NULL => the allocate function failed
+static lm_prepared_geometry *lm_prepareGeometry(lm_allocator *allocator, const lm_mesh *mesh, int w, int h, int threadCount, int sampleOrder)
+{
+	lm_prepared_geometry *geometry = (lm_prepared_geometry*)lm_allocate(allocator, 1, sizeof(lm_prepared_geometry));
+	if (!geometry)
+		return NULL;
+	lm_retainAllocator(allocator);
+	geometry->allocator = allocator;
+	geometry->width = w;
+	geometry->height = h;
+	geometry->triangleCount = mesh->count / 3;
+	geometry->rasterMin = (lm_ivec2*)lm_allocate(allocator, geometry->triangleCount, sizeof(lm_ivec2));
+	geometry->rasterMax = (lm_ivec2*)lm_allocate(allocator, geometry->triangleCount, sizeof(lm_ivec2));
+	geometry->chart = (unsigned int*)lm_allocate(allocator, geometry->triangleCount, sizeof(unsigned int));
+
+	lm_vertex_cache vertices;
+	vertices.memory = NULL;
+	lm_bool prepared = geometry->rasterMin && geometry->rasterMax && geometry->chart &&
+		lm_createVertexCache(allocator, mesh, w, h, &vertices) &&
+		lm_findCharts(mesh, &vertices, geometry) &&
+		lm_rasterizeGeometry(geometry, mesh, &vertices, threadCount);
+	lm_deallocate(allocator, vertices.memory);
+
+	if (prepared && (sampleOrder & LM_SAMPLE_ORDER_SPATIAL))
+		prepared = lm_sortSamples(geometry, sampleOrder);
+
+	// texel ownership for the interpolation across triangles and the geometry-aware interpolation guard
+	prepared = prepared && lm_initTexelTiles(allocator, &geometry->sampleAt, w, h, lm_texelU(LM_NO_SAMPLE));
+	for (unsigned int i = 0; prepared && i < geometry->count; i++)
+		prepared = lm_setTexelValue(&geometry->sampleAt, geometry->texel[i].x, geometry->texel[i].y, lm_texelU(i));
+
+	if (!prepared)
+	{
+		lmDestroyPreparedGeometry(geometry);
+		return NULL;
+	}
+	return geometry;
+}
+
+static GLuint lm_LoadShader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	if (shader == 0)
+	{
+		fprintf(stderr, "Could not create shader!\n");
+		return 0;
+	}
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	GLint compiled;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		fprintf(stderr, "Could not compile shader!\n");
+		GLint infoLen = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
+		if (infoLen)
+		{
+			char* infoLog = (char*)malloc(infoLen);
+			glGetShaderInfoLog(shader, infoLen, NULL, infoLog);
+			fprintf(stderr, "%s\n", infoLog);
+			free(infoLog);
+		}
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+static GLuint lm_LoadProgram(const char *vp, const char *fp)
+{
+	GLuint program = glCreateProgram();
+	if (program == 0)
+	{
+		fprintf(stderr, "Could not create program!\n");
 		return 0;
 	}
 	GLuint vertexShader = lm_LoadShader(GL_VERTEX_SHADER, vp);
@@ -1137,15 +3827,107 @@ static GLuint lm_LoadProgram(const char *vp, const char *fp)
 	return program;
 }
 
+#ifdef GL_COMPUTE_SHADER
+static GLuint lm_LoadComputeProgram(const char *cp)
+{
+	GLuint program = glCreateProgram();
+	if (program == 0)
+	{
+		fprintf(stderr, "Could not create program!\n");
+		return 0;
+	}
+	GLuint computeShader = lm_LoadShader(GL_COMPUTE_SHADER, cp);
+	glAttachShader(program, computeShader);
+	glLinkProgram(program);
+	glDeleteShader(computeShader);
+	GLint linked;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		fprintf(stderr, "Could not link program!\n");
+		GLint infoLen = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &infoLen);
+		if (infoLen)
+		{
+			char* infoLog = (char*)malloc(sizeof(char) * infoLen);
+			glGetProgramInfoLog(program, infoLen, NULL, infoLog);
+			fprintf(stderr, "%s\n", infoLog);
+			free(infoLog);
+		}
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+#endif
+
+static lm_bool lm_hasComputeShaders(void)
+{
+#ifdef GL_COMPUTE_SHADER
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	return major > 4 || (major == 4 && minor >= 3);
+#else
+	return LM_FALSE;
+#endif
+}
+
 static float lm_defaultWeights(float cos_theta, void *userdata)
 {
 	return 1.0f;
 }
 
+static void lm_chooseBatchSize(lm_context *ctx, const lm_create_params *params)
+{
+	// the batch framebuffer has to be a valid texture, renderbuffer and viewport
+	GLint maxTextureSize, maxRenderbufferSize, maxViewportDims[2];
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRenderbufferSize);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewportDims);
+	int maxWidth = lm_mini(lm_mini(maxTextureSize, maxRenderbufferSize), maxViewportDims[0]);
+	int maxHeight = lm_mini(lm_mini(maxTextureSize, maxRenderbufferSize), maxViewportDims[1]);
+	int maxCountX = lm_maxi(maxWidth / (3 * ctx->hemisphere.size), 1);
+	int maxCountY = lm_maxi(maxHeight / ctx->hemisphere.size, 1);
+
+	int countX = params ? params->batchHemisphereCountX : 0;
+	int countY = params ? params->batchHemisphereCountY : 0;
+	if (countX <= 0 || countY <= 0)
+	{
+		// per hemisphere: RGBA32F color and 24 bit depth in the batch + the quarter sized RGBA32F downsampling target
+		double budget = (params && params->batchMemoryBudget > 0 ? params->batchMemoryBudget : 32) * 1024.0 * 1024.0;
+		double hemisphereBytes = 3.0 * ctx->hemisphere.size * ctx->hemisphere.size * (16.0 + 4.0 + 16.0 / 4.0);
+		int count = lm_maxi((int)(budget / hemisphereBytes), 1);
+		countX = lm_maxi((int)sqrt(count / 3.0), 1); // prefer a square framebuffer (3 * countX = countY)
+		countY = count / countX;
+	}
+	ctx->hemisphere.fbHemiCountX = lm_mini(countX, maxCountX);
+	ctx->hemisphere.fbHemiCountY = lm_mini(countY, maxCountY);
+}
+
+static void lm_freeContext(lm_context *ctx)
+{
+	lm_allocator *allocator = ctx->allocator;
+	lm_deallocate(allocator, ctx);
+	lm_releaseAllocator(allocator); // stays alive for the remaining prepared geometries
+}
+
 lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	float clearR, float clearG, float clearB,
 	int interpolationPasses, float interpolationThreshold,
 	float cameraToSurfaceDistanceModifier)
+{
+	return lmCreateEx(hemisphereSize, zNear, zFar,
+		clearR, clearG, clearB,
+		interpolationPasses, interpolationThreshold,
+		cameraToSurfaceDistanceModifier, NULL);
+}
+
+lm_context *lmCreateEx(int hemisphereSize, float zNear, float zFar,
+	float clearR, float clearG, float clearB,
+	int interpolationPasses, float interpolationThreshold,
+	float cameraToSurfaceDistanceModifier,
+	const lm_create_params *params)
 {
 	assert(hemisphereSize == 512 || hemisphereSize == 256 || hemisphereSize == 128 ||
 		   hemisphereSize ==  64 || hemisphereSize ==  32 || hemisphereSize ==  16);
@@ -1154,10 +3936,44 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	assert(interpolationPasses >= 0 && interpolationPasses <= 8);
 	assert(interpolationThreshold >= 0.0f);
 
-	lm_context *ctx = (lm_context*)LM_CALLOC(1, sizeof(lm_context));
+	lm_allocator *allocator = lm_createAllocator(params);
+	if (!allocator)
+		return NULL;
+	lm_context *ctx = (lm_context*)lm_allocate(allocator, 1, sizeof(lm_context));
+	if (!ctx)
+	{
+		lm_releaseAllocator(allocator);
+		return NULL;
+	}
+	ctx->allocator = allocator;
 
 	ctx->meshPosition.passCount = 1 + 3 * interpolationPasses;
 	ctx->interpolationThreshold = interpolationThreshold;
+	ctx->threadCount = params && params->threadCount > 0 ? params->threadCount : lm_processorCount();
+	if (params && params->spatialSampleOrder)
+		ctx->sampleOrder = LM_SAMPLE_ORDER_SPATIAL | (params->normalSampleOrder ? LM_SAMPLE_ORDER_NORMAL : 0);
+	if (params && params->adaptiveSampling)
+	{
+		assert(params->errorTarget >= 0.0f);
+		ctx->adaptive.enabled = LM_TRUE;
+		ctx->adaptive.budget = params->sampleBudget;
+		ctx->adaptive.errorTarget = params->errorTarget > 0.0f ? params->errorTarget : interpolationThreshold;
+	}
+	if (params && params->irradianceCaching)
+	{ // uses the sample selection of the adaptive sampling rounds
+		assert(params->irradianceCacheAccuracy >= 0.0f);
+		ctx->adaptive.enabled = LM_TRUE;
+		ctx->adaptive.budget = params->sampleBudget;
+		ctx->irradianceCache.enabled = LM_TRUE;
+		ctx->irradianceCache.accuracy = params->irradianceCacheAccuracy > 0.0f ? params->irradianceCacheAccuracy : 0.3f;
+	}
+	ctx->interpolationGuard.minNormalCos = -2.0f;
+	if (params && params->interpolationMaxNormalAngle > 0.0f)
+		ctx->interpolationGuard.minNormalCos = cosf(params->interpolationMaxNormalAngle * 3.14159265358979f / 180.0f);
+	ctx->interpolationGuard.maxPositionError = params && params->interpolationMaxPositionError > 0.0f ? params->interpolationMaxPositionError : FLT_MAX;
+	ctx->interpolationGuard.maxHitDistanceFraction = params && params->interpolationMaxHitDistanceFraction > 0.0f ? params->interpolationMaxHitDistanceFraction : 0.0f;
+	ctx->interpolationGuard.enabled = ctx->interpolationGuard.minNormalCos > -2.0f || ctx->interpolationGuard.maxPositionError < FLT_MAX || ctx->interpolationGuard.maxHitDistanceFraction > 0.0f;
+	ctx->chartInterpolation = params && params->chartInterpolation;
 	ctx->hemisphere.size = hemisphereSize;
 	ctx->hemisphere.zNear = zNear;
 	ctx->hemisphere.zFar = zFar;
@@ -1167,8 +3983,60 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	ctx->hemisphere.clearColor.b = clearB;
 
 	// calculate hemisphere batch size
-	ctx->hemisphere.fbHemiCountX = 1536 / (3 * ctx->hemisphere.size);
-	ctx->hemisphere.fbHemiCountY = 512 / ctx->hemisphere.size;
+	lm_chooseBatchSize(ctx, params);
+
+#ifdef GL_COMPUTE_SHADER
+	// hemisphere compute shader (weighted sum of each 3x1 hemisphere layout by parallel reduction in one dispatch)
+	if (!(params && params->disableComputeIntegration) && lm_hasComputeShaders())
+	{
+		const char *cs =
+			"#version 430 core\n"
+			"layout(local_size_x = 256) in;\n"
+			"uniform sampler2D hemispheres;\n"
+			"uniform sampler2D weights;\n"
+			"uniform int hemiCountX;\n"
+
+			"layout(std430, binding = 0) writeonly buffer Results { vec4 results[]; };\n"
+			"shared vec4 sums[256];\n"
+
+			"void main()\n"
+			"{\n" // one work group sums up one hemisphere (alpha component contains the weighted valid sample count)
+				"ivec2 size = textureSize(weights, 0);\n"
+				"int hemi = int(gl_WorkGroupID.x);\n"
+				"ivec2 origin = ivec2(hemi % hemiCountX, hemi / hemiCountX) * size;\n"
+				"uint i = gl_LocalInvocationIndex;\n"
+				"vec4 sum = vec4(0.0);\n"
+				"for (int j = int(i); j < size.x * size.y; j += 256)\n"
+				"{\n"
+					"ivec2 uv = ivec2(j % size.x, j / size.x);\n"
+					"vec4 texel = texelFetch(hemispheres, origin + uv, 0);\n"
+					"vec2 weight = texelFetch(weights, uv, 0).rg;\n"
+					"sum += vec4(texel.rgb * weight.r, texel.a * weight.g);\n"
+				"}\n"
+				"sums[i] = sum;\n"
+				"memoryBarrierShared();\n"
+				"barrier();\n"
+				"for (uint stride = 128u; stride > 0u; stride >>= 1)\n"
+				"{\n"
+					"if (i < stride)\n"
+						"sums[i] += sums[i + stride];\n"
+					"memoryBarrierShared();\n"
+					"barrier();\n"
+				"}\n"
+				"if (i == 0u)\n"
+					"results[hemi] = sums[0];\n"
+			"}\n";
+		ctx->hemisphere.computePass.programID = lm_LoadComputeProgram(cs);
+		if (!ctx->hemisphere.computePass.programID)
+			fprintf(stderr, "Error loading the hemisphere compute shader program... falling back to the downsampling passes!\n");
+		ctx->hemisphere.computePass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.computePass.programID, "hemispheres");
+		ctx->hemisphere.computePass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.computePass.programID, "weights");
+		ctx->hemisphere.computePass.hemiCountXID = glGetUniformLocation(ctx->hemisphere.computePass.programID, "hemiCountX");
+	}
+#endif
+	lm_bool hitDistances = ctx->interpolationGuard.maxHitDistanceFraction > 0.0f || ctx->irradianceCache.enabled;
+	lm_bool downsampling = !ctx->hemisphere.computePass.programID || hitDistances; // the hit distances are always downsampled
+	int fbCount = downsampling ? 2 : 1; // the compute shader doesn't need the downsampling target
 
 	// hemisphere batch framebuffers
 	unsigned int w[] = {
@@ -1178,15 +4046,18 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 		ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size,
 		ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size / 2 };
 
-	glGenTextures(2, ctx->hemisphere.fbTexture);
-	glGenFramebuffers(2, ctx->hemisphere.fb);
-	glGenRenderbuffers(1, &ctx->hemisphere.fbDepth);
+	glGenTextures(fbCount, ctx->hemisphere.fbTexture);
+	glGenFramebuffers(fbCount, ctx->hemisphere.fb);
+	glGenTextures(1, &ctx->hemisphere.fbDepth);
 
-	glBindRenderbuffer(GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w[0], h[0]);
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbDepth); // a texture, so that the hit distances can be read
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w[0], h[0], 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0);
+	ctx->statistics.glAllocations++;
 	glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[0]);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, ctx->hemisphere.fbDepth);
-	for (int i = 0; i < 2; i++)
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, ctx->hemisphere.fbDepth, 0);
+	for (int i = 0; i < fbCount; i++)
 	{
 		glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.fbTexture[i]);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -1194,6 +4065,7 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w[i], h[i], 0, GL_RGBA, GL_FLOAT, 0);
+		ctx->statistics.glAllocations++;
 
 		glBindFramebuffer(GL_FRAMEBUFFER, ctx->hemisphere.fb[i]);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->hemisphere.fbTexture[i], 0);
@@ -1201,10 +4073,11 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 		if (status != GL_FRAMEBUFFER_COMPLETE)
 		{
 			fprintf(stderr, "Could not create framebuffer!\n");
-			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
+			glDeleteProgram(ctx->hemisphere.computePass.programID);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepth);
 			glDeleteFramebuffers(2, ctx->hemisphere.fb);
 			glDeleteTextures(2, ctx->hemisphere.fbTexture);
-			LM_FREE(ctx);
+			lm_freeContext(ctx);
 			return NULL;
 		}
 	}
@@ -1214,6 +4087,7 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	glGenVertexArrays(1, &ctx->hemisphere.vao);
 
 	// hemisphere shader (weighted downsampling of the 3x1 hemisphere layout to a 0.5x0.5 square)
+	if (!ctx->hemisphere.computePass.programID)
 	{
 		const char *vs =
 			"#version 150 core\n"
@@ -1257,22 +4131,66 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 				"vec4 rt = threeWeightedSamples(h_uv, w_uv, ivec2(1, 1));\n"
 				"outColor = lb + rb + lt + rt;\n"
 			"}\n";
-		ctx->hemisphere.firstPass.programID = lm_LoadProgram(vs, fs);
-		if (!ctx->hemisphere.firstPass.programID)
+		ctx->hemisphere.firstPass.programID = lm_LoadProgram(vs, fs);
+		if (!ctx->hemisphere.firstPass.programID)
+		{
+			fprintf(stderr, "Error loading the hemisphere first pass shader program... leaving!\n");
+			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepth);
+			glDeleteFramebuffers(2, ctx->hemisphere.fb);
+			glDeleteTextures(2, ctx->hemisphere.fbTexture);
+			lm_freeContext(ctx);
+			return NULL;
+		}
+		ctx->hemisphere.firstPass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheres");
+		ctx->hemisphere.firstPass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weights");
+	}
+
+	// downsample shader
+	if (downsampling)
+	{
+		const char *vs =
+			"#version 150 core\n"
+			"const vec2 ps[4] = vec2[](vec2(1, -1), vec2(1, 1), vec2(-1, -1), vec2(-1, 1));\n"
+			"void main()\n"
+			"{\n"
+				"gl_Position = vec4(ps[gl_VertexID], 0, 1);\n"
+			"}\n";
+		const char *fs =
+			"#version 150 core\n"
+			"uniform sampler2D hemispheres;\n"
+
+			"layout(pixel_center_integer) in vec4 gl_FragCoord;\n" // whole integer values represent pixel centers, GL_ARB_fragment_coord_conventions
+
+			"out vec4 outColor;\n"
+
+			"void main()\n"
+			"{\n" // this is a sum downsampling pass (alpha component contains the weighted valid sample count)
+				"ivec2 h_uv = ivec2(gl_FragCoord.xy) * 2;\n"
+				"vec4 lb = texelFetch(hemispheres, h_uv + ivec2(0, 0), 0);\n"
+				"vec4 rb = texelFetch(hemispheres, h_uv + ivec2(1, 0), 0);\n"
+				"vec4 lt = texelFetch(hemispheres, h_uv + ivec2(0, 1), 0);\n"
+				"vec4 rt = texelFetch(hemispheres, h_uv + ivec2(1, 1), 0);\n"
+				"outColor = lb + rb + lt + rt;\n"
+			"}\n";
+		ctx->hemisphere.downsamplePass.programID = lm_LoadProgram(vs, fs);
+		if (!ctx->hemisphere.downsamplePass.programID)
 		{
-			fprintf(stderr, "Error loading the hemisphere first pass shader program... leaving!\n");
+			fprintf(stderr, "Error loading the hemisphere downsample pass shader program... leaving!\n");
+			glDeleteProgram(ctx->hemisphere.computePass.programID);
+			glDeleteProgram(ctx->hemisphere.firstPass.programID);
 			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
-			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepth);
 			glDeleteFramebuffers(2, ctx->hemisphere.fb);
 			glDeleteTextures(2, ctx->hemisphere.fbTexture);
-			LM_FREE(ctx);
+			lm_freeContext(ctx);
 			return NULL;
 		}
-		ctx->hemisphere.firstPass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "hemispheres");
-		ctx->hemisphere.firstPass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.firstPass.programID, "weights");
+		ctx->hemisphere.downsamplePass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.downsamplePass.programID, "hemispheres");
 	}
 
-	// downsample shader
+	// hit distance shader (weighted downsampling of the 3x1 hemisphere depth layout to a 0.5x0.5 square)
+	if (hitDistances)
 	{
 		const char *vs =
 			"#version 150 core\n"
@@ -1283,34 +4201,58 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 			"}\n";
 		const char *fs =
 			"#version 150 core\n"
-			"uniform sampler2D hemispheres;\n"
+			"uniform sampler2D depths;\n"
+			"uniform sampler2D weights;\n"
+			"uniform vec2 zNearFar;\n"
 
 			"layout(pixel_center_integer) in vec4 gl_FragCoord;\n" // whole integer values represent pixel centers, GL_ARB_fragment_coord_conventions
 
 			"out vec4 outColor;\n"
 
+			"vec4 weightedInverseDepth(ivec2 h_uv, ivec2 w_uv, ivec2 quadrant)\n"
+			"{\n" // all hemisphere sides share the same near and far planes
+				"float depth = texelFetch(depths, h_uv + quadrant, 0).r * 2.0 - 1.0;\n"
+				"float z = 2.0 * zNearFar.x * zNearFar.y / (zNearFar.y + zNearFar.x - depth * (zNearFar.y - zNearFar.x));\n"
+				"float weight = texelFetch(weights, w_uv + quadrant, 0).g;\n"
+				"return vec4(weight / z, weight, 0.0, 0.0);\n"
+			"}\n"
+
+			"vec4 threeWeightedInverseDepths(ivec2 h_uv, ivec2 w_uv, ivec2 offset)\n"
+			"{\n" // horizontal triple sum
+				"vec4 sum = weightedInverseDepth(h_uv, w_uv, offset);\n"
+				"sum += weightedInverseDepth(h_uv, w_uv, offset + ivec2(2, 0));\n"
+				"sum += weightedInverseDepth(h_uv, w_uv, offset + ivec2(4, 0));\n"
+				"return sum;\n"
+			"}\n"
+
 			"void main()\n"
-			"{\n" // this is a sum downsampling pass (alpha component contains the weighted valid sample count)
-				"ivec2 h_uv = ivec2(gl_FragCoord.xy) * 2;\n"
-				"vec4 lb = texelFetch(hemispheres, h_uv + ivec2(0, 0), 0);\n"
-				"vec4 rb = texelFetch(hemispheres, h_uv + ivec2(1, 0), 0);\n"
-				"vec4 lt = texelFetch(hemispheres, h_uv + ivec2(0, 1), 0);\n"
-				"vec4 rt = texelFetch(hemispheres, h_uv + ivec2(1, 1), 0);\n"
+			"{\n" // this is a weighted sum downsampling pass (x: weighted inverse depth sum, y: weight sum => harmonic mean depth = y / x)
+				"vec2 in_uv = gl_FragCoord.xy * vec2(6.0, 2.0) + vec2(0.5);\n"
+				"ivec2 h_uv = ivec2(in_uv);\n"
+				"ivec2 w_uv = ivec2(mod(in_uv, vec2(textureSize(weights, 0))));\n" // there's no integer modulo :(
+				"vec4 lb = threeWeightedInverseDepths(h_uv, w_uv, ivec2(0, 0));\n"
+				"vec4 rb = threeWeightedInverseDepths(h_uv, w_uv, ivec2(1, 0));\n"
+				"vec4 lt = threeWeightedInverseDepths(h_uv, w_uv, ivec2(0, 1));\n"
+				"vec4 rt = threeWeightedInverseDepths(h_uv, w_uv, ivec2(1, 1));\n"
 				"outColor = lb + rb + lt + rt;\n"
 			"}\n";
-		ctx->hemisphere.downsamplePass.programID = lm_LoadProgram(vs, fs);
-		if (!ctx->hemisphere.downsamplePass.programID)
+		ctx->hemisphere.distancePass.programID = lm_LoadProgram(vs, fs);
+		if (!ctx->hemisphere.distancePass.programID)
 		{
-			fprintf(stderr, "Error loading the hemisphere downsample pass shader program... leaving!\n");
+			fprintf(stderr, "Error loading the hemisphere hit distance shader program... leaving!\n");
+			glDeleteProgram(ctx->hemisphere.computePass.programID);
+			glDeleteProgram(ctx->hemisphere.downsamplePass.programID);
 			glDeleteProgram(ctx->hemisphere.firstPass.programID);
 			glDeleteVertexArrays(1, &ctx->hemisphere.vao);
-			glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
+			glDeleteTextures(1, &ctx->hemisphere.fbDepth);
 			glDeleteFramebuffers(2, ctx->hemisphere.fb);
 			glDeleteTextures(2, ctx->hemisphere.fbTexture);
-			LM_FREE(ctx);
+			lm_freeContext(ctx);
 			return NULL;
 		}
-		ctx->hemisphere.downsamplePass.hemispheresTextureID = glGetUniformLocation(ctx->hemisphere.downsamplePass.programID, "hemispheres");
+		ctx->hemisphere.distancePass.depthsTextureID = glGetUniformLocation(ctx->hemisphere.distancePass.programID, "depths");
+		ctx->hemisphere.distancePass.weightsTextureID = glGetUniformLocation(ctx->hemisphere.distancePass.programID, "weights");
+		ctx->hemisphere.distancePass.zNearFarID = glGetUniformLocation(ctx->hemisphere.distancePass.programID, "zNearFar");
 	}
 
 	// hemisphere weights texture
@@ -1322,8 +4264,14 @@ lm_context *lmCreate(int hemisphereSize, float zNear, float zFar,
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
 	// allocate batchPosition-to-lightmapPosition map
-	ctx->hemisphere.fbHemiToLightmapLocation = (lm_ivec2*)LM_CALLOC(ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_ivec2));
+	ctx->hemisphere.fbHemiToLightmapLocation = (lm_ivec2*)lm_allocate(ctx->allocator, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(lm_ivec2));
+	ctx->hemisphere.fbHemiToMesh = (unsigned int*)lm_allocate(ctx->allocator, ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY, sizeof(unsigned int));
 
+	if (!ctx->hemisphere.firstPass.weightsTextureAllocated || !ctx->hemisphere.fbHemiToLightmapLocation || !ctx->hemisphere.fbHemiToMesh)
+	{ // the allocate function failed
+		lmDestroy(ctx);
+		return NULL;
+	}
 	return ctx;
 }
 
@@ -1338,305 +4286,1377 @@ void lmDestroy(lm_context *ctx)
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
-	// delete gl objects
-	glDeleteTextures(1, &ctx->hemisphere.firstPass.weightsTexture);
-	glDeleteTextures(1, &ctx->hemisphere.storage.texture);
-	glDeleteProgram(ctx->hemisphere.downsamplePass.programID);
-	glDeleteProgram(ctx->hemisphere.firstPass.programID);
-	glDeleteVertexArrays(1, &ctx->hemisphere.vao);
-	glDeleteRenderbuffers(1, &ctx->hemisphere.fbDepth);
-	glDeleteFramebuffers(2, ctx->hemisphere.fb);
-	glDeleteTextures(2, ctx->hemisphere.fbTexture);
-	glDeleteTextures(1, &ctx->hemisphere.storage.texture);
+	// delete gl objects
+	lm_destroyReadbacks(ctx);
+	glDeleteBuffers(1, &ctx->hemisphere.batch.camerasBuffer);
+	glDeleteTextures(1, &ctx->hemisphere.firstPass.weightsTexture);
+	glDeleteProgram(ctx->hemisphere.computePass.programID);
+	glDeleteProgram(ctx->hemisphere.distancePass.programID);
+	glDeleteProgram(ctx->hemisphere.downsamplePass.programID);
+	glDeleteProgram(ctx->hemisphere.firstPass.programID);
+	glDeleteVertexArrays(1, &ctx->hemisphere.vao);
+	glDeleteTextures(1, &ctx->hemisphere.fbDepth);
+	glDeleteFramebuffers(2, ctx->hemisphere.fb);
+	glDeleteTextures(2, ctx->hemisphere.fbTexture);
+
+	// free memory
+	lm_clearQueue(ctx);
+	lm_deallocate(ctx->allocator, ctx->queue.meshes);
+#ifdef LM_DEBUG_INTERPOLATION
+	lm_deallocate(ctx->allocator, ctx->queue.debugTargets);
+#endif
+	lm_freeMeshState(ctx);
+	lm_deallocate(ctx->allocator, ctx->hemisphere.fbHemiToLightmapLocation);
+	lm_deallocate(ctx->allocator, ctx->hemisphere.fbHemiToMesh);
+	lm_deallocate(ctx->allocator, ctx->hemisphere.batch.cameras);
+	lm_deallocate(ctx->allocator, ctx->hemisphere.batch.positions);
+	lm_deallocate(ctx->allocator, ctx->hemisphere.batch.directions);
+#ifdef LM_DEBUG_INTERPOLATION
+	lm_freeTexelTiles(&ctx->lightmap.debug);
+#endif
+	lm_freeContext(ctx);
+}
+
+void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
+{
+	// hemisphere weights texture. bakes in material dependent attenuation behaviour.
+	float *weights = (float*)lm_allocate(ctx->allocator, 2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size, sizeof(float));
+	if (!weights)
+		return; // the allocate function failed: keeps the previous weights
+	float center = (ctx->hemisphere.size - 1) * 0.5f;
+	double sum = 0.0;
+	for (unsigned int y = 0; y < ctx->hemisphere.size; y++)
+	{
+		float dy = 2.0f * (y - center) / (float)ctx->hemisphere.size;
+		for (unsigned int x = 0; x < ctx->hemisphere.size; x++)
+		{
+			float dx = 2.0f * (x - center) / (float)ctx->hemisphere.size;
+			lm_vec3 v = lm_normalize3(lm_v3(dx, dy, 1.0f));
+
+			float solidAngle = v.z * v.z * v.z;
+
+			float *w0 = weights + 2 * (y * (3 * ctx->hemisphere.size) + x);
+			float *w1 = w0 + 2 * ctx->hemisphere.size;
+			float *w2 = w1 + 2 * ctx->hemisphere.size;
+
+			// center weights
+			w0[0] = solidAngle * f(v.z, userdata);
+			w0[1] = solidAngle;
+
+			// left/right side weights
+			w1[0] = solidAngle * f(lm_absf(v.x), userdata);
+			w1[1] = solidAngle;
+
+			// up/down side weights
+			w2[0] = solidAngle * f(lm_absf(v.y), userdata);
+			w2[1] = solidAngle;
+
+			sum += 3.0 * (double)solidAngle;
+		}
+	}
+
+	// normalize weights
+	float weightScale = (float)(1.0 / sum);
+	for (unsigned int i = 0; i < 2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size; i++)
+		weights[i] *= weightScale;
+
+	// upload weight texture
+	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
+	if (ctx->hemisphere.firstPass.weightsTextureAllocated)
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 3 * ctx->hemisphere.size, ctx->hemisphere.size, GL_RG, GL_FLOAT, weights);
+	}
+	else
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RG, GL_FLOAT, weights);
+		ctx->hemisphere.firstPass.weightsTextureAllocated = LM_TRUE;
+		ctx->statistics.glAllocations++;
+	}
+	lm_deallocate(ctx->allocator, weights);
+}
+
+static void lm_setTargetLightmap(lm_context *ctx, void *outLightmap, lm_type type, lm_mapped_image *mapped, lm_sparse_image *sparse, int w, int h, int c)
+{
+	lm_assertTexelType(type, c);
+	// results of an unfinished lightmap can't be written anymore
+	lm_discardReadbacks(ctx);
+	ctx->hemisphere.fbHemiIndex = 0;
+
+#ifdef LM_DEBUG_INTERPOLATION
+	// the debug flags of the previous target lightmap stay with the queued meshes that bake into it
+	if (lm_isQueueTarget(ctx))
+		lm_keepDebugTarget(ctx);
+	else
+		lm_freeTexelTiles(&ctx->lightmap.debug);
+	lm_initTexelTiles(ctx->allocator, &ctx->lightmap.debug, w, h, lm_texelU(0));
+#endif
+
+	ctx->lightmap.data = outLightmap;
+	ctx->lightmap.type = type;
+	ctx->lightmap.mapped = mapped;
+	ctx->lightmap.sparse = sparse;
+	ctx->lightmap.width = w;
+	ctx->lightmap.height = h;
+	ctx->lightmap.channels = c;
+}
+
+void lmSetTargetLightmap(lm_context *ctx, float *outLightmap, int w, int h, int c)
+{
+	lm_setTargetLightmap(ctx, outLightmap, LM_FLOAT, NULL, NULL, w, h, c);
+}
+
+void lmSetTargetLightmapEx(lm_context *ctx, void *outLightmap, lm_type type, int w, int h, int c)
+{
+	lm_setTargetLightmap(ctx, outLightmap, type, NULL, NULL, w, h, c);
+}
+
+void lmSetTargetLightmapMapped(lm_context *ctx, lm_mapped_image *lightmap)
+{
+	lm_setTargetLightmap(ctx, NULL, LM_FLOAT, lightmap, NULL, lightmap->w, lightmap->h, lightmap->c);
+}
+
+void lmSetTargetLightmapSparse(lm_context *ctx, lm_sparse_image *lightmap)
+{
+	lm_setTargetLightmap(ctx, NULL, LM_FLOAT, NULL, lightmap, lightmap->w, lightmap->h, lightmap->c);
+}
+
+// mapped images: a header page followed by the tiles
+#define LM_MAPPED_HEADER_SIZE 4096
+
+typedef struct lm_mapped_image_header
+{
+	char magic[8];
+	int w, h, c;
+	int tileSize;
+} lm_mapped_image_header;
+
+lm_mapped_image *lmMapImage(const char *filename, int w, int h, int c)
+{
+	assert(w > 0 && h > 0 && c > 0 && c <= 4);
+	lm_mapped_image_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "LMTILES", 8);
+	header.w = w;
+	header.h = h;
+	header.c = c;
+	header.tileSize = LM_TILE_SIZE;
+
+	lm_mapped_image *image = (lm_mapped_image*)LM_CALLOC(1, sizeof(lm_mapped_image));
+	image->w = w;
+	image->h = h;
+	image->c = c;
+	image->tilesX = (w + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	image->tilesY = (h + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	image->size = LM_MAPPED_HEADER_SIZE + (size_t)image->tilesX * image->tilesY * LM_TILE_SIZE * LM_TILE_SIZE * c * sizeof(float);
+
+	// keep the content of a file with the same header and size. everything else starts with zeros.
+	lm_mapped_image_header existing;
+	memset(&existing, 0, sizeof(existing));
+#if defined(_WIN32)
+	image->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (image->file == INVALID_HANDLE_VALUE)
+	{
+		LM_FREE(image);
+		return NULL;
+	}
+	LARGE_INTEGER fileSize, zero, size;
+	DWORD bytesRead = 0;
+	zero.QuadPart = 0;
+	size.QuadPart = (LONGLONG)image->size;
+	lm_bool keep = GetFileSizeEx(image->file, &fileSize) && fileSize.QuadPart == size.QuadPart &&
+		ReadFile(image->file, &existing, sizeof(existing), &bytesRead, NULL) && bytesRead == sizeof(existing) && !memcmp(&existing, &header, sizeof(header));
+	lm_bool success = keep || (SetFilePointerEx(image->file, zero, NULL, FILE_BEGIN) && SetEndOfFile(image->file) &&
+		SetFilePointerEx(image->file, size, NULL, FILE_BEGIN) && SetEndOfFile(image->file));
+	image->mapping = success ? CreateFileMappingA(image->file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)image->size >> 32), (DWORD)image->size, NULL) : NULL;
+	image->view = image->mapping ? MapViewOfFile(image->mapping, FILE_MAP_ALL_ACCESS, 0, 0, image->size) : NULL;
+	if (!image->view)
+	{
+		if (image->mapping)
+			CloseHandle(image->mapping);
+		CloseHandle(image->file);
+		LM_FREE(image);
+		return NULL;
+	}
+#else
+	image->file = open(filename, O_RDWR | O_CREAT, 0666);
+	if (image->file < 0)
+	{
+		LM_FREE(image);
+		return NULL;
+	}
+	struct stat status;
+	lm_bool keep = fstat(image->file, &status) == 0 && (size_t)status.st_size == image->size &&
+		read(image->file, &existing, sizeof(existing)) == (ssize_t)sizeof(existing) && !memcmp(&existing, &header, sizeof(header));
+	if (!keep)
+	{ // the file is emptied and its last byte is written, which leaves a (sparse) zero filled file
+		close(image->file);
+		image->file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	}
+	unsigned char zero = 0;
+	lm_bool success = image->file >= 0 && (keep || (lseek(image->file, (off_t)image->size - 1, SEEK_SET) >= 0 && write(image->file, &zero, 1) == 1));
+	image->view = success ? mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->file, 0) : MAP_FAILED;
+	if (image->view == MAP_FAILED)
+	{
+		if (image->file >= 0)
+			close(image->file);
+		LM_FREE(image);
+		return NULL;
+	}
+#endif
+	if (!keep)
+		memcpy(image->view, &header, sizeof(header));
+	image->data = (float*)((char*)image->view + LM_MAPPED_HEADER_SIZE);
+	return image;
+}
+
+void lmUnmapImage(lm_mapped_image *image)
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(image->view);
+	CloseHandle(image->mapping);
+	CloseHandle(image->file);
+#else
+	munmap(image->view, image->size);
+	close(image->file);
+#endif
+	LM_FREE(image);
+}
+
+void lmMappedImageRead(const lm_mapped_image *image, int x, int y, int w, int h, float *out)
+{
+	assert(x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= image->w && y + h <= image->h);
+	lm_mappedImageCopy(image, x, y, w, h, out, (size_t)w * image->c, LM_FALSE);
+}
+
+void lmMappedImageWrite(lm_mapped_image *image, int x, int y, int w, int h, const float *in)
+{
+	assert(x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= image->w && y + h <= image->h);
+	lm_mappedImageCopy(image, x, y, w, h, (float*)in, (size_t)w * image->c, LM_TRUE);
+}
+
+lm_sparse_image *lmCreateSparseImage(int w, int h, int c)
+{
+	assert(w > 0 && h > 0 && c > 0 && c <= 4);
+	lm_sparse_image *image = (lm_sparse_image*)LM_CALLOC(1, sizeof(lm_sparse_image));
+	image->w = w;
+	image->h = h;
+	image->c = c;
+	image->tilesX = (w + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	image->tilesY = (h + LM_TILE_SIZE - 1) / LM_TILE_SIZE;
+	image->tiles = (float**)LM_CALLOC((size_t)image->tilesX * image->tilesY, sizeof(float*));
+	return image;
+}
+
+void lmDestroySparseImage(lm_sparse_image *image)
+{
+	lm_clearSparseArea(image, 0, 0, image->w, image->h);
+	LM_FREE(image->tiles);
+	LM_FREE(image);
+}
+
+const float *lmSparseImageTile(const lm_sparse_image *image, int tx, int ty)
+{
+	assert(tx >= 0 && tx < image->tilesX && ty >= 0 && ty < image->tilesY);
+	return image->tiles[(size_t)ty * image->tilesX + tx];
+}
+
+int lmSparseImageTileCount(const lm_sparse_image *image)
+{
+	int count = 0;
+	for (size_t i = 0; i < (size_t)image->tilesX * image->tilesY; i++)
+		count += image->tiles[i] ? 1 : 0;
+	return count;
+}
+
+void lmSparseImageRead(const lm_sparse_image *image, int x, int y, int w, int h, float *out)
+{
+	assert(x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= image->w && y + h <= image->h);
+	lm_sparseImageCopy(image, x, y, w, h, out, (size_t)w * image->c, LM_FALSE);
+}
+
+void lmSparseImageWrite(lm_sparse_image *image, int x, int y, int w, int h, const float *in)
+{
+	assert(x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= image->w && y + h <= image->h);
+	lm_sparseImageCopy(image, x, y, w, h, (float*)in, (size_t)w * image->c, LM_TRUE);
+}
+
+lm_prepared_geometry *lmPrepareGeometry(lm_context *ctx,
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type normalsType, const void *normalsXYZ, int normalsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType, const void *indices)
+{
+	lm_mesh mesh;
+	mesh.modelMatrix = transformationMatrix;
+	mesh.positions = (const unsigned char*)positionsXYZ;
+	mesh.positionsType = positionsType;
+	mesh.positionsStride = positionsStride == 0 ? sizeof(lm_vec3) : positionsStride;
+	mesh.normals = (const unsigned char*)normalsXYZ;
+	mesh.normalsType = normalsType;
+	mesh.normalsStride = normalsStride == 0 ? sizeof(lm_vec3) : normalsStride;
+	mesh.uvs = (const unsigned char*)lightmapCoordsUV;
+	mesh.uvsType = lightmapCoordsType;
+	mesh.uvsStride = lightmapCoordsStride == 0 ? sizeof(lm_vec2) : lightmapCoordsStride;
+	mesh.indicesType = indicesType;
+	mesh.indices = (const unsigned char*)indices;
+	mesh.count = count;
+
+	lm_inverseTranspose(transformationMatrix, mesh.normalMatrix);
+
+	return lm_prepareGeometry(ctx->allocator, &mesh, ctx->lightmap.width, ctx->lightmap.height, ctx->threadCount, ctx->sampleOrder);
+}
+
+void lmGetPreparedGeometryGuides(const lm_prepared_geometry *geometry, float *outPositions, float *outNormals)
+{
+	for (unsigned int sample = 0; sample < geometry->count; sample++)
+	{
+		size_t i = (size_t)geometry->texel[sample].y * geometry->width + geometry->texel[sample].x;
+		if (outPositions)
+			memcpy(outPositions + i * 3, &geometry->position[sample], sizeof(lm_vec3));
+		if (outNormals)
+			memcpy(outNormals + i * 3, &geometry->normal[sample], sizeof(lm_vec3));
+	}
+}
+
+void lmDestroyPreparedGeometry(lm_prepared_geometry *geometry)
+{
+	if (!geometry)
+		return;
+	lm_deallocate(geometry->allocator, geometry->texel);
+	lm_deallocate(geometry->allocator, geometry->triangle);
+	lm_deallocate(geometry->allocator, geometry->position);
+	lm_deallocate(geometry->allocator, geometry->normal);
+	lm_deallocate(geometry->allocator, geometry->up);
+	lm_freeTexelTiles(&geometry->sampleAt);
+	lm_deallocate(geometry->allocator, geometry->rasterMin);
+	lm_deallocate(geometry->allocator, geometry->rasterMax);
+	lm_deallocate(geometry->allocator, geometry->chart);
+	lm_allocator *allocator = geometry->allocator;
+	lm_deallocate(allocator, geometry);
+	lm_releaseAllocator(allocator);
+}
+
+static void lm_setPreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry)
+{
+	assert(geometry->width == ctx->lightmap.width && geometry->height == ctx->lightmap.height); // prepared for another lightmap size?
+
+	if (geometry != ctx->mesh.owned)
+	{
+		lmDestroyPreparedGeometry(ctx->mesh.owned);
+		ctx->mesh.owned = 0;
+	}
+	ctx->mesh.geometry = geometry;
+
+	ctx->meshPosition.pass = 0;
+	ctx->meshPosition.sampleIndex = 0;
+	ctx->meshPosition.hemisphere.side = 5; // no hemisphere yet. lmBegin looks for the first one
+
+	if (ctx->hemisphere.distancePass.programID)
+	{ // texels without a hemisphere are never close to anything
+		lm_freeTexelTiles(&ctx->interpolationGuard.hitDistance);
+		lm_initTexelTiles(ctx->allocator, &ctx->interpolationGuard.hitDistance, ctx->lightmap.width, ctx->lightmap.height, lm_texelF(FLT_MAX));
+	}
+
+	if (ctx->adaptive.enabled)
+		lm_resetAdaptiveSampling(ctx); // the first round is scheduled by lmBegin
+	if (ctx->irradianceCache.enabled)
+		lm_resetIrradianceCache(ctx);
+}
+
+void lmSetPreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry)
+{
+	assert(!ctx->queue.count); // the queued meshes have to be baked first
+	lm_setPreparedGeometry(ctx, geometry);
+}
+
+void lmSetGeometry(lm_context *ctx,
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type normalsType, const void *normalsXYZ, int normalsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType, const void *indices)
+{
+	lm_prepared_geometry *geometry = lmPrepareGeometry(ctx, transformationMatrix,
+		positionsType, positionsXYZ, positionsStride,
+		normalsType, normalsXYZ, normalsStride,
+		lightmapCoordsType, lightmapCoordsUV, lightmapCoordsStride,
+		count, indicesType, indices);
+	assert(geometry); // the allocate function failed
+	lmSetPreparedGeometry(ctx, geometry);
+	ctx->mesh.owned = geometry;
+}
+
+static void lm_queuePreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry, lm_prepared_geometry *owned)
+{
+	assert(!ctx->queue.baking); // meshes can't be added to a running bake
+	if (ctx->queue.count == ctx->queue.capacity)
+	{
+		unsigned int capacity = lm_maxi(2 * ctx->queue.capacity, 64);
+		lm_queued_mesh *meshes = (lm_queued_mesh*)lm_allocate(ctx->allocator, capacity, sizeof(lm_queued_mesh));
+		if (ctx->queue.count)
+			memcpy(meshes, ctx->queue.meshes, ctx->queue.count * sizeof(lm_queued_mesh));
+		lm_deallocate(ctx->allocator, ctx->queue.meshes);
+		ctx->queue.meshes = meshes;
+		ctx->queue.capacity = capacity;
+	}
+
+	// set up the mesh in the context (the first one replaces the mesh set with lmSetGeometry)
+	// and move its state into the queue. the context keeps its target lightmap for the next meshes.
+	lm_setPreparedGeometry(ctx, geometry);
+	ctx->mesh.owned = owned;
+	lm_queued_mesh *mesh = ctx->queue.meshes + ctx->queue.count++;
+	lm_storeQueuedMesh(ctx, mesh); // shares the debug flags of the target lightmap (LM_DEBUG_INTERPOLATION)
+	lm_detachMeshState(ctx);
+}
+
+void lmQueuePreparedGeometry(lm_context *ctx, const lm_prepared_geometry *geometry)
+{
+	lm_queuePreparedGeometry(ctx, geometry, NULL);
+}
+
+void lmQueueGeometry(lm_context *ctx,
+	const float *transformationMatrix,
+	lm_type positionsType, const void *positionsXYZ, int positionsStride,
+	lm_type normalsType, const void *normalsXYZ, int normalsStride,
+	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
+	int count, lm_type indicesType, const void *indices)
+{
+	lm_prepared_geometry *geometry = lmPrepareGeometry(ctx, transformationMatrix,
+		positionsType, positionsXYZ, positionsStride,
+		normalsType, normalsXYZ, normalsStride,
+		lightmapCoordsType, lightmapCoordsUV, lightmapCoordsStride,
+		count, indicesType, indices);
+	assert(geometry); // the allocate function failed
+	lm_queuePreparedGeometry(ctx, geometry, geometry);
+}
+
+// starts baking the queued meshes with the first lmBegin (or lmBeginBatch) call
+static void lm_beginQueue(lm_context *ctx)
+{
+	if (!ctx->queue.count || ctx->queue.baking)
+		return;
+#ifdef LM_DEBUG_INTERPOLATION
+	if (lm_isQueueTarget(ctx))
+		lm_keepDebugTarget(ctx); // stays owned by the context
+#endif
+	ctx->queue.lightmap = ctx->lightmap;
+	ctx->queue.baking = LM_TRUE;
+	ctx->queue.finished = 0;
+	ctx->queue.current = 0;
+	ctx->queue.progress = 0.0;
+	for (unsigned int i = 1; i < ctx->queue.count; i++)
+		ctx->queue.progress += ctx->queue.meshes[i].progress;
+	lm_loadQueuedMesh(ctx, ctx->queue.meshes);
+}
+
+// moves to the next hemisphere to sample in the current pass of the current mesh if the current one is finished.
+// returns false if there are no sample positions left in the current pass.
+static lm_bool lm_findNextMeshHemisphere(lm_context *ctx)
+{
+	while (ctx->meshPosition.hemisphere.side >= 5)
+	{ // as long as there are no hemisphere sides to render...
+		if (ctx->adaptive.enabled)
+		{ // the samples of the current round were already selected
+			if (ctx->meshPosition.sampleIndex >= ctx->adaptive.selectionCount)
+				return LM_FALSE; // the round is done
+			lm_setSampleCamera(ctx, ctx->adaptive.selection[ctx->meshPosition.sampleIndex++]);
+			ctx->meshPosition.hemisphere.side = 0;
+			continue;
+		}
+
+		if (ctx->meshPosition.sampleIndex >= ctx->mesh.geometry->count)
+			return LM_FALSE; // no samples left: the pass is done
+
+		// try the next prepared sample. it may belong to another pass or be interpolated.
+		if (lm_trySamplingPreparedTexel(ctx, ctx->meshPosition.sampleIndex))
+			ctx->meshPosition.hemisphere.side = 0; // start sampling a hemisphere there
+		ctx->meshPosition.sampleIndex++;
+	}
+	return LM_TRUE;
+}
+
+// same as lm_findNextMeshHemisphere, but continues with the next queued meshes while baking a queue.
+// returns false if the current pass of all queued meshes is done.
+static lm_bool lm_findNextHemisphere(lm_context *ctx)
+{
+	while (!lm_findNextMeshHemisphere(ctx))
+	{
+		if (!ctx->queue.baking || ctx->queue.current + 1 >= ctx->queue.count)
+			return LM_FALSE;
+		lm_selectQueuedMesh(ctx, ctx->queue.current + 1);
+	}
+	return LM_TRUE;
+}
+
+#ifdef LM_DEBUG_INTERPOLATION
+// saves the rendered (red) and interpolated (green) texels of a target lightmap and prints their statistics.
+// only the allocated tiles are expanded and counted: texels of empty tiles are neither used nor wasted.
+static void lm_writeDebugInterpolation(const lm_target_lightmap *lightmap, const char *filename)
+{
+	const lm_texel_tiles *debug = &lightmap->debug;
+	int w = lightmap->width, h = lightmap->height;
+	unsigned char *image = (unsigned char*)LM_CALLOC((size_t)w * h, 3);
+	int rendered = 0, interpolated = 0, wasted = 0;
+	for (int ty = 0; ty < debug->tilesY; ty++)
+	{
+		for (int tx = 0; tx < debug->tilesX; tx++)
+		{
+			const lm_texel_value *tile = debug->tiles[(size_t)ty * debug->tilesX + tx];
+			if (!tile)
+				continue;
+			for (int y = ty * LM_TILE_SIZE; y < lm_mini((ty + 1) * LM_TILE_SIZE, h); y++)
+			{
+				for (int x = tx * LM_TILE_SIZE; x < lm_mini((tx + 1) * LM_TILE_SIZE, w); x++)
+				{
+					unsigned int flags = tile[(y % LM_TILE_SIZE) * LM_TILE_SIZE + x % LM_TILE_SIZE].u;
+					unsigned char *pixel = image + ((size_t)y * w + x) * 3;
+					pixel[0] = (flags & LM_DEBUG_RENDERED) ? 255 : 0;
+					pixel[1] = (flags & LM_DEBUG_INTERPOLATED) ? 255 : 0;
+					if (flags & LM_DEBUG_RENDERED)
+						rendered++;
+					else if (flags & LM_DEBUG_INTERPOLATED)
+						interpolated++;
+					else
+						wasted++;
+				}
+			}
+		}
+	}
+	lmImageSaveTGAub(filename, image, w, h, 3);
+	LM_FREE(image);
+
+	// lightmap texel statistics
+	int used = rendered + interpolated;
+	int total = used + wasted;
+	printf("\n#######################################################################\n");
+	printf("%10d %6.2f%% rendered hemicubes integrated to lightmap texels.\n", rendered, 100.0f * (float)rendered / (float)total);
+	printf("%10d %6.2f%% interpolated lightmap texels.\n", interpolated, 100.0f * (float)interpolated / (float)total);
+	printf("%10d %6.2f%% wasted lightmap texels.\n", wasted, 100.0f * (float)wasted / (float)total);
+	printf("\n%17.2f%% of used texels were rendered.\n", 100.0f * (float)rendered / (float)used);
+	printf("#######################################################################\n");
+}
+#endif
+
+// moves the current mesh on to its next pass (or adaptive sampling round) once all results of the current one arrived.
+// returns false if this was the last pass.
+static lm_bool lm_finishMeshPass(lm_context *ctx)
+{
+	ctx->meshPosition.sampleIndex = 0; // start over with the next pass
+	lm_bool last;
+	if (ctx->irradianceCache.enabled)
+		last = !lm_scheduleCacheRound(ctx);
+	else if (ctx->adaptive.enabled)
+		last = !lm_scheduleAdaptiveRound(ctx);
+	else
+		last = ++ctx->meshPosition.pass == ctx->meshPosition.passCount;
+	if (last)
+	{
+		// pass == passCount is the end condition (in case someone accidentally calls lmBegin again)
+		ctx->meshPosition.pass = ctx->meshPosition.passCount;
 
-	// free memory
-	LM_FREE(ctx->hemisphere.storage.toLightmapLocation);
-	LM_FREE(ctx->hemisphere.fbHemiToLightmapLocation);
 #ifdef LM_DEBUG_INTERPOLATION
-	LM_FREE(ctx->lightmap.debug);
+		if (!ctx->queue.baking) // a queue is saved once all of its meshes are done
+			lm_writeDebugInterpolation(&ctx->lightmap, "debug_interpolation.tga");
 #endif
-	LM_FREE(ctx);
+
+		return LM_FALSE;
+	}
+
+	return LM_TRUE;
 }
 
-void lmSetHemisphereWeights(lm_context *ctx, lm_weight_func f, void *userdata)
+// integrates the remaining hemispheres of the current pass (or adaptive sampling round) and moves on to the next one.
+// returns false if this was the last pass.
+static lm_bool lm_finishPass(lm_context *ctx)
 {
-	// hemisphere weights texture. bakes in material dependent attenuation behaviour.
-	float *weights = (float*)LM_CALLOC(2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size, sizeof(float));
-	float center = (ctx->hemisphere.size - 1) * 0.5f;
-	double sum = 0.0;
-	for (unsigned int y = 0; y < ctx->hemisphere.size; y++)
+	lm_integrateHemisphereBatch(ctx); // integrate and read back last batch
+	lm_processReadbacks(ctx, LM_TRUE); // wait for all batch results and write them to the lightmap
+	if (!ctx->queue.baking)
+		return lm_finishMeshPass(ctx);
+
+	// the pass of all queued meshes is done: move each of them on and drop the finished ones
+	lm_storeQueuedMesh(ctx, ctx->queue.meshes + ctx->queue.current);
+	unsigned int count = 0;
+	ctx->queue.progress = 0.0;
+	for (unsigned int i = 0; i < ctx->queue.count; i++)
 	{
-		float dy = 2.0f * (y - center) / (float)ctx->hemisphere.size;
-		for (unsigned int x = 0; x < ctx->hemisphere.size; x++)
+		lm_loadQueuedMesh(ctx, ctx->queue.meshes + i);
+		if (lm_finishMeshPass(ctx))
 		{
-			float dx = 2.0f * (x - center) / (float)ctx->hemisphere.size;
-			lm_vec3 v = lm_normalize3(lm_v3(dx, dy, 1.0f));
-
-			float solidAngle = v.z * v.z * v.z;
+			lm_storeQueuedMesh(ctx, ctx->queue.meshes + count);
+			ctx->queue.progress += ctx->queue.meshes[count++].progress;
+		}
+		else
+		{
+			lm_freeMeshState(ctx);
+			ctx->queue.finished++;
+		}
+	}
+	ctx->queue.count = count;
+	if (!count)
+	{
+#ifdef LM_DEBUG_INTERPOLATION
+		for (unsigned int i = 0; i < ctx->queue.debugTargetCount; i++)
+		{
+			char filename[40] = "debug_interpolation.tga";
+			if (ctx->queue.debugTargetCount > 1)
+				sprintf(filename, "debug_interpolation%u.tga", i);
+			lm_writeDebugInterpolation(ctx->queue.debugTargets + i, filename);
+		}
+#endif
+		lm_clearQueue(ctx);
+		return LM_FALSE;
+	}
+	ctx->queue.current = 0;
+	lm_loadQueuedMesh(ctx, ctx->queue.meshes);
+	ctx->queue.progress -= ctx->queue.meshes[0].progress;
+	return LM_TRUE;
+}
 
-			float *w0 = weights + 2 * (y * (3 * ctx->hemisphere.size) + x);
-			float *w1 = w0 + 2 * ctx->hemisphere.size;
-			float *w2 = w1 + 2 * ctx->hemisphere.size;
+lm_bool lmBegin(lm_context *ctx, int* outViewport4, float* outView4x4, float* outProjection4x4)
+{
+	lm_beginQueue(ctx);
+	assert(ctx->meshPosition.pass < ctx->meshPosition.passCount);
+	while (!lm_findNextHemisphere(ctx))
+	{ // as long as there are no hemispheres left to sample in the current pass...
+		if (!lm_finishPass(ctx))
+			return LM_FALSE;
+	}
+	return lm_beginSampleHemisphere(ctx, outViewport4, outView4x4, outProjection4x4);
+}
 
-			// center weights
-			w0[0] = solidAngle * f(v.z, userdata);
-			w0[1] = solidAngle;
+lm_bool lmBeginHemisphere(lm_context *ctx, float* outViewports5x4, float* outViews5x4x4, float* outProjections5x4x4)
+{
+	int viewport[4];
+	if (!lmBegin(ctx, viewport, outViews5x4x4, outProjections5x4x4)) // prepares the hemisphere and its first side
+		return LM_FALSE;
+	assert(ctx->meshPosition.hemisphere.side == 0); // lmBegin was used to render some of the hemisphere sides?
 
-			// left/right side weights
-			w1[0] = solidAngle * f(lm_absf(v.x), userdata);
-			w1[1] = solidAngle;
+	for (int side = 0; side < 5; side++)
+	{
+		if (side > 0)
+			lm_getHemisphereSideView(ctx, side, viewport, outViews5x4x4 + side * 16, outProjections5x4x4 + side * 16);
+		for (int i = 0; i < 4; i++)
+			outViewports5x4[side * 4 + i] = (float)viewport[i];
+	}
 
-			// up/down side weights
-			w2[0] = solidAngle * f(lm_absf(v.y), userdata);
-			w2[1] = solidAngle;
+	ctx->meshPosition.hemisphere.side = 4; // lmEnd finishes the whole hemisphere
+	return LM_TRUE;
+}
 
-			sum += 3.0 * (double)solidAngle;
-		}
+static void lm_calculateBatchBounds(lm_context *ctx)
+{
+	const lm_vec3 *positions = ctx->hemisphere.batch.positions;
+	const lm_vec3 *directions = ctx->hemisphere.batch.directions;
+	unsigned int count = ctx->hemisphere.fbHemiIndex;
+
+	// sphere around the center of the bounding box
+	lm_vec3 bbMin = lm_v3(FLT_MAX, FLT_MAX, FLT_MAX), bbMax = lm_v3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	lm_vec3 axis = lm_v3(0.0f, 0.0f, 0.0f);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		bbMin = lm_min3(bbMin, positions[i]);
+		bbMax = lm_max3(bbMax, positions[i]);
+		axis = lm_add3(axis, directions[i]);
 	}
+	lm_vec3 center = lm_scale3(lm_add3(bbMin, bbMax), 0.5f);
+	float radiusSq = 0.0f;
+	for (unsigned int i = 0; i < count; i++)
+		radiusSq = lm_maxf(radiusSq, lm_length3sq(lm_sub3(positions[i], center)));
+
+	// cone around the average direction
+	float cosHalfAngle = -1.0f;
+	if (lm_length3sq(axis) > 0.000001f)
+	{
+		axis = lm_normalize3(axis);
+		cosHalfAngle = 1.0f;
+		for (unsigned int i = 0; i < count; i++)
+			cosHalfAngle = lm_minf(cosHalfAngle, lm_dot3(axis, directions[i]));
+	}
+	else
+		axis = lm_v3(0.0f, 0.0f, 1.0f);
 
-	// normalize weights
-	float weightScale = (float)(1.0 / sum);
-	for (unsigned int i = 0; i < 2 * 3 * ctx->hemisphere.size * ctx->hemisphere.size; i++)
-		weights[i] *= weightScale;
-
-	// upload weight texture
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.firstPass.weightsTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, 3 * ctx->hemisphere.size, ctx->hemisphere.size, 0, GL_RG, GL_FLOAT, weights);
-	LM_FREE(weights);
+	float *sphere = ctx->hemisphere.batch.sphere;
+	float *cone = ctx->hemisphere.batch.cone;
+	sphere[0] = center.x; sphere[1] = center.y; sphere[2] = center.z; sphere[3] = sqrtf(radiusSq);
+	cone[0] = axis.x; cone[1] = axis.y; cone[2] = axis.z; cone[3] = lm_maxf(cosHalfAngle, -1.0f);
 }
 
-void lmSetTargetLightmap(lm_context *ctx, float *outLightmap, int w, int h, int c)
+int lmBeginBatch(lm_context *ctx, int* outViewport4, unsigned int* outCamerasBuffer)
 {
-	ctx->lightmap.data = outLightmap;
-	ctx->lightmap.width = w;
-	ctx->lightmap.height = h;
-	ctx->lightmap.channels = c;
+	lm_beginQueue(ctx);
+	assert(ctx->meshPosition.pass < ctx->meshPosition.passCount);
+	assert(ctx->meshPosition.hemisphere.side == 0 || ctx->meshPosition.hemisphere.side == 5); // lmBegin was used to render some of the hemisphere sides?
+	assert(ctx->hemisphere.fbHemiIndex == 0); // lmBegin and lmBeginBatch can't be mixed within one batch
+
+	unsigned int capacity = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.fbHemiCountY;
+	int w = ctx->hemisphere.fbHemiCountX * ctx->hemisphere.size * 3;
+	int h = ctx->hemisphere.fbHemiCountY * ctx->hemisphere.size;
+	if (!ctx->hemisphere.batch.camerasBuffer)
+	{
+		ctx->hemisphere.batch.cameras = (float*)lm_allocate(ctx->allocator, capacity * 5 * 36, sizeof(float));
+		ctx->hemisphere.batch.positions = (lm_vec3*)lm_allocate(ctx->allocator, capacity, sizeof(lm_vec3));
+		ctx->hemisphere.batch.directions = (lm_vec3*)lm_allocate(ctx->allocator, capacity, sizeof(lm_vec3));
+		glGenBuffers(1, &ctx->hemisphere.batch.camerasBuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, ctx->hemisphere.batch.camerasBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, capacity * 5 * 36 * sizeof(float), 0, GL_STREAM_DRAW);
+		ctx->statistics.glAllocations++;
+	}
 
-	// allocate storage texture
-	if (!ctx->hemisphere.storage.texture)
-		glGenTextures(1, &ctx->hemisphere.storage.texture);
-	glBindTexture(GL_TEXTURE_2D, ctx->hemisphere.storage.texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, 0);
+	while (!lm_findNextHemisphere(ctx))
+	{ // as long as there are no hemispheres left to sample in the current pass...
+		if (!lm_finishPass(ctx))
+			return 0;
+	}
 
-	// allocate storage position to lightmap position map
-	if (ctx->hemisphere.storage.toLightmapLocation)
-		LM_FREE(ctx->hemisphere.storage.toLightmapLocation);
-	ctx->hemisphere.storage.toLightmapLocation = (lm_ivec2*)LM_CALLOC(w * h, sizeof(lm_ivec2));
-	// invalidate all positions
-	for (int i = 0; i < w * h; i++)
-		ctx->hemisphere.storage.toLightmapLocation[i].x = -1;
+	// gather hemispheres until the batch is full or the pass is done.
+	// the next pass depends on the results of this one, so a batch never spans two passes (or adaptive sampling rounds),
+	// but it continues with the same pass of the next queued meshes.
+	do
+	{
+		float *camera = ctx->hemisphere.batch.cameras + ctx->hemisphere.fbHemiIndex * 5 * 36;
+		for (int side = 0; side < 5; side++, camera += 36)
+		{
+			int viewport[4];
+			ctx->meshPosition.hemisphere.side = side;
+			lm_beginSampleHemisphere(ctx, viewport, camera, camera + 16);
+
+			// map the side's clip space to its viewport in the whole batch framebuffer
+			float sx = (float)viewport[2] / (float)w, ox = (float)(2 * viewport[0] + viewport[2]) / (float)w - 1.0f;
+			float sy = (float)viewport[3] / (float)h, oy = (float)(2 * viewport[1] + viewport[3]) / (float)h - 1.0f;
+			float *proj = camera + 16;
+			for (int column = 0; column < 4; column++)
+			{
+				proj[column * 4 + 0] = sx * proj[column * 4 + 0] + ox * proj[column * 4 + 3];
+				proj[column * 4 + 1] = sy * proj[column * 4 + 1] + oy * proj[column * 4 + 3];
+			}
 
-#ifdef LM_DEBUG_INTERPOLATION
-	if (ctx->lightmap.debug)
-		LM_FREE(ctx->lightmap.debug);
-	ctx->lightmap.debug = (unsigned char*)LM_CALLOC(ctx->lightmap.width * ctx->lightmap.height, 3);
-#endif
+			// clip rectangle of the side in normalized device coordinates
+			camera[32] = (float)(2 * viewport[0]) / (float)w - 1.0f;
+			camera[33] = (float)(2 * viewport[1]) / (float)h - 1.0f;
+			camera[34] = (float)(2 * (viewport[0] + viewport[2])) / (float)w - 1.0f;
+			camera[35] = (float)(2 * (viewport[1] + viewport[3])) / (float)h - 1.0f;
+		}
+		ctx->meshPosition.hemisphere.side = 5;
+		ctx->hemisphere.batch.positions[ctx->hemisphere.fbHemiIndex] = ctx->meshPosition.sample.position;
+		ctx->hemisphere.batch.directions[ctx->hemisphere.fbHemiIndex] = ctx->meshPosition.sample.direction;
+	} while (++ctx->hemisphere.fbHemiIndex < capacity && lm_findNextHemisphere(ctx));
+
+	lm_calculateBatchBounds(ctx);
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, ctx->hemisphere.batch.camerasBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, 0, ctx->hemisphere.fbHemiIndex * 5 * 36 * sizeof(float), ctx->hemisphere.batch.cameras);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	outViewport4[0] = 0;
+	outViewport4[1] = 0;
+	outViewport4[2] = w;
+	outViewport4[3] = h;
+	*outCamerasBuffer = ctx->hemisphere.batch.camerasBuffer;
+	return (int)ctx->hemisphere.fbHemiIndex;
 }
 
-void lmSetGeometry(lm_context *ctx,
-	const float *transformationMatrix,
-	lm_type positionsType, const void *positionsXYZ, int positionsStride,
-	lm_type normalsType, const void *normalsXYZ, int normalsStride,
-	lm_type lightmapCoordsType, const void *lightmapCoordsUV, int lightmapCoordsStride,
-	int count, lm_type indicesType, const void *indices)
+void lmEndBatch(lm_context *ctx)
 {
-	ctx->mesh.modelMatrix = transformationMatrix;
-	ctx->mesh.positions = (const unsigned char*)positionsXYZ;
-	ctx->mesh.positionsType = positionsType;
-	ctx->mesh.positionsStride = positionsStride == 0 ? sizeof(lm_vec3) : positionsStride;
-	ctx->mesh.normals = (const unsigned char*)normalsXYZ;
-	ctx->mesh.normalsType = normalsType;
-	ctx->mesh.normalsStride = normalsStride == 0 ? sizeof(lm_vec3) : normalsStride;
-	ctx->mesh.uvs = (const unsigned char*)lightmapCoordsUV;
-	ctx->mesh.uvsType = lightmapCoordsType;
-	ctx->mesh.uvsStride = lightmapCoordsStride == 0 ? sizeof(lm_vec2) : lightmapCoordsStride;
-	ctx->mesh.indicesType = indicesType;
-	ctx->mesh.indices = (const unsigned char*)indices;
-	ctx->mesh.count = count;
-
-	lm_inverseTranspose(transformationMatrix, ctx->mesh.normalMatrix);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	lm_integrateHemisphereBatch(ctx);
+}
 
-	ctx->meshPosition.pass = 0;
-	lm_setMeshPosition(ctx, 0);
+void lmGetBatchBounds(lm_context *ctx, float* outSphere4, float* outNormalCone4)
+{
+	assert(ctx->hemisphere.fbHemiIndex > 0); // only valid between lmBeginBatch and lmEndBatch
+	for (int i = 0; i < 4; i++)
+	{
+		outSphere4[i] = ctx->hemisphere.batch.sphere[i];
+		outNormalCone4[i] = ctx->hemisphere.batch.cone[i];
+	}
 }
 
-lm_bool lmBegin(lm_context *ctx, int* outViewport4, float* outView4x4, float* outProjection4x4)
+float lmProgress(lm_context *ctx)
 {
-	assert(ctx->meshPosition.triangle.baseIndex < ctx->mesh.count);
-	while (!lm_beginSampleHemisphere(ctx, outViewport4, outView4x4, outProjection4x4))
-	{ // as long as there are no hemisphere sides to render...
-		// try moving to the next rasterizer position
-		if (lm_findNextConservativeTriangleRasterizerPosition(ctx))
-		{ // if we successfully moved to the next sample position on the current triangle...
-			ctx->meshPosition.hemisphere.side = 0; // start sampling a hemisphere there
-		}
-		else
-		{ // if there are no valid sample positions on the current triangle...
-			if (ctx->meshPosition.triangle.baseIndex + 3 < ctx->mesh.count)
-			{ // ...and there are triangles left: move to the next triangle and continue sampling.
-				lm_setMeshPosition(ctx, ctx->meshPosition.triangle.baseIndex + 3);
-			}
-			else
-			{ // ...and there are no triangles left: finish
-				lm_integrateHemisphereBatch(ctx); // integrate and store last batch
-				lm_writeResultsToLightmap(ctx); // read storage data from gpu memory and write it to the lightmap
+	if (ctx->queue.baking)
+	{ // the finished meshes, the other queued meshes as they were left and the current one
+		unsigned int total = ctx->queue.finished + ctx->queue.count;
+		return lm_minf((float)((ctx->queue.finished + ctx->queue.progress + lm_meshProgress(ctx)) / total), 1.0f);
+	}
+	return lm_meshProgress(ctx);
+}
 
-				if (++ctx->meshPosition.pass == ctx->meshPosition.passCount)
-				{
-					ctx->meshPosition.pass = 0;
-					ctx->meshPosition.triangle.baseIndex = ctx->mesh.count; // set end condition (in case someone accidentally calls lmBegin again)
+void lmEnd(lm_context *ctx)
+{
+	lm_endSampleHemisphere(ctx);
+}
 
-#ifdef LM_DEBUG_INTERPOLATION
-					lmImageSaveTGAub("debug_interpolation.tga", ctx->lightmap.debug, ctx->lightmap.width, ctx->lightmap.height, 3);
+void lmGetStatistics(lm_context *ctx, lm_statistics *outStatistics)
+{
+	*outStatistics = ctx->statistics;
+	lm_lock(&ctx->allocator->mutex);
+	outStatistics->heapAllocations = ctx->allocator->heapAllocations;
+	outStatistics->pooledAllocations = ctx->allocator->pooledAllocations;
+	outStatistics->pooledBytes = ctx->allocator->pooledBytes;
+	lm_unlock(&ctx->allocator->mutex);
+}
 
-					// lightmap texel statistics
-					int rendered = 0, interpolated = 0, wasted = 0;
-					for (int y = 0; y < ctx->lightmap.height; y++)
-					{
-						for (int x = 0; x < ctx->lightmap.width; x++)
-						{
-							if (ctx->lightmap.debug[(y * ctx->lightmap.width + x) * 3 + 0])
-								rendered++;
-							else if (ctx->lightmap.debug[(y * ctx->lightmap.width + x) * 3 + 1])
-								interpolated++;
-							else
-								wasted++;
-						}
-					}
-					int used = rendered + interpolated;
-					int total = used + wasted;
-					printf("\n#######################################################################\n");
-					printf("%10d %6.2f%% rendered hemicubes integrated to lightmap texels.\n", rendered, 100.0f * (float)rendered / (float)total);
-					printf("%10d %6.2f%% interpolated lightmap texels.\n", interpolated, 100.0f * (float)interpolated / (float)total);
-					printf("%10d %6.2f%% wasted lightmap texels.\n", wasted, 100.0f * (float)wasted / (float)total);
-					printf("\n%17.2f%% of used texels were rendered.\n", 100.0f * (float)rendered / (float)used);
-					printf("#######################################################################\n");
+// image processing helpers: the image is split into jobs of whole rows (or of channel aligned runs of floats)
+// that are processed by up to lm_processorCount() threads and vectorized where the SIMD registers fit the layout.
+// the results are identical to processing the whole image sequentially on a single thread
+// (lmImageMin/lmImageMax can only differ in the sign of a zero result).
+#if defined(LM_SSE2)
+#define LM_SIMD4
+typedef __m128 lm_f4;
+typedef __m128 lm_m4;
+static inline lm_f4   lm_load4       (const float *p            ) { return _mm_loadu_ps(p); }
+static inline void    lm_store4      (float *p, lm_f4 a         ) { _mm_storeu_ps(p, a); }
+static inline lm_f4   lm_set4        (float a                   ) { return _mm_set1_ps(a); }
+static inline lm_f4   lm_add4        (lm_f4 a, lm_f4 b          ) { return _mm_add_ps(a, b); }
+static inline lm_f4   lm_sub4        (lm_f4 a, lm_f4 b          ) { return _mm_sub_ps(a, b); }
+static inline lm_f4   lm_mul4        (lm_f4 a, lm_f4 b          ) { return _mm_mul_ps(a, b); }
+static inline lm_f4   lm_div4        (lm_f4 a, lm_f4 b          ) { return _mm_div_ps(a, b); }
+static inline lm_f4   lm_min4        (lm_f4 a, lm_f4 b          ) { return _mm_min_ps(a, b); } // a < b ? a : b (like lm_minf)
+static inline lm_f4   lm_max4        (lm_f4 a, lm_f4 b          ) { return _mm_max_ps(a, b); } // a > b ? a : b (like lm_maxf)
+static inline lm_m4   lm_less4       (lm_f4 a, lm_f4 b          ) { return _mm_cmplt_ps(a, b); }
+static inline lm_f4   lm_select4     (lm_m4 m, lm_f4 a, lm_f4 b ) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+static inline lm_m4   lm_lanes4      (int bits                  ) { return _mm_castsi128_ps(_mm_set_epi32(bits & 8 ? -1 : 0, bits & 4 ? -1 : 0, bits & 2 ? -1 : 0, bits & 1 ? -1 : 0)); }
+static inline lm_bool lm_anyPositive4(lm_f4 a                   ) { return _mm_movemask_ps(_mm_cmpgt_ps(a, _mm_setzero_ps())) != 0; }
+static inline lm_bool lm_anyNonZero4 (lm_f4 a                   ) { return _mm_movemask_ps(_mm_cmpneq_ps(a, _mm_setzero_ps())) != 0; }
+static inline float   lm_sum4        (lm_f4 a                   ) { __m128 s = _mm_add_ps(a, _mm_movehl_ps(a, a)); return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1))); }
+static inline lm_f4   lm_trunc4      (lm_f4 a, lm_f4 *outPow2   ) { __m128i n = _mm_cvttps_epi32(a); *outPow2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23)); return _mm_cvtepi32_ps(n); }
+#elif defined(LM_NEON)
+#define LM_SIMD4
+typedef float32x4_t lm_f4;
+typedef uint32x4_t  lm_m4;
+static inline lm_bool lm_any4        (lm_m4 m                   ) { uint32x2_t t = vorr_u32(vget_low_u32(m), vget_high_u32(m)); return (vget_lane_u32(t, 0) | vget_lane_u32(t, 1)) != 0; }
+static inline lm_f4   lm_load4       (const float *p            ) { return vld1q_f32(p); }
+static inline void    lm_store4      (float *p, lm_f4 a         ) { vst1q_f32(p, a); }
+static inline lm_f4   lm_set4        (float a                   ) { return vdupq_n_f32(a); }
+static inline lm_f4   lm_add4        (lm_f4 a, lm_f4 b          ) { return vaddq_f32(a, b); }
+static inline lm_f4   lm_sub4        (lm_f4 a, lm_f4 b          ) { return vsubq_f32(a, b); }
+static inline lm_f4   lm_mul4        (lm_f4 a, lm_f4 b          ) { return vmulq_f32(a, b); }
+#if defined(__aarch64__) || defined(_M_ARM64)
+static inline lm_f4   lm_div4        (lm_f4 a, lm_f4 b          ) { return vdivq_f32(a, b); }
+#else
+static inline lm_f4   lm_div4        (lm_f4 a, lm_f4 b          ) { float fa[4], fb[4]; vst1q_f32(fa, a); vst1q_f32(fb, b); for (int i = 0; i < 4; i++) fa[i] /= fb[i]; return vld1q_f32(fa); }
+#endif
+static inline lm_f4   lm_min4        (lm_f4 a, lm_f4 b          ) { return vbslq_f32(vcltq_f32(a, b), a, b); } // a < b ? a : b (like lm_minf)
+static inline lm_f4   lm_max4        (lm_f4 a, lm_f4 b          ) { return vbslq_f32(vcgtq_f32(a, b), a, b); } // a > b ? a : b (like lm_maxf)
+static inline lm_m4   lm_less4       (lm_f4 a, lm_f4 b          ) { return vcltq_f32(a, b); }
+static inline lm_f4   lm_select4     (lm_m4 m, lm_f4 a, lm_f4 b ) { return vbslq_f32(m, a, b); }
+static inline lm_m4   lm_lanes4      (int bits                  ) { uint32_t l[4] = { bits & 1 ? ~0u : 0u, bits & 2 ? ~0u : 0u, bits & 4 ? ~0u : 0u, bits & 8 ? ~0u : 0u }; return vld1q_u32(l); }
+static inline lm_bool lm_anyPositive4(lm_f4 a                   ) { return lm_any4(vcgtq_f32(a, vdupq_n_f32(0.0f))); }
+static inline lm_bool lm_anyNonZero4 (lm_f4 a                   ) { return lm_any4(vmvnq_u32(vceqq_f32(a, vdupq_n_f32(0.0f)))); }
+static inline float   lm_sum4        (lm_f4 a                   ) { float32x2_t s = vadd_f32(vget_low_f32(a), vget_high_f32(a)); return vget_lane_f32(vpadd_f32(s, s), 0); }
+static inline lm_f4   lm_trunc4      (lm_f4 a, lm_f4 *outPow2   ) { int32x4_t n = vcvtq_s32_f32(a); *outPow2 = vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23)); return vcvtq_f32_s32(n); }
 #endif
 
-					return LM_FALSE;
-				}
+#if defined(LM_SIMD4)
+// approximate exp(-x) for x >= 0 (relative error < 2e-5). 2^-(n + f) = 2^-n * exp(-f * ln(2)), n = trunc(x * log2(e))
+static inline lm_f4 lm_expNeg4(lm_f4 x)
+{
+	lm_f4 pow2, t = lm_mul4(lm_min4(x, lm_set4(87.0f)), lm_set4(-1.44269504f));
+	lm_f4 y = lm_mul4(lm_sub4(t, lm_trunc4(t, &pow2)), lm_set4(0.693147181f)); // -ln(2) < y <= 0
+	lm_f4 p = lm_add4(lm_set4(1.0f / 120.0f), lm_mul4(y, lm_set4(1.0f / 720.0f)));
+	p = lm_add4(lm_set4(1.0f / 24.0f), lm_mul4(y, p));
+	p = lm_add4(lm_set4(1.0f / 6.0f), lm_mul4(y, p));
+	p = lm_add4(lm_set4(1.0f / 2.0f), lm_mul4(y, p));
+	p = lm_add4(lm_set4(1.0f), lm_mul4(y, p));
+	p = lm_add4(lm_set4(1.0f), lm_mul4(y, p));
+	return lm_mul4(p, pow2);
+}
+#endif
 
-				lm_setMeshPosition(ctx, 0); // start over with the next pass
-			}
-		}
+#define LM_IMAGE_JOB_FLOATS (1 << 18) // minimum amount of floats that an image job should touch to be worth a thread
+
+typedef struct lm_image_job
+{
+	const float *image;
+	float *outImage;
+	unsigned char *outImageUB;
+	int w, h, c, m;
+	float value;
+	size_t first, end; // range of rows, columns or floats
+	float result;
+	const void *userdata; // kernel specific data shared by all jobs
+} lm_image_job;
+
+// a job over a w x h image with c channels. all other fields are zero.
+static lm_image_job lm_imageJob(const float *image, float *outImage, int w, int h, int c)
+{
+	lm_image_job job;
+	memset(&job, 0, sizeof(job));
+	job.image = image;
+	job.outImage = outImage;
+	job.w = w;
+	job.h = h;
+	job.c = c;
+	return job;
+}
+
+// jobs[0] is the template for all jobs. splits [0..count) into ranges that start at multiples of granularity.
+static int lm_runImageJobs(lm_job_func run, lm_image_job *jobs, size_t count, size_t granularity, size_t floatsPerUnit)
+{
+	size_t units = (count + granularity - 1) / granularity;
+	size_t maxJobs = count * floatsPerUnit / LM_IMAGE_JOB_FLOATS;
+	int jobCount = 1;
+	if (maxJobs > 1 && units > 1)
+	{
+		jobCount = lm_mini(lm_processorCount(), LM_MAX_THREADS);
+		if ((size_t)jobCount > maxJobs) jobCount = (int)maxJobs;
+		if ((size_t)jobCount > units) jobCount = (int)units;
 	}
-	return LM_TRUE;
+	for (int i = 0; i < jobCount; i++)
+	{
+		jobs[i] = jobs[0];
+		jobs[i].first = units *  i      / jobCount * granularity;
+		jobs[i].end   = units * (i + 1) / jobCount * granularity;
+		if (jobs[i].end > count) jobs[i].end = count;
+	}
+	lm_runJobs(run, jobs, sizeof(lm_image_job), jobCount);
+	return jobCount;
 }
 
-float lmProgress(lm_context *ctx)
+#if defined(LM_SIMD4)
+// channel masks of the c consecutive float4 vectors starting at a multiple of 4 * c floats (c <= 4)
+static void lm_imageChannelMasks(int c, int m, lm_m4 *masks)
 {
-	float passProgress = (float)ctx->meshPosition.triangle.baseIndex / (float)ctx->mesh.count;
-	return ((float)ctx->meshPosition.pass + passProgress) / (float)ctx->meshPosition.passCount;
+	for (int j = 0; j < c; j++)
+	{
+		int bits = 0;
+		for (int k = 0; k < 4; k++)
+			if (m & (1 << ((j * 4 + k) % c)))
+				bits |= 1 << k;
+		masks[j] = lm_lanes4(bits);
+	}
 }
+#endif
 
-void lmEnd(lm_context *ctx)
+static void lm_imageMinJob(void *data)
 {
-	lm_endSampleHemisphere(ctx);
+	lm_image_job *job = (lm_image_job*)data;
+	const float *image = job->image;
+	int c = job->c, m = job->m;
+	float minValue = FLT_MAX;
+	size_t i = job->first;
+#if defined(LM_SIMD4)
+	if (c <= 4)
+	{
+		lm_m4 masks[4];
+		lm_imageChannelMasks(c, m, masks);
+		lm_f4 minValues = lm_set4(FLT_MAX);
+		for (int j = 0; i + 4 <= job->end; i += 4, j = j + 1 < c ? j + 1 : 0)
+			minValues = lm_select4(masks[j], lm_min4(minValues, lm_load4(image + i)), minValues);
+		float lanes[4];
+		lm_store4(lanes, minValues);
+		for (int k = 0; k < 4; k++)
+			minValue = lm_minf(minValue, lanes[k]);
+	}
+#endif
+	for (int j = (int)(i % c); i < job->end; i++, j = j + 1 < c ? j + 1 : 0)
+		if (m & (1 << j))
+			minValue = lm_minf(minValue, image[i]);
+	job->result = minValue;
 }
 
-// these are not performance tuned since their impact on the whole lightmapping duration is insignificant
 float lmImageMin(const float *image, int w, int h, int c, int m)
 {
 	assert(c > 0 && m);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, NULL, w, h, c);
+	jobs[0].m = m;
+	int jobCount = lm_runImageJobs(lm_imageMinJob, jobs, (size_t)w * h * c, 4 * c, 1);
 	float minValue = FLT_MAX;
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				minValue = lm_minf(minValue, image[i * c + j]);
+	for (int i = 0; i < jobCount; i++)
+		minValue = lm_minf(minValue, jobs[i].result);
 	return minValue;
 }
 
+static void lm_imageMaxJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	const float *image = job->image;
+	int c = job->c, m = job->m;
+	float maxValue = 0.0f;
+	size_t i = job->first;
+#if defined(LM_SIMD4)
+	if (c <= 4)
+	{
+		lm_m4 masks[4];
+		lm_imageChannelMasks(c, m, masks);
+		lm_f4 maxValues = lm_set4(0.0f);
+		for (int j = 0; i + 4 <= job->end; i += 4, j = j + 1 < c ? j + 1 : 0)
+			maxValues = lm_select4(masks[j], lm_max4(maxValues, lm_load4(image + i)), maxValues);
+		float lanes[4];
+		lm_store4(lanes, maxValues);
+		for (int k = 0; k < 4; k++)
+			maxValue = lm_maxf(maxValue, lanes[k]);
+	}
+#endif
+	for (int j = (int)(i % c); i < job->end; i++, j = j + 1 < c ? j + 1 : 0)
+		if (m & (1 << j))
+			maxValue = lm_maxf(maxValue, image[i]);
+	job->result = maxValue;
+}
+
 float lmImageMax(const float *image, int w, int h, int c, int m)
 {
 	assert(c > 0 && m);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, NULL, w, h, c);
+	jobs[0].m = m;
+	int jobCount = lm_runImageJobs(lm_imageMaxJob, jobs, (size_t)w * h * c, 4 * c, 1);
 	float maxValue = 0.0f;
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				maxValue = lm_maxf(maxValue, image[i * c + j]);
+	for (int i = 0; i < jobCount; i++)
+		maxValue = lm_maxf(maxValue, jobs[i].result);
 	return maxValue;
 }
 
+static void lm_imageAddJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	float *image = job->outImage;
+	int c = job->c, m = job->m;
+	size_t i = job->first;
+#if defined(LM_SIMD4)
+	if (c <= 4)
+	{
+		lm_m4 masks[4];
+		lm_imageChannelMasks(c, m, masks);
+		lm_f4 value = lm_set4(job->value);
+		for (int j = 0; i + 4 <= job->end; i += 4, j = j + 1 < c ? j + 1 : 0)
+		{
+			lm_f4 v = lm_load4(image + i);
+			lm_store4(image + i, lm_select4(masks[j], lm_add4(v, value), v));
+		}
+	}
+#endif
+	for (int j = (int)(i % c); i < job->end; i++, j = j + 1 < c ? j + 1 : 0)
+		if (m & (1 << j))
+			image[i] += job->value;
+}
+
 void lmImageAdd(float *image, int w, int h, int c, float value, int m)
 {
 	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] += value;
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, image, w, h, c);
+	jobs[0].m = m;
+	jobs[0].value = value;
+	lm_runImageJobs(lm_imageAddJob, jobs, (size_t)w * h * c, 4 * c, 1);
+}
+
+static void lm_imageScaleJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	float *image = job->outImage;
+	int c = job->c, m = job->m;
+	size_t i = job->first;
+#if defined(LM_SIMD4)
+	if (c <= 4)
+	{
+		lm_m4 masks[4];
+		lm_imageChannelMasks(c, m, masks);
+		lm_f4 factor = lm_set4(job->value);
+		for (int j = 0; i + 4 <= job->end; i += 4, j = j + 1 < c ? j + 1 : 0)
+		{
+			lm_f4 v = lm_load4(image + i);
+			lm_store4(image + i, lm_select4(masks[j], lm_mul4(v, factor), v));
+		}
+	}
+#endif
+	for (int j = (int)(i % c); i < job->end; i++, j = j + 1 < c ? j + 1 : 0)
+		if (m & (1 << j))
+			image[i] *= job->value;
+}
+
+void lmImageScale(float *image, int w, int h, int c, float factor, int m)
+{
+	assert(c > 0 && m);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, image, w, h, c);
+	jobs[0].m = m;
+	jobs[0].value = factor;
+	lm_runImageJobs(lm_imageScaleJob, jobs, (size_t)w * h * c, 4 * c, 1);
+}
+
+static void lm_imagePowerJob(void *data)
+{
+	// no vector powf to match, so this one is only split across threads
+	lm_image_job *job = (lm_image_job*)data;
+	float *image = job->outImage;
+	int c = job->c, m = job->m;
+	for (size_t i = job->first, j = i % c; i < job->end; i++, j = j + 1 < (size_t)c ? j + 1 : 0)
+		if (m & (1 << j))
+			image[i] = powf(image[i], job->value);
+}
+
+void lmImagePower(float *image, int w, int h, int c, float exponent, int m)
+{
+	assert(c > 0 && m);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, image, w, h, c);
+	jobs[0].m = m;
+	jobs[0].value = exponent;
+	lm_runImageJobs(lm_imagePowerJob, jobs, (size_t)w * h * c, c, 16); // powf is expensive
+}
+
+static inline lm_bool lm_isPixelPositive(const float *p, int c)
+{
+	lm_bool valid = LM_FALSE;
+	for (int i = 0; i < c; i++)
+		valid |= p[i] > 0.0f;
+	return valid;
+}
+
+static void lm_imageDilateJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	int w = job->w, h = job->h, c = job->c;
+	size_t stride = (size_t)w * c;
+	for (int y = (int)job->first; y < (int)job->end; y++)
+	{
+		const float *row = job->image + y * stride;
+		float *outRow = job->outImage + y * stride;
+#if defined(LM_SIMD4)
+		if (c == 4)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				const float *p = row + x * 4;
+				lm_f4 color = lm_load4(p);
+				if (!lm_anyPositive4(color))
+				{
+					// same neighbor order as the scalar version below
+					int n = 0;
+					lm_f4 d;
+					if (x > 0     && lm_anyPositive4(d = lm_load4(p - 4     ))) { color = lm_add4(color, d); n++; }
+					if (y + 1 < h && lm_anyPositive4(d = lm_load4(p + stride))) { color = lm_add4(color, d); n++; }
+					if (x + 1 < w && lm_anyPositive4(d = lm_load4(p + 4     ))) { color = lm_add4(color, d); n++; }
+					if (y > 0     && lm_anyPositive4(d = lm_load4(p - stride))) { color = lm_add4(color, d); n++; }
+					if (n)
+						color = lm_mul4(color, lm_set4(1.0f / n));
+				}
+				lm_store4(outRow + x * 4, color);
+			}
+			continue;
+		}
+#endif
+		for (int x = 0; x < w; x++)
+		{
+			const float *p = row + x * c;
+			float color[4];
+			for (int i = 0; i < c; i++)
+				color[i] = p[i];
+			if (!lm_isPixelPositive(p, c))
+			{
+				int n = 0;
+				const float *neighbors[4] = {
+					x > 0     ? p - c      : NULL,
+					y + 1 < h ? p + stride : NULL,
+					x + 1 < w ? p + c      : NULL,
+					y > 0     ? p - stride : NULL };
+				for (int d = 0; d < 4; d++)
+				{
+					if (neighbors[d] && lm_isPixelPositive(neighbors[d], c))
+					{
+						for (int i = 0; i < c; i++)
+							color[i] += neighbors[d][i];
+						n++;
+					}
+				}
+				if (n)
+				{
+					float in = 1.0f / n;
+					for (int i = 0; i < c; i++)
+						color[i] *= in;
+				}
+			}
+			for (int i = 0; i < c; i++)
+				outRow[x * c + i] = color[i];
+		}
+	}
 }
 
-void lmImageScale(float *image, int w, int h, int c, float factor, int m)
+void lmImageDilate(const float *image, float *outImage, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, outImage, w, h, c);
+	lm_runImageJobs(lm_imageDilateJob, jobs, (size_t)h, 1, (size_t)w * c);
+}
+
+// lmImageDilateN: exact euclidean feature transform (Felzenszwalb & Huttenlocher) in two separable passes.
+// the rows pass finds the nearest populated pixel of each pixel in its row, the columns pass combines them.
+static void lm_imageDilateNRowsJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	int w = job->w, c = job->c;
+	for (size_t y = job->first; y < job->end; y++)
+	{
+		const float *row = job->image + y * w * c;
+		int *nearest = (int*)job->userdata + y * w;
+		int last = -1;
+		for (int x = 0; x < w; x++)
+		{
+			if (lm_isPixelPositive(row + x * c, c))
+				last = x;
+			nearest[x] = last;
+		}
+		last = -1;
+		for (int x = w - 1; x >= 0; x--)
+		{
+			if (nearest[x] == x)
+				last = x;
+			else if (last >= 0 && (nearest[x] < 0 || last - x < x - nearest[x]))
+				nearest[x] = last;
+		}
+	}
+}
+
+#define LM_DILATE_COLUMN_BLOCK 32 // columns that are gathered and written together to keep the memory accesses row by row
+
+static void lm_imageDilateNColumnsJob(void *data)
 {
-	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] *= factor;
+	lm_image_job *job = (lm_image_job*)data;
+	int w = job->w, h = job->h, c = job->c;
+	int hs = h + 16; // padded column stride. power of two strides would map all columns of a block to the same cache sets
+	const int *nearest = (const int*)job->userdata; // nearest populated x in the same row
+	double maxDistanceSq = job->value < 0.0f ? DBL_MAX : (double)job->value * job->value;
+	int *nx = (int*)LM_CALLOC((size_t)hs * LM_DILATE_COLUMN_BLOCK, sizeof(int)); // nearest populated x per row for each column of the block
+	int *sources = (int*)LM_CALLOC((size_t)hs * LM_DILATE_COLUMN_BLOCK, sizeof(int)); // nearest populated row for each pixel of the block (or -1)
+	double *f = (double*)LM_CALLOC(h, sizeof(double)); // squared distances to the row sites
+	double *z = (double*)LM_CALLOC(h + 1, sizeof(double)); // lower envelope parabola boundaries
+	int *v = (int*)LM_CALLOC(h, sizeof(int)); // lower envelope parabola rows
+	for (int x0 = (int)job->first; x0 < (int)job->end; x0 += LM_DILATE_COLUMN_BLOCK)
+	{
+		int n = lm_mini(LM_DILATE_COLUMN_BLOCK, (int)job->end - x0);
+		for (int q = 0; q < h; q++)
+			for (int b = 0; b < n; b++)
+				nx[b * hs + q] = nearest[(size_t)q * w + x0 + b];
+
+		for (int b = 0; b < n; b++)
+		{
+			int x = x0 + b;
+			const int *columnNx = nx + b * hs;
+			int *columnSources = sources + b * hs;
+			int k = -1;
+			for (int q = 0; q < h; q++)
+			{
+				// the ends of a populated run are always closer than its interior
+				if (columnNx[q] < 0 || (columnNx[q] == x && q > 0 && q + 1 < h && columnNx[q - 1] == x && columnNx[q + 1] == x))
+					continue;
+				f[q] = (double)(x - columnNx[q]) * (x - columnNx[q]);
+				double s = 0.0;
+				while (k >= 0)
+				{
+					s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+					if (s > z[k])
+						break;
+					k--;
+				}
+				k++;
+				v[k] = q;
+				z[k] = k > 0 ? s : -DBL_MAX;
+				z[k + 1] = DBL_MAX;
+			}
+
+			for (int q = 0, j = 0; q < h; q++)
+			{
+				columnSources[q] = -1;
+				if (columnNx[q] == x)
+					columnSources[q] = q;
+				else if (k >= 0)
+				{
+					while (z[j + 1] < q)
+						j++;
+					if ((double)(q - v[j]) * (q - v[j]) + f[v[j]] <= maxDistanceSq)
+						columnSources[q] = v[j];
+				}
+			}
+		}
+
+		for (int q = 0; q < h; q++)
+		{
+			for (int b = 0; b < n; b++)
+			{
+				int sy = sources[b * hs + q];
+				size_t src = sy < 0 ? (size_t)q * w + x0 + b : (size_t)sy * w + nx[b * hs + sy];
+				float *dst = job->outImage + ((size_t)q * w + x0 + b) * c;
+				for (int i = 0; i < c; i++)
+					dst[i] = job->image[src * c + i];
+			}
+		}
+	}
+	LM_FREE(v);
+	LM_FREE(z);
+	LM_FREE(f);
+	LM_FREE(sources);
+	LM_FREE(nx);
 }
 
-void lmImagePower(float *image, int w, int h, int c, float exponent, int m)
+void lmImageDilateN(const float *image, float *outImage, int w, int h, int c, int radius)
 {
-	assert(c > 0 && m);
-	for (int i = 0; i < w * h; i++)
-		for (int j = 0; j < c; j++)
-			if (m & (1 << j))
-				image[i * c + j] = powf(image[i * c + j], exponent);
+	assert(c > 0 && c <= 4);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, outImage, w, h, c);
+	jobs[0].value = (float)radius;
+	int *nearest = (int*)LM_CALLOC((size_t)w * h, sizeof(int));
+	jobs[0].userdata = nearest;
+	lm_runImageJobs(lm_imageDilateNRowsJob, jobs, (size_t)h, 1, (size_t)w * c);
+	lm_runImageJobs(lm_imageDilateNColumnsJob, jobs, (size_t)w, LM_DILATE_COLUMN_BLOCK, (size_t)h * c * 4);
+	LM_FREE(nearest);
 }
 
-void lmImageDilate(const float *image, float *outImage, int w, int h, int c)
+static void lm_imageSmoothJob(void *data)
 {
-	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h; y++)
+	lm_image_job *job = (lm_image_job*)data;
+	int w = job->w, h = job->h, c = job->c;
+	size_t stride = (size_t)w * c;
+	for (int y = (int)job->first; y < (int)job->end; y++)
 	{
+		// clamp the 3x3 window to the image instead of checking every neighbor
+		int y0 = lm_maxi(y - 1, 0), y1 = lm_mini(y + 1, h - 1);
+		float *outRow = job->outImage + y * stride;
 		for (int x = 0; x < w; x++)
 		{
-			float color[4];
-			lm_bool valid = LM_FALSE;
-			for (int i = 0; i < c; i++)
-			{
-				color[i] = image[(y * w + x) * c + i];
-				valid |= color[i] > 0.0f;
-			}
-			if (!valid)
+			int x0 = lm_maxi(x - 1, 0), x1 = lm_mini(x + 1, w - 1);
+			int n = 0;
+#if defined(LM_SIMD4)
+			if (c == 4)
 			{
-				int n = 0;
-				const int dx[] = { -1, 0, 1,  0 };
-				const int dy[] = {  0, 1, 0, -1 };
-				for (int d = 0; d < 4; d++)
+				lm_f4 color = lm_set4(0.0f);
+				for (int cy = y0; cy <= y1; cy++)
 				{
-					int cx = x + dx[d];
-					int cy = y + dy[d];
-					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					const float *row = job->image + cy * stride;
+					for (int cx = x0; cx <= x1; cx++)
 					{
-						float dcolor[4];
-						lm_bool dvalid = LM_FALSE;
-						for (int i = 0; i < c; i++)
-						{
-							dcolor[i] = image[(cy * w + cx) * c + i];
-							dvalid |= dcolor[i] > 0.0f;
-						}
-						if (dvalid)
+						lm_f4 v = lm_load4(row + cx * 4);
+						if (lm_anyPositive4(v))
 						{
-							for (int i = 0; i < c; i++)
-								color[i] += dcolor[i];
+							color = lm_add4(color, v);
 							n++;
 						}
 					}
 				}
-				if (n)
+				lm_store4(outRow + x * 4, n ? lm_div4(color, lm_set4((float)n)) : lm_set4(0.0f));
+				continue;
+			}
+#endif
+			float color[4] = {0};
+			for (int cy = y0; cy <= y1; cy++)
+			{
+				const float *row = job->image + cy * stride;
+				for (int cx = x0; cx <= x1; cx++)
 				{
-					float in = 1.0f / n;
-					for (int i = 0; i < c; i++)
-						color[i] *= in;
+					if (lm_isPixelPositive(row + cx * c, c))
+					{
+						for (int i = 0; i < c; i++)
+							color[i] += row[cx * c + i];
+						n++;
+					}
 				}
 			}
 			for (int i = 0; i < c; i++)
-				outImage[(y * w + x) * c + i] = color[i];
+				outRow[x * c + i] = n ? color[i] / n : 0.0f;
 		}
 	}
 }
@@ -1644,118 +5664,818 @@ void lmImageDilate(const float *image, float *outImage, int w, int h, int c)
 void lmImageSmooth(const float *image, float *outImage, int w, int h, int c)
 {
 	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h; y++)
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, outImage, w, h, c);
+	lm_runImageJobs(lm_imageSmoothJob, jobs, (size_t)h, 1, (size_t)w * c * 9);
+}
+
+typedef struct lm_denoise_params
+{
+	const float *positions, *normals;
+	int step;
+	float colorFactor, positionFactor, normalFactor; // 1 / sigma^2 (0 => unused)
+} lm_denoise_params;
+#define LM_DENOISE_MAX_EXPONENT 30.0f // taps with smaller weights than exp(-30) are dropped instead of accumulating denormals
+
+static void lm_imageDenoiseJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	const lm_denoise_params *params = (const lm_denoise_params*)job->userdata;
+	const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	const float *positions = params->positionFactor > 0.0f ? params->positions : NULL;
+	const float *normals = params->normals;
+	int w = job->w, h = job->h, c = job->c, step = params->step;
+	for (int y = (int)job->first; y < (int)job->end; y++)
 	{
 		for (int x = 0; x < w; x++)
 		{
-			float color[4] = {0};
-			int n = 0;
-			for (int dy = -1; dy <= 1; dy++)
+			size_t index = (size_t)y * w + x;
+			const float *center = job->image + index * c;
+			float *out = job->outImage + index * c;
+			if (!lm_isPixelPositive(center, c))
+			{
+				for (int i = 0; i < c; i++)
+					out[i] = center[i];
+				continue;
+			}
+
+			lm_vec3 p = positions ? lm_v3(positions[index * 3], positions[index * 3 + 1], positions[index * 3 + 2]) : lm_v3(0.0f, 0.0f, 0.0f);
+			lm_vec3 n = normals ? lm_v3(normals[index * 3], normals[index * 3 + 1], normals[index * 3 + 2]) : lm_v3(0.0f, 0.0f, 0.0f);
+			float centerSq = 0.0f;
+			for (int i = 0; i < c; i++)
+				centerSq += center[i] * center[i];
+
+			// gather the populated taps and the negative exponents of their edge stopping weights
+			// (color term: colorFactor * colorDistances / colorNorms)
+			const float *taps[28];
+			float exponents[28], colorDistances[28], colorNorms[28], weights[28];
+			int tapCount = 0;
+			for (int dy = -2; dy <= 2; dy++)
 			{
-				int cy = y + dy;
-				for (int dx = -1; dx <= 1; dx++)
+				int cy = y + dy * step;
+				if (cy < 0 || cy >= h)
+					continue;
+				for (int dx = -2; dx <= 2; dx++)
 				{
-					int cx = x + dx;
-					if (cx >= 0 && cx < w && cy >= 0 && cy < h)
+					int cx = x + dx * step;
+					if (cx < 0 || cx >= w)
+						continue;
+					size_t tapIndex = (size_t)cy * w + cx;
+					const float *tap = job->image + tapIndex * c;
+					float dSq = 0.0f, tapSq = 0.0f;
+#if defined(LM_SIMD4)
+					if (c == 4)
+					{
+						lm_f4 t = lm_load4(tap), d = lm_sub4(t, lm_load4(center));
+						if (!lm_anyPositive4(t))
+							continue;
+						dSq = lm_sum4(lm_mul4(d, d));
+						tapSq = lm_sum4(lm_mul4(t, t));
+					}
+					else
+#endif
 					{
-						lm_bool valid = LM_FALSE;
+						if (!lm_isPixelPositive(tap, c))
+							continue;
 						for (int i = 0; i < c; i++)
-							valid |= image[(cy * w + cx) * c + i] > 0.0f;
-						if (valid)
 						{
-							for (int i = 0; i < c; i++)
-								color[i] += image[(cy * w + cx) * c + i];
-							n++;
+							float d = tap[i] - center[i];
+							dSq += d * d;
+							tapSq += tap[i] * tap[i];
 						}
 					}
+					float e = 0.0f;
+					if (normals && params->normalFactor > 0.0f)
+					{
+						lm_vec3 d = lm_sub3(lm_v3(normals[tapIndex * 3], normals[tapIndex * 3 + 1], normals[tapIndex * 3 + 2]), n);
+						e += params->normalFactor * lm_length3sq(d);
+					}
+					if (positions)
+					{
+						lm_vec3 d = lm_sub3(lm_v3(positions[tapIndex * 3], positions[tapIndex * 3 + 1], positions[tapIndex * 3 + 2]), p);
+						float distance = normals ? lm_dot3(d, n) : 0.0f;
+						e += params->positionFactor * (normals ? distance * distance : lm_length3sq(d));
+					}
+					taps[tapCount] = tap;
+					weights[tapCount] = kernel[dx + 2] * kernel[dy + 2];
+					colorDistances[tapCount] = dSq;
+					colorNorms[tapCount] = centerSq + tapSq;
+					exponents[tapCount++] = e;
 				}
 			}
+
+			int k = 0;
+#if defined(LM_SIMD4)
+			for (int i = tapCount; i < ((tapCount + 3) & ~3); i++)
+			{
+				exponents[i] = weights[i] = colorDistances[i] = 0.0f;
+				colorNorms[i] = 1.0f;
+			}
+			lm_f4 colorFactor = lm_set4(params->colorFactor), maxExponent = lm_set4(LM_DENOISE_MAX_EXPONENT);
+			for (; k < tapCount; k += 4)
+			{
+				lm_f4 e = lm_add4(lm_load4(exponents + k), lm_mul4(colorFactor, lm_div4(lm_load4(colorDistances + k), lm_load4(colorNorms + k))));
+				lm_store4(weights + k, lm_select4(lm_less4(e, maxExponent), lm_mul4(lm_load4(weights + k), lm_expNeg4(lm_min4(e, maxExponent))), lm_set4(0.0f)));
+			}
+#endif
+			for (; k < tapCount; k++)
+			{
+				float e = exponents[k] + params->colorFactor * colorDistances[k] / colorNorms[k];
+				weights[k] = e < LM_DENOISE_MAX_EXPONENT ? weights[k] * expf(-e) : 0.0f;
+			}
+
+			// the pixel itself always contributes, so weightSum > 0
+			float weightSum = 0.0f;
+			for (k = 0; k < tapCount; k++)
+				weightSum += weights[k];
+#if defined(LM_SIMD4)
+			if (c == 4)
+			{
+				lm_f4 color = lm_set4(0.0f);
+				for (k = 0; k < tapCount; k++)
+					color = lm_add4(color, lm_mul4(lm_load4(taps[k]), lm_set4(weights[k])));
+				lm_store4(out, lm_div4(color, lm_set4(weightSum)));
+				continue;
+			}
+#endif
+			float color[4] = {0};
+			for (k = 0; k < tapCount; k++)
+				for (int i = 0; i < c; i++)
+					color[i] += taps[k][i] * weights[k];
 			for (int i = 0; i < c; i++)
-				outImage[(y * w + x) * c + i] = n ? color[i] / n : 0.0f;
+				out[i] = color[i] / weightSum;
 		}
 	}
 }
 
-void lmImageDownsample(const float *image, float *outImage, int w, int h, int c)
+void lmImageDenoise(const float *image, float *outImage, int w, int h, int c,
+	const float *positions, const float *normals, int iterations, float colorSigma, float positionSigma, float normalSigma)
 {
-	assert(c > 0 && c <= 4);
-	for (int y = 0; y < h / 2; y++)
+	assert(c > 0 && c <= 4 && iterations >= 0);
+	float *temp = iterations > 1 ? (float*)LM_CALLOC((size_t)w * h * c, sizeof(float)) : NULL;
+	const float *src = image;
+	if (iterations == 0)
+		memcpy(outImage, image, (size_t)w * h * c * sizeof(float));
+	for (int i = 0; i < iterations; i++)
+	{
+		// ping-pong so that the last iteration writes to outImage
+		float *dst = (iterations - i) % 2 ? outImage : temp;
+		lm_denoise_params params;
+		params.positions = positions;
+		params.normals = normals;
+		params.step = 1 << i;
+		params.colorFactor = colorSigma > 0.0f ? (float)(2 << i) / (colorSigma * colorSigma) : 0.0f; // 2 / (|a|^2 + |b|^2) = 1 / rms(|a|, |b|)^2
+		params.positionFactor = positionSigma > 0.0f ? 1.0f / (positionSigma * positionSigma) : 0.0f;
+		params.normalFactor = normalSigma > 0.0f ? 1.0f / (normalSigma * normalSigma) : 0.0f;
+		lm_image_job jobs[LM_MAX_THREADS];
+		jobs[0] = lm_imageJob(src, dst, w, h, c);
+		jobs[0].userdata = &params;
+		lm_runImageJobs(lm_imageDenoiseJob, jobs, (size_t)h, 1, (size_t)w * c * 25);
+		src = dst;
+	}
+	LM_FREE(temp);
+}
+
+static void lm_imageDownsampleJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	int w = job->w, c = job->c;
+	size_t stride = (size_t)w * c;
+	for (int y = (int)job->first; y < (int)job->end; y++)
 	{
-		for (int x = 0; x < w / 2; x++)
+		const float *row0 = job->image + 2 * y * stride;
+		const float *row1 = row0 + stride;
+		float *outRow = job->outImage + (size_t)y * (w / 2) * c;
+		int x = 0;
+#if defined(LM_SIMD4)
+		if (c == 4)
+		{
+			lm_f4 zero = lm_set4(0.0f);
+			for (; x < w / 2; x++)
+			{
+				lm_f4 p00 = lm_load4(row0 + x * 8), p01 = lm_load4(row0 + x * 8 + 4);
+				lm_f4 p10 = lm_load4(row1 + x * 8), p11 = lm_load4(row1 + x * 8 + 4);
+				int n = lm_anyNonZero4(p00) + lm_anyNonZero4(p01) + lm_anyNonZero4(p10) + lm_anyNonZero4(p11);
+				lm_f4 sums = lm_add4(zero, lm_add4(lm_add4(lm_add4(p00, p01), p10), p11)); // same order of operations as below
+				lm_store4(outRow + x * 4, n ? lm_div4(sums, lm_set4((float)n)) : zero);
+			}
+		}
+#endif
+		for (; x < w / 2; x++)
 		{
-			int p0 = 2 * (y * w + x) * c;
-			int p1 = p0 + w * c;
+			const float *p0 = row0 + 2 * x * c;
+			const float *p1 = row1 + 2 * x * c;
 			int valid[2][2] = {0};
 			float sums[4] = {0};
 			for (int i = 0; i < c; i++)
 			{
-				valid[0][0] |= image[p0     + i] != 0.0f ? 1 : 0;
-				valid[0][1] |= image[p0 + c + i] != 0.0f ? 1 : 0;
-				valid[1][0] |= image[p1     + i] != 0.0f ? 1 : 0;
-				valid[1][1] |= image[p1 + c + i] != 0.0f ? 1 : 0;
-				sums[i] += image[p0 + i] + image[p0 + c + i] + image[p1 + i] + image[p1 + c + i];
+				valid[0][0] |= p0[i    ] != 0.0f ? 1 : 0;
+				valid[0][1] |= p0[i + c] != 0.0f ? 1 : 0;
+				valid[1][0] |= p1[i    ] != 0.0f ? 1 : 0;
+				valid[1][1] |= p1[i + c] != 0.0f ? 1 : 0;
+				sums[i] += p0[i] + p0[i + c] + p1[i] + p1[i + c];
 			}
 			int n = valid[0][0] + valid[0][1] + valid[1][0] + valid[1][1];
-			int p = (y * w / 2 + x) * c;
 			for (int i = 0; i < c; i++)
-				outImage[p + i] = n ? sums[i] / n : 0.0f;
+				outRow[x * c + i] = n ? sums[i] / n : 0.0f;
 		}
 	}
 }
 
+void lmImageDownsample(const float *image, float *outImage, int w, int h, int c)
+{
+	assert(c > 0 && c <= 4);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, outImage, w, h, c);
+	lm_runImageJobs(lm_imageDownsampleJob, jobs, (size_t)(h / 2), 1, (size_t)w * c * 2);
+}
+
+static void lm_imageFtoUBJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	const float *image = job->image;
+	unsigned char *outImage = job->outImageUB;
+	float scale = job->value;
+	size_t i = job->first;
+#if defined(LM_SIMD4)
+	lm_f4 s = lm_set4(scale), zero = lm_set4(0.0f), top = lm_set4(255.0f);
+	for (; i + 16 <= job->end; i += 16)
+	{
+		lm_f4 v[4];
+		for (int k = 0; k < 4; k++)
+			v[k] = lm_min4(lm_max4(lm_mul4(lm_load4(image + i + k * 4), s), zero), top); // same order of operations as below
+#if defined(LM_SSE2)
+		__m128i b0 = _mm_packs_epi32(_mm_cvttps_epi32(v[0]), _mm_cvttps_epi32(v[1]));
+		__m128i b1 = _mm_packs_epi32(_mm_cvttps_epi32(v[2]), _mm_cvttps_epi32(v[3]));
+		_mm_storeu_si128((__m128i*)(outImage + i), _mm_packus_epi16(b0, b1));
+#elif defined(LM_NEON)
+		uint16x8_t b0 = vcombine_u16(vmovn_u32(vcvtq_u32_f32(v[0])), vmovn_u32(vcvtq_u32_f32(v[1])));
+		uint16x8_t b1 = vcombine_u16(vmovn_u32(vcvtq_u32_f32(v[2])), vmovn_u32(vcvtq_u32_f32(v[3])));
+		vst1q_u8(outImage + i, vcombine_u8(vmovn_u16(b0), vmovn_u16(b1)));
+#endif
+	}
+#endif
+	for (; i < job->end; i++)
+		outImage[i] = (unsigned char)lm_minf(lm_maxf(image[i] * scale, 0.0f), 255.0f);
+}
+
 void lmImageFtoUB(const float *image, unsigned char *outImage, int w, int h, int c, float max)
 {
 	assert(c > 0);
 	float scale = 255.0f / (max != 0.0f ? max : lmImageMax(image, w, h, c, LM_ALL_CHANNELS));
-	for (int i = 0; i < w * h * c; i++)
-		outImage[i] = (unsigned char)lm_minf(lm_maxf(image[i] * scale, 0.0f), 255.0f);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(image, NULL, w, h, c);
+	jobs[0].outImageUB = outImage;
+	jobs[0].m = LM_ALL_CHANNELS;
+	jobs[0].value = scale;
+	lm_runImageJobs(lm_imageFtoUBJob, jobs, (size_t)w * h * c, 16, 1);
+}
+
+#define LM_IMAGE_TILE_SIZE 128 // pixels per side of the lmImageProcess tiles (without their borders). a multiple of LM_TILE_SIZE.
+
+typedef struct lm_image_pipeline
+{
+	const lm_image_op *ops;
+	int opCount;
+	int border;                   // reach of all operations together
+	const void *image;            // linear images
+	lm_type type;
+	void *outImage;
+	lm_type outType;              // LM_UNSIGNED_BYTE: the result of a final LM_IMAGE_OP_FTOUB
+	const lm_mapped_image *mappedImage; // instead of the linear images
+	lm_mapped_image *mappedOutImage;
+	const lm_sparse_image *sparseImage; // instead of the linear images
+	lm_sparse_image *sparseOutImage;
+	lm_bool keepsZero;            // all operations turn zero texels into zero texels
+} lm_image_pipeline;
+
+static int lm_imageOpReach(const lm_image_op *op)
+{
+	switch (op->type)
+	{
+		case LM_IMAGE_OP_DILATE: case LM_IMAGE_OP_SMOOTH: return 1;
+		case LM_IMAGE_OP_DILATE_N: return (int)op->value;
+		default: return 0;
+	}
 }
 
-// TGA output helpers
-static void lm_swapRandBub(unsigned char *image, int w, int h, int c)
+// keeps only the x0..x1, y0..y1 part of a w x h tile (rows are moved towards the start, so the moves never overwrite unmoved rows)
+static void lm_cropTile(float *tile, int w, int c, int x0, int y0, int x1, int y1)
 {
-	assert(c >= 3);
-	for (int i = 0; i < w * h * c; i += c)
-		LM_SWAP(unsigned char, image[i], image[i + 2]);
+	for (int y = y0; y < y1; y++)
+		memmove(tile + (size_t)(y - y0) * (x1 - x0) * c, tile + ((size_t)y * w + x0) * c, (size_t)(x1 - x0) * c * sizeof(float));
 }
 
-lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w, int h, int c)
+static void lm_imageProcessJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	const lm_image_pipeline *pipeline = (const lm_image_pipeline*)job->userdata;
+	int w = job->w, h = job->h, c = job->c;
+	int maxSize = LM_IMAGE_TILE_SIZE + 2 * pipeline->border;
+	float *buffers[2];
+	buffers[0] = (float*)LM_CALLOC((size_t)maxSize * maxSize * c, sizeof(float));
+	buffers[1] = (float*)LM_CALLOC((size_t)maxSize * maxSize * c, sizeof(float));
+	int *nearest = (int*)LM_CALLOC((size_t)maxSize * maxSize, sizeof(int));
+	int tilesX = (w + LM_IMAGE_TILE_SIZE - 1) / LM_IMAGE_TILE_SIZE;
+	for (size_t tile = job->first; tile < job->end; tile++)
+	{
+		// the results near the buffer borders are wrong (neighbors are missing) unless they are image borders,
+		// but every operation only spreads the wrong results by its reach, so they never get into the tile itself.
+		// every operation only computes the part that the remaining operations still need.
+		int x0 = (int)(tile % tilesX) * LM_IMAGE_TILE_SIZE, x1 = lm_mini(x0 + LM_IMAGE_TILE_SIZE, w);
+		int y0 = (int)(tile / tilesX) * LM_IMAGE_TILE_SIZE, y1 = lm_mini(y0 + LM_IMAGE_TILE_SIZE, h);
+		int reach = pipeline->border;
+		int bx0 = lm_maxi(x0 - reach, 0), bx1 = lm_mini(x1 + reach, w);
+		int by0 = lm_maxi(y0 - reach, 0), by1 = lm_mini(y1 + reach, h);
+		float *src = buffers[0], *dst = buffers[1];
+		if (pipeline->sparseOutImage) // every sparse tile of the output belongs to exactly one job tile. they are reallocated for non-zero results only.
+			lm_clearSparseArea(pipeline->sparseOutImage, x0, y0, x1, y1);
+		if (pipeline->sparseImage && pipeline->keepsZero && lm_isEmptySparseArea(pipeline->sparseImage, bx0, by0, bx1, by1))
+			continue; // only zeros in the reach of the tile
+		if (pipeline->mappedImage)
+			lm_mappedImageCopy(pipeline->mappedImage, bx0, by0, bx1 - bx0, by1 - by0, src, (size_t)(bx1 - bx0) * c, LM_FALSE);
+		else if (pipeline->sparseImage)
+			lm_sparseImageCopy(pipeline->sparseImage, bx0, by0, bx1 - bx0, by1 - by0, src, (size_t)(bx1 - bx0) * c, LM_FALSE);
+		else for (int y = by0; y < by1; y++)
+			lm_loadTexels(pipeline->image, pipeline->type, c, (size_t)y * w + bx0, bx1 - bx0, src + (size_t)(y - by0) * (bx1 - bx0) * c);
+
+		for (int i = 0; i < pipeline->opCount; i++)
+		{
+			const lm_image_op *op = pipeline->ops + i;
+			reach -= lm_imageOpReach(op);
+			int nx0 = lm_maxi(x0 - reach, 0), nx1 = lm_mini(x1 + reach, w); // still needed after this operation
+			int ny0 = lm_maxi(y0 - reach, 0), ny1 = lm_mini(y1 + reach, h);
+			int bw = bx1 - bx0, bh = by1 - by0;
+			lm_image_job tileJob = lm_imageJob(src, dst, bw, bh, c);
+			tileJob.m = op->m ? op->m : LM_ALL_CHANNELS;
+			tileJob.value = op->value;
+			switch (op->type)
+			{
+				case LM_IMAGE_OP_ADD:   tileJob.outImage = src; tileJob.end = (size_t)bw * bh * c; lm_imageAddJob(&tileJob);   continue;
+				case LM_IMAGE_OP_SCALE: tileJob.outImage = src; tileJob.end = (size_t)bw * bh * c; lm_imageScaleJob(&tileJob); continue;
+				case LM_IMAGE_OP_POWER: tileJob.outImage = src; tileJob.end = (size_t)bw * bh * c; lm_imagePowerJob(&tileJob); continue;
+				case LM_IMAGE_OP_FTOUB: continue; // written with the output below
+				case LM_IMAGE_OP_DILATE: tileJob.first = ny0 - by0; tileJob.end = ny1 - by0; lm_imageDilateJob(&tileJob); break;
+				case LM_IMAGE_OP_SMOOTH: tileJob.first = ny0 - by0; tileJob.end = ny1 - by0; lm_imageSmoothJob(&tileJob); break;
+				case LM_IMAGE_OP_DILATE_N:
+					tileJob.value = (float)(int)op->value; // same as the int radius of lmImageDilateN
+					tileJob.userdata = nearest;
+					tileJob.end = bh;
+					lm_imageDilateNRowsJob(&tileJob);
+					tileJob.first = nx0 - bx0;
+					tileJob.end = nx1 - bx0;
+					lm_imageDilateNColumnsJob(&tileJob);
+					break;
+			}
+			lm_cropTile(dst, bw, c, nx0 - bx0, ny0 - by0, nx1 - bx0, ny1 - by0);
+			bx0 = nx0; bx1 = nx1; by0 = ny0; by1 = ny1;
+			LM_SWAP(float*, src, dst);
+		}
+
+		if (pipeline->mappedOutImage || pipeline->sparseOutImage)
+		{
+			float *core = src + ((size_t)(y0 - by0) * (bx1 - bx0) + (x0 - bx0)) * c;
+			if (pipeline->mappedOutImage)
+				lm_mappedImageCopy(pipeline->mappedOutImage, x0, y0, x1 - x0, y1 - y0, core, (size_t)(bx1 - bx0) * c, LM_TRUE);
+			else
+				lm_sparseImageCopy(pipeline->sparseOutImage, x0, y0, x1 - x0, y1 - y0, core, (size_t)(bx1 - bx0) * c, LM_TRUE);
+			continue;
+		}
+		for (int y = y0; y < y1; y++)
+		{
+			const float *row = src + ((size_t)(y - by0) * (bx1 - bx0) + (x0 - bx0)) * c;
+			size_t p = (size_t)y * w + x0;
+			if (pipeline->outType == LM_UNSIGNED_BYTE)
+			{
+				lm_image_job rowJob = lm_imageJob(row, NULL, x1 - x0, 1, c);
+				rowJob.outImageUB = (unsigned char*)pipeline->outImage + p * c;
+				rowJob.m = LM_ALL_CHANNELS;
+				rowJob.value = 255.0f / pipeline->ops[pipeline->opCount - 1].value;
+				rowJob.end = (size_t)(x1 - x0) * c;
+				lm_imageFtoUBJob(&rowJob);
+			}
+			else
+				lm_storeTexels(row, pipeline->outImage, pipeline->outType, c, p, x1 - x0);
+		}
+	}
+	LM_FREE(nearest);
+	LM_FREE(buffers[1]);
+	LM_FREE(buffers[0]);
+}
+
+// pipeline: the ops and the images
+static void lm_imageProcess(lm_image_pipeline *pipeline, int w, int h, int c)
+{
+	const lm_image_op *ops = pipeline->ops;
+	int opCount = pipeline->opCount;
+	assert(c > 0 && c <= 4 && opCount >= 0);
+	float zero[4] = { 0 };
+	pipeline->border = 0;
+	for (int i = 0; i < opCount; i++)
+	{
+		assert(ops[i].type >= LM_IMAGE_OP_ADD && ops[i].type <= LM_IMAGE_OP_FTOUB);
+		assert(ops[i].type != LM_IMAGE_OP_DILATE_N || ops[i].value >= 0.0f);
+		assert(ops[i].type != LM_IMAGE_OP_FTOUB || (i == opCount - 1 && ops[i].value > 0.0f && pipeline->outType == LM_UNSIGNED_BYTE));
+		pipeline->border += lm_imageOpReach(ops + i);
+
+		// dilation and smoothing keep zero images. the others are applied to a zero texel.
+		lm_image_job zeroJob = lm_imageJob(zero, zero, 1, 1, c);
+		zeroJob.m = ops[i].m ? ops[i].m : LM_ALL_CHANNELS;
+		zeroJob.value = ops[i].value;
+		zeroJob.end = c;
+		if (ops[i].type == LM_IMAGE_OP_ADD)   lm_imageAddJob(&zeroJob);
+		if (ops[i].type == LM_IMAGE_OP_SCALE) lm_imageScaleJob(&zeroJob);
+		if (ops[i].type == LM_IMAGE_OP_POWER) lm_imagePowerJob(&zeroJob);
+	}
+	pipeline->keepsZero = zero[0] == 0.0f && zero[1] == 0.0f && zero[2] == 0.0f && zero[3] == 0.0f;
+	assert(pipeline->outType != LM_UNSIGNED_BYTE || (opCount && ops[opCount - 1].type == LM_IMAGE_OP_FTOUB));
+
+	int tileCount = ((w + LM_IMAGE_TILE_SIZE - 1) / LM_IMAGE_TILE_SIZE) * ((h + LM_IMAGE_TILE_SIZE - 1) / LM_IMAGE_TILE_SIZE);
+	lm_image_job jobs[LM_MAX_THREADS];
+	jobs[0] = lm_imageJob(NULL, NULL, w, h, c);
+	jobs[0].userdata = pipeline;
+	lm_runImageJobs(lm_imageProcessJob, jobs, (size_t)tileCount, 1, (size_t)LM_IMAGE_TILE_SIZE * LM_IMAGE_TILE_SIZE * c * lm_maxi(opCount, 1));
+}
+
+void lmImageProcess(const float *image, float *outImage, unsigned char *outImageUB, int w, int h, int c, const lm_image_op *ops, int opCount)
+{
+	lm_bool toUB = opCount && ops[opCount - 1].type == LM_IMAGE_OP_FTOUB;
+	assert(toUB || outImage);
+	lmImageProcessEx(image, LM_FLOAT, toUB ? (void*)outImageUB : (void*)outImage, toUB ? LM_UNSIGNED_BYTE : LM_FLOAT, w, h, c, ops, opCount);
+}
+
+void lmImageProcessEx(const void *image, lm_type type, void *outImage, lm_type outType, int w, int h, int c, const lm_image_op *ops, int opCount)
+{
+	lm_assertTexelType(type, c);
+	if (outType != LM_UNSIGNED_BYTE)
+		lm_assertTexelType(outType, c);
+	lm_image_pipeline pipeline;
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.ops = ops;
+	pipeline.opCount = opCount;
+	pipeline.image = image;
+	pipeline.type = type;
+	pipeline.outImage = outImage;
+	pipeline.outType = outType;
+	lm_imageProcess(&pipeline, w, h, c);
+}
+
+void lmImageProcessMapped(const lm_mapped_image *image, lm_mapped_image *outImage, const lm_image_op *ops, int opCount)
+{
+	assert(image != outImage && image->w == outImage->w && image->h == outImage->h && image->c == outImage->c);
+	lm_image_pipeline pipeline;
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.ops = ops;
+	pipeline.opCount = opCount;
+	pipeline.mappedImage = image;
+	pipeline.mappedOutImage = outImage;
+	lm_imageProcess(&pipeline, image->w, image->h, image->c); // asserts on LM_IMAGE_OP_FTOUB
+}
+
+void lmImageProcessSparse(const lm_sparse_image *image, lm_sparse_image *outImage, const lm_image_op *ops, int opCount)
+{
+	assert(image != outImage && image->w == outImage->w && image->h == outImage->h && image->c == outImage->c);
+	lm_image_pipeline pipeline;
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.ops = ops;
+	pipeline.opCount = opCount;
+	pipeline.sparseImage = image;
+	pipeline.sparseOutImage = outImage;
+	lm_imageProcess(&pipeline, image->w, image->h, image->c); // asserts on LM_IMAGE_OP_FTOUB
+}
+
+// image file output helpers
+#define LM_IMAGE_WRITE_BLOCK (1 << 22) // bytes of encoded rows that are converted together before they are written
+
+typedef struct lm_image_writer lm_image_writer;
+typedef size_t (*lm_encode_row_func)(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out);
+struct lm_image_writer
+{
+	const float *image;
+	const unsigned char *imageUB;
+	int w, h, c;
+	float scale;                  // float to 8bit scale
+	lm_bool flipY;                // write the top row first
+	lm_encode_row_func encodeRow; // returns the encoded size of row y
+	size_t rowBytes;              // maximum encoded size of a row
+	size_t scratchBytes;
+
+	// current block
+	int firstRow;
+	unsigned char *block;
+	size_t *blockRowBytes;
+};
+
+static void lm_imageEncodeRowsJob(void *data)
+{
+	lm_image_job *job = (lm_image_job*)data;
+	const lm_image_writer *writer = (const lm_image_writer*)job->userdata;
+	unsigned char *scratch = (unsigned char*)LM_CALLOC(writer->scratchBytes, 1);
+	for (size_t i = job->first; i < job->end; i++)
+	{
+		int row = writer->firstRow + (int)i;
+		int y = writer->flipY ? writer->h - 1 - row : row;
+		writer->blockRowBytes[i] = writer->encodeRow(writer, y, scratch, writer->block + i * writer->rowBytes);
+	}
+	LM_FREE(scratch);
+}
+
+static FILE *lm_openFileForWriting(const char *filename)
+{
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+	FILE *file;
+	if (fopen_s(&file, filename, "wb") != 0) return NULL;
+	return file;
+#else
+	return fopen(filename, "wb");
+#endif
+}
+
+static lm_bool lm_writeImage(const char *filename, const void *header, size_t headerBytes, lm_image_writer *writer)
+{
+	FILE *file = lm_openFileForWriting(filename);
+	if (!file) return LM_FALSE;
+	lm_bool success = !headerBytes || fwrite(header, 1, headerBytes, file) == headerBytes;
+
+	size_t blockRows = LM_IMAGE_WRITE_BLOCK / (writer->rowBytes ? writer->rowBytes : 1);
+	blockRows = blockRows < 1 ? 1 : blockRows > (size_t)writer->h ? (size_t)writer->h : blockRows;
+	writer->block = (unsigned char*)LM_CALLOC((size_t)blockRows * writer->rowBytes, 1);
+	writer->blockRowBytes = (size_t*)LM_CALLOC(blockRows, sizeof(size_t));
+	for (writer->firstRow = 0; success && writer->firstRow < writer->h; writer->firstRow += (int)blockRows)
+	{
+		int rows = lm_mini((int)blockRows, writer->h - writer->firstRow);
+		lm_image_job jobs[LM_MAX_THREADS];
+		jobs[0] = lm_imageJob(writer->image, NULL, writer->w, writer->h, writer->c);
+		jobs[0].userdata = writer;
+		lm_runImageJobs(lm_imageEncodeRowsJob, jobs, (size_t)rows, 1, (size_t)writer->w * writer->c);
+		for (int i = 0; success && i < rows; i++)
+			success = fwrite(writer->block + (size_t)i * writer->rowBytes, 1, writer->blockRowBytes[i], file) == writer->blockRowBytes[i];
+	}
+	LM_FREE(writer->blockRowBytes);
+	LM_FREE(writer->block);
+	return fclose(file) == 0 && success;
+}
+
+// TGA
+static const unsigned char *lm_getRowUB(const lm_image_writer *writer, int y, unsigned char *scratch)
+{
+	size_t n = (size_t)writer->w * writer->c;
+	if (writer->imageUB)
+		return writer->imageUB + (size_t)y * n;
+	lm_image_job rowJob = lm_imageJob(writer->image + (size_t)y * n, NULL, writer->w, 1, writer->c);
+	rowJob.outImageUB = scratch;
+	rowJob.m = LM_ALL_CHANNELS;
+	rowJob.value = writer->scale;
+	rowJob.end = n;
+	lm_imageFtoUBJob(&rowJob); // same results as lmImageFtoUB
+	return scratch;
+}
+
+static void lm_storePixelBGR(unsigned char *out, const unsigned char *p, int c)
+{
+	out[0] = p[c >= 3 ? 2 : 0];
+	for (int i = 1; i < c; i++)
+		out[i] = p[i == 2 ? 0 : i];
+}
+
+static size_t lm_encodeRowTGA(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out)
+{
+	int w = writer->w, c = writer->c;
+	const unsigned char *row = lm_getRowUB(writer, y, scratch);
+	for (int x = 0; x < w; x++)
+		lm_storePixelBGR(out + x * c, row + x * c, c);
+	return (size_t)w * c;
+}
+
+static size_t lm_encodeRowTGARLE(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out)
+{
+	int w = writer->w, c = writer->c;
+	const unsigned char *row = lm_getRowUB(writer, y, scratch);
+	size_t n = 0;
+	for (int x = 0; x < w;)
+	{
+		int run = 1;
+		while (x + run < w && run < 128 && !memcmp(row + x * c, row + (x + run) * c, c))
+			run++;
+		if (run > 1)
+		{
+			out[n++] = (unsigned char)(0x80 | (run - 1));
+			lm_storePixelBGR(out + n, row + x * c, c);
+			n += c;
+			x += run;
+			continue;
+		}
+		// raw packet until the next run starts
+		int count = 1;
+		while (x + count < w && count < 128 && (x + count + 1 >= w || memcmp(row + (x + count) * c, row + (x + count + 1) * c, c)))
+			count++;
+		out[n++] = (unsigned char)(count - 1);
+		for (int i = 0; i < count; i++, x++, n += c)
+			lm_storePixelBGR(out + n, row + x * c, c);
+	}
+	return n;
+}
+
+static lm_bool lm_saveTGA(const char *filename, const float *image, const unsigned char *imageUB, int w, int h, int c, float max, lm_bool rle)
 {
 	assert(c == 1 || c == 3 || c == 4);
 	lm_bool isGreyscale = c == 1;
 	lm_bool hasAlpha = c == 4;
 	unsigned char header[18] = {
-		0, 0, (unsigned char)(isGreyscale ? 3 : 2), 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, (unsigned char)((isGreyscale ? 3 : 2) | (rle ? 8 : 0)), 0, 0, 0, 0, 0, 0, 0, 0, 0,
 		(unsigned char)(w & 0xff), (unsigned char)((w >> 8) & 0xff), (unsigned char)(h & 0xff), (unsigned char)((h >> 8) & 0xff),
 		(unsigned char)(8 * c), (unsigned char)(hasAlpha ? 8 : 0)
 	};
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-	FILE *file;
-	if (fopen_s(&file, filename, "wb") != 0) return LM_FALSE;
-#else
-	FILE *file = fopen(filename, "wb");
-	if (!file) return LM_FALSE;
-#endif
-	fwrite(header, 1, sizeof(header), file);
-
-	// we make sure to swap it back! trust me. :)
-	if (!isGreyscale)
-		lm_swapRandBub((unsigned char*)image, w, h, c);
-	fwrite(image, 1, w * h * c , file);
-	if (!isGreyscale)
-		lm_swapRandBub((unsigned char*)image, w, h, c);
+	lm_image_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.image = image;
+	writer.imageUB = imageUB;
+	writer.w = w; writer.h = h; writer.c = c;
+	if (image)
+		writer.scale = 255.0f / (max != 0.0f ? max : lmImageMax(image, w, h, c, LM_ALL_CHANNELS));
+	writer.encodeRow = rle ? lm_encodeRowTGARLE : lm_encodeRowTGA;
+	writer.rowBytes = (size_t)w * (c + 1); // worst case for RLE: alternating raw pixels and runs of two
+	writer.scratchBytes = image ? (size_t)w * c : 1;
+	return lm_writeImage(filename, header, sizeof(header), &writer);
+}
 
-	fclose(file);
-	return LM_TRUE;
+lm_bool lmImageSaveTGAub(const char *filename, const unsigned char *image, int w, int h, int c)
+{
+	return lm_saveTGA(filename, NULL, image, w, h, c, 0.0f, LM_FALSE);
 }
 
 lm_bool lmImageSaveTGAf(const char *filename, const float *image, int w, int h, int c, float max)
 {
-	unsigned char *temp = (unsigned char*)LM_CALLOC(w * h * c, sizeof(unsigned char));
-	lmImageFtoUB(image, temp, w, h, c, max);
-	lm_bool success = lmImageSaveTGAub(filename, temp, w, h, c);
-	LM_FREE(temp);
-	return success;
+	return lm_saveTGA(filename, image, NULL, w, h, c, max, LM_FALSE);
+}
+
+lm_bool lmImageSaveTGAubRLE(const char *filename, const unsigned char *image, int w, int h, int c)
+{
+	return lm_saveTGA(filename, NULL, image, w, h, c, 0.0f, LM_TRUE);
+}
+
+lm_bool lmImageSaveTGAfRLE(const char *filename, const float *image, int w, int h, int c, float max)
+{
+	return lm_saveTGA(filename, image, NULL, w, h, c, max, LM_TRUE);
+}
+
+// PFM
+static void lm_storeLittleEndian32(unsigned char *out, float f)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	out[0] = (unsigned char)bits; out[1] = (unsigned char)(bits >> 8); out[2] = (unsigned char)(bits >> 16); out[3] = (unsigned char)(bits >> 24);
+}
+
+static size_t lm_encodeRowPFM(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out)
+{
+	(void)scratch;
+	int w = writer->w, c = writer->c, oc = c == 1 ? 1 : 3;
+	const float *row = writer->image + (size_t)y * w * c;
+	for (int x = 0; x < w; x++)
+		for (int i = 0; i < oc; i++)
+			lm_storeLittleEndian32(out + (x * oc + i) * 4, row[x * c + i]);
+	return (size_t)w * oc * 4;
+}
+
+lm_bool lmImageSavePFM(const char *filename, const float *image, int w, int h, int c)
+{
+	assert(c == 1 || c >= 3);
+	char header[64];
+	int headerBytes = snprintf(header, sizeof(header), "%s\n%d %d\n-1.0\n", c == 1 ? "Pf" : "PF", w, h); // negative scale: little endian
+	lm_image_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.image = image;
+	writer.w = w; writer.h = h; writer.c = c;
+	writer.encodeRow = lm_encodeRowPFM;
+	writer.rowBytes = (size_t)w * (c == 1 ? 1 : 3) * 4;
+	writer.scratchBytes = 1;
+	return lm_writeImage(filename, header, headerBytes, &writer);
+}
+
+// Radiance HDR
+static void lm_floatToRGBE(unsigned char *rgbe, float r, float g, float b)
+{
+	float v = lm_maxf(lm_maxf(r, g), b);
+	if (!(v >= 1e-32f)) // also catches NaNs
+	{
+		rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+		return;
+	}
+	int e;
+	float scale = frexpf(v, &e) * 256.0f / v;
+	rgbe[0] = (unsigned char)(lm_maxf(r, 0.0f) * scale);
+	rgbe[1] = (unsigned char)(lm_maxf(g, 0.0f) * scale);
+	rgbe[2] = (unsigned char)(lm_maxf(b, 0.0f) * scale);
+	rgbe[3] = (unsigned char)lm_mini(e + 128, 255);
+}
+
+static size_t lm_encodeRLERGBE(const unsigned char *data, int n, unsigned char *out)
+{
+	// runs of at least 4 equal bytes: 128 + count, byte. everything else: count, bytes
+	size_t o = 0;
+	int x = 0;
+	while (x < n)
+	{
+		int runStart = x, run = 0;
+		while (runStart < n)
+		{
+			run = 1;
+			while (runStart + run < n && run < 127 && data[runStart + run] == data[runStart])
+				run++;
+			if (run >= 4)
+				break;
+			runStart += run;
+		}
+		if (run < 4)
+			runStart = n;
+		while (x < runStart)
+		{
+			int count = lm_mini(runStart - x, 128);
+			out[o++] = (unsigned char)count;
+			memcpy(out + o, data + x, count);
+			o += count;
+			x += count;
+		}
+		if (runStart < n)
+		{
+			out[o++] = (unsigned char)(128 + run);
+			out[o++] = data[runStart];
+			x = runStart + run;
+		}
+	}
+	return o;
+}
+
+static size_t lm_encodeRowHDR(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out)
+{
+	int w = writer->w, c = writer->c;
+	const float *row = writer->image + (size_t)y * w * c;
+	lm_bool rle = w >= 8 && w < 32768; // the run length encoding can't describe other widths
+	unsigned char *rgbe = rle ? scratch : out;
+	for (int x = 0; x < w; x++)
+	{
+		const float *p = row + x * c;
+		lm_floatToRGBE(rgbe + x * 4, p[0], p[c == 1 ? 0 : 1], p[c == 1 ? 0 : 2]);
+	}
+	if (!rle)
+		return (size_t)w * 4;
+
+	// each component is encoded separately
+	unsigned char *component = scratch + (size_t)w * 4;
+	size_t n = 0;
+	out[n++] = 2; out[n++] = 2; out[n++] = (unsigned char)(w >> 8); out[n++] = (unsigned char)(w & 0xff);
+	for (int i = 0; i < 4; i++)
+	{
+		for (int x = 0; x < w; x++)
+			component[x] = rgbe[x * 4 + i];
+		n += lm_encodeRLERGBE(component, w, out + n);
+	}
+	return n;
+}
+
+lm_bool lmImageSaveHDR(const char *filename, const float *image, int w, int h, int c)
+{
+	assert(c == 1 || c >= 3);
+	char header[128];
+	int headerBytes = snprintf(header, sizeof(header), "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", h, w);
+	lm_image_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.image = image;
+	writer.w = w; writer.h = h; writer.c = c;
+	writer.flipY = LM_TRUE; // -Y: top row first
+	writer.encodeRow = lm_encodeRowHDR;
+	writer.rowBytes = 4 + (size_t)w * 4 + 4 * ((w + 127) / 128);
+	writer.scratchBytes = (size_t)w * 5;
+	return lm_writeImage(filename, header, headerBytes, &writer);
+}
+
+// raw half floats
+static size_t lm_encodeRowHalf(const lm_image_writer *writer, int y, unsigned char *scratch, unsigned char *out)
+{
+	(void)scratch;
+	size_t n = (size_t)writer->w * writer->c;
+	const float *row = writer->image + (size_t)y * n;
+	for (size_t i = 0; i < n; i++)
+	{
+		unsigned short half = lm_floatToHalf(row[i]);
+		out[i * 2 + 0] = (unsigned char)half;
+		out[i * 2 + 1] = (unsigned char)(half >> 8);
+	}
+	return n * 2;
+}
+
+lm_bool lmImageSaveHalf(const char *filename, const float *image, int w, int h, int c)
+{
+	assert(c > 0);
+	lm_image_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.image = image;
+	writer.w = w; writer.h = h; writer.c = c;
+	writer.encodeRow = lm_encodeRowHalf;
+	writer.rowBytes = (size_t)w * c * 2;
+	writer.scratchBytes = 1;
+	return lm_writeImage(filename, NULL, 0, &writer);
 }
 
 #endif // LIGHTMAPPER_IMPLEMENTATION